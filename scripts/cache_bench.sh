@@ -0,0 +1,20 @@
+# cache misses per token of the E-step under each document order
+# test:
+# sh cache_bench.sh ../dat/src bench
+dat=$1
+out=$2
+iters=${3:-5}
+
+mkdir -p $out
+for order in id date_entity hilbert; do
+    ../src/capsule --data $dat --out $out/$order --batch --max_iter $iters --min_iter $iters \
+        --doc_order $order --cache_stats > $out/$order.log
+done
+
+# columns of cache_log.dat: iteration, tokens, cache misses, per token,
+# L1d read misses, per token; report the mean over the iterations
+echo "order        misses/token  L1d misses/token"
+for order in id date_entity hilbert; do
+    awk -v order=$order '{ m += $4; l += $6; n++ }
+        END { printf "%-12s %12.3f %17.3f\n", order, m / n, l / n }' $out/$order/cache_log.dat
+done
@@ -52,9 +52,9 @@ do
     #ls $label/sim/$id
     #pwd
     #ls $label/fit/$id
-    (../src/capsule --K $K --batch --a_phi 0.1 --b_phi 0.1 --a_psi 0.1 --b_psi 0.1 --a_theta 0.1 --a_epsilon 0.1 --a_pi 0.1 --a_beta 0.1 --data $label/sim/$id --out $label/fit/$id/capsule --event_dur $dur --seed $seed --conv_freq 1 --min_iter 100 --max_iter 100 --event_decay $shapeF > $label/fit/"$id"capsule.out 2>$label/fit/"$id"capsule.err &)
-    (../src/capsule --K $K --batch --a_phi 0.1 --b_phi 0.1 --a_psi 0.1 --b_psi 0.1 --a_theta 0.1 --a_epsilon 0.1 --a_pi 0.1 --a_beta 0.1 --data $label/sim/$id --out $label/fit/$id/entity_only --event_dur $dur --seed $seed --conv_freq 1 --min_iter 100 --max_iter 100 --event_decay $shapeF --entity_only > $label/fit/"$id"entity.out 2> $label/fit/"$id"entity.err &)
-    (../src/capsule --K $K --batch --a_phi 0.1 --b_phi 0.1 --a_psi 0.1 --b_psi 0.1 --a_theta 0.1 --a_epsilon 0.1 --a_pi 0.1 --a_beta 0.1 --data $label/sim/$id --out $label/fit/$id/event_only --event_dur $dur --seed $seed --conv_freq 1 --min_iter 100 --max_iter 100 --event_decay $shapeF --event_only >$label/fit/"$id"event.out 2>$label/fit/"$id"event.err &)
+    (../src/capsule --K $K --batch --a_phi 0.1 --b_phi 0.1 --a_psi 0.1 --b_psi 0.1 --a_theta 0.1 --a_epsilon 0.1 --a_pi 0.1 --a_beta 0.1 --data $label/sim/$id --out $label/fit/$id/capsule --event_dur $dur --seed $seed --conv_freq 1 --min_iter 100 --max_iter 100 --event_decay $shapeF --save_text > $label/fit/"$id"capsule.out 2>$label/fit/"$id"capsule.err &)
+    (../src/capsule --K $K --batch --a_phi 0.1 --b_phi 0.1 --a_psi 0.1 --b_psi 0.1 --a_theta 0.1 --a_epsilon 0.1 --a_pi 0.1 --a_beta 0.1 --data $label/sim/$id --out $label/fit/$id/entity_only --event_dur $dur --seed $seed --conv_freq 1 --min_iter 100 --max_iter 100 --event_decay $shapeF --save_text --entity_only > $label/fit/"$id"entity.out 2> $label/fit/"$id"entity.err &)
+    (../src/capsule --K $K --batch --a_phi 0.1 --b_phi 0.1 --a_psi 0.1 --b_psi 0.1 --a_theta 0.1 --a_epsilon 0.1 --a_pi 0.1 --a_beta 0.1 --data $label/sim/$id --out $label/fit/$id/event_only --event_dur $dur --seed $seed --conv_freq 1 --min_iter 100 --max_iter 100 --event_decay $shapeF --save_text --event_only >$label/fit/"$id"event.out 2>$label/fit/"$id"event.err &)
 
 
     mkdir $label/fit/$id/baselines
@@ -0,0 +1,28 @@
+# training time until the validation log likelihood reaches a target, with
+# one pass per document and with inner passes over the locals
+# test:
+# sh inner_bench.sh ../dat/src bench -7.5
+dat=$1
+out=$2
+target=$3
+iters=${4:-50}
+
+mkdir -p $out
+for n in 1 3 5; do
+    ../src/capsule --data $dat --out $out/inner$n --batch --max_iter $iters --conv_freq 1 \
+        --converge 0 --inner_iter $n > $out/inner$n.log
+done
+
+# time_log.dat: iteration, seconds; log_likelihood.dat: iteration, ..., the
+# validation log likelihood in column 3
+echo "passes  iterations  seconds to target"
+for n in 1 3 5; do
+    awk -v target=$target -v n=$n '
+        FNR == NR { if ($1 > 0) secs[$1] = $2; next }
+        !done && $3 >= target { done = $1 }
+        END {
+            if (!done) { printf "%-7s %10s %18s\n", n, "-", "not reached"; exit }
+            for (i = 1; i <= done; i++) t += secs[i]
+            printf "%-7s %10d %18.0f\n", n, done, t
+        }' $out/inner$n/time_log.dat $out/inner$n/log_likelihood.dat
+done
@@ -0,0 +1,27 @@
+# the same seed gives the same fit whatever the number of threads: trains
+# with 1, 4 and 16 threads (SVI, so the minibatch draws count too) and
+# compares the final parameters byte for byte
+# test:
+# sh thread_check.sh ../dat/src check
+dat=$1
+out=$2
+iters=${3:-5}
+
+mkdir -p $out
+for n in 1 4 16; do
+    OMP_NUM_THREADS=$n ../src/capsule --data $dat --out $out/threads$n --svi --seed 7 \
+        --max_iter $iters --min_iter $iters > $out/threads$n.log
+done
+
+status=0
+for f in $out/threads1/*-final.*; do
+    name=$(basename $f)
+    for n in 4 16; do
+        if ! cmp -s $f $out/threads$n/$name; then
+            echo "$name differs with $n threads"
+            status=1
+        fi
+    done
+done
+[ $status -eq 0 ] && echo "final parameters identical for 1, 4 and 16 threads"
+exit $status
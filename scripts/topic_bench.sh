@@ -0,0 +1,33 @@
+# time per iteration and held-out fit of the exact and the truncated topic
+# E-step, at K = 100, 500, and 1000
+# test:
+# sh topic_bench.sh ../dat/src bench 10
+dat=$1
+out=$2
+top=${3:-10}
+iters=${4:-5}
+
+mkdir -p $out
+for k in 100 500 1000; do
+    for m in 0 $top; do
+        ../src/capsule --data $dat --out $out/k$k-m$m --batch --max_iter $iters --min_iter $iters \
+            --K $k --top_topics $m > $out/k$k-m$m.log
+    done
+done
+
+# time_log.dat: iteration, seconds; log_likelihood.dat: iteration, ..., the
+# validation log likelihood in column 3; truncation_log.dat: share of tokens
+# on the top topics in column 4
+echo "K     top   s/iteration  validation ll  truncated"
+for k in 100 500 1000; do
+    for m in 0 $top; do
+        dir=$out/k$k-m$m
+        secs=$(awk '$1 > 0 { s += $2; n++ } END { printf "%.1f", s / n }' $dir/time_log.dat)
+        ll=$(tail -n 1 $dir/log_likelihood.dat | cut -f 3)
+        share=-
+        if [ -f $dir/truncation_log.dat ]; then
+            share=$(awk '{ s += $4; n++ } END { printf "%.3f", s / n }' $dir/truncation_log.dat)
+        fi
+        printf "%-5s %-5s %12s %14s %10s\n" $k $m $secs $ll $share
+    done
+done
@@ -0,0 +1,114 @@
+#include "arena.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+Arena::Arena() {
+    base = NULL;
+    capacity = 0;
+    used = 0;
+    spilled = 0;
+    blocks = 0;
+    backing = "heap only";
+}
+
+Arena::~Arena() {
+    if (base)
+        munmap(base, capacity);
+}
+
+// free explicit huge pages and their size, from /proc/meminfo
+static size_t free_huge_pages(size_t& page_bytes) {
+    size_t free_pages = 0;
+    page_bytes = 0;
+    FILE* file = fopen("/proc/meminfo", "r");
+    if (!file)
+        return 0;
+    char name[64];
+    unsigned long value;
+    while (fscanf(file, "%63s %lu%*[^\n]", name, &value) == 2) {
+        if (strcmp(name, "HugePages_Free:") == 0)
+            free_pages = value;
+        else if (strcmp(name, "Hugepagesize:") == 0)
+            page_bytes = (size_t) value << 10;
+    }
+    fclose(file);
+    return free_pages;
+}
+
+bool Arena::reserve(string mode) {
+    if (mode == "off")
+        return true;
+
+    void* region = MAP_FAILED;
+    if (mode == "explicit") {
+        // only as much as the pool can back: touching more would fault
+        size_t page_bytes;
+        capacity = free_huge_pages(page_bytes) * page_bytes;
+        if (capacity > 0)
+            region = mmap(NULL, capacity, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (region == MAP_FAILED) {
+            printf("\tno explicit huge pages available; using transparent ones\n");
+            mode = "transparent";
+        } else {
+            backing = "explicit huge pages";
+        }
+    }
+    if (mode == "transparent") {
+        // address space for all of RAM; only touched pages count
+        capacity = (size_t) sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE);
+        region = mmap(NULL, capacity, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (region == MAP_FAILED) {
+            printf("\tunable to reserve the parameter arena; using the heap\n");
+            capacity = 0;
+            return false;
+        }
+        madvise(region, capacity, MADV_HUGEPAGE);
+        backing = "transparent huge pages";
+    } else if (region == MAP_FAILED) {
+        printf("unknown arena mode %s\n", mode.c_str());
+        capacity = 0;
+        return false;
+    }
+    base = (char*) region;
+    return true;
+}
+
+// n floats, aligned, or NULL if the arena is off or full
+float* Arena::take(size_t n) {
+    size_t bytes = (n * sizeof(float) + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+    if (!base || used + bytes > capacity) {
+        spilled += n * sizeof(float);
+        return NULL;
+    }
+    float* block = (float*) (base + used);
+    used += bytes;
+    blocks++;
+    return block;
+}
+
+fmat Arena::matrix(uword rows, uword cols) {
+    float* block = take(rows * cols);
+    if (!block)
+        return fmat(rows, cols);
+    return fmat(block, rows, cols, false, false);
+}
+
+fvec Arena::column(uword n) {
+    float* block = take(n);
+    if (!block)
+        return fvec(n);
+    return fvec(block, n, false, false);
+}
+
+void Arena::print(FILE* file) {
+    fprintf(file, "\tparameter arena: %.1f MB in %d blocks (%s)", used / 1048576.0,
+        blocks, backing.c_str());
+    if (spilled > 0)
+        fprintf(file, ", %.1f MB on the heap", spilled / 1048576.0);
+    fprintf(file, "\n");
+}
@@ -0,0 +1,51 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <string>
+#include <stdio.h>
+
+#define ARMA_64BIT_WORD
+#include <armadillo>
+
+using namespace std;
+using namespace arma;
+
+// every block starts on a cache line
+#define ARENA_ALIGN 64
+
+// One up-front reservation for the dense parameter and scratch blocks, which
+// Armadillo matrices view (as non-strict auxiliary memory, as for the mapped
+// parameter files) instead of each owning a heap allocation.  The reservation
+// is address space only: pages are committed as the blocks are first touched,
+// backed by transparent huge pages, or by explicit (hugetlbfs) ones up to the
+// free pool.  Blocks that do not fit fall back to the heap.
+//
+// A view keeps its block as long as its size does not change; assignments of
+// the same size write into the block.  Nothing is freed before the arena is.
+class Arena {
+    private:
+        char* base;
+        size_t capacity;
+        size_t used;
+        size_t spilled;     // bytes that did not fit, on the heap
+        int blocks;
+        string backing;
+
+        float* take(size_t n);
+
+    public:
+        Arena();
+        ~Arena();
+
+        // mode: "transparent", "explicit", or "off" (everything on the heap)
+        bool reserve(string mode);
+
+        fmat matrix(uword rows, uword cols);
+        fvec column(uword n);
+
+        size_t bytes_used() const { return used; }
+        size_t bytes_spilled() const { return spilled; }
+        void print(FILE* file);
+};
+
+#endif
@@ -1,119 +1,165 @@
 #include "capsule.h"
-//#include <omp.h>
+#include <algorithm>
+#include <functional>
+#include <string.h>
+#include <linux/perf_event.h>
+#include <omp.h>
 
-Capsule::Capsule(model_settings* model_set, Data* dataset) {
+Capsule::Capsule(model_settings* model_set, Data* dataset, Cluster* processes) {
     settings = model_set;
     data = dataset;
     last_save = "";
 
+    refit_globals = true;
+    cell_entity = -1;
+    cell_date = -1;
+    cell_docs = 0;
+    doc_rest = 0;
+    locals_only = false;
+    freezing = false;
+    inner_passes = 0;
+    tokens_truncated = 0;
+    tokens_exact = 0;
+    focus_date = 0;
+    first_new_entity = 0;
+    if (settings->inner_iter > 1)
+        inner_used.assign(data->doc_count(), min(settings->inner_iter, 255));
+    if (skipping())
+        doc_state.assign(data->doc_count(), DOC_ACTIVE);
+    cluster = processes;
+    partition();
+
+    arena.reserve(settings->arena);
+
     printf("\tallocating parameters\n");
     if (settings->incl_topics) {
         printf("\t\ttopic parameters\n");
         // beta: global topics
         printf("\t\t\tglobal topics (beta)\n");
-        beta = fmat(settings->k, data->term_count());
-        logbeta = fmat(settings->k, data->term_count());
-        a_beta = fmat(settings->k, data->term_count());
+        if (!settings->low_memory) {
+            beta = arena.matrix(settings->k, data->term_count());
+            logbeta = arena.matrix(settings->k, data->term_count());
+        }
+        a_beta = arena.matrix(settings->k, data->term_count());
         // keep track of old a parameters for SVI
-        a_beta_old = fmat(settings->k, data->term_count());
+        a_beta_old = arena.matrix(settings->k, data->term_count());
         a_beta_old.fill(settings->a_beta);
+        if (skipping())
+            a_beta_frozen = arena.matrix(settings->k, data->term_count());
+        beta_total = arena.column(settings->k);
+        beta_sum = arena.column(settings->k);
+        beta_psi_sum = arena.column(settings->k);
+        tile_logbeta = arena.column(settings->k);
+        doc_logtheta = arena.column(settings->k);
+        omega_topics = arena.column(settings->k);
+        cell_theta_rate = arena.column(settings->k);
+        cell_theta_sum = arena.column(settings->k);
+        if (truncating()) {
+            omega_top = arena.column(settings->top_topics);
+            term_max_beta = arena.column(data->term_count());
+        }
+        for (int k = 0; k < settings->k; k++) {
+            topic_id.push_back(k);
+            topic_idle.push_back(0);
+        }
 
         // phi: entity general concerns
         printf("\t\t\tentity general concerns (phi)\n");
-        phi = fmat(settings->k, data->entity_count());
-        logphi = fmat(settings->k, data->entity_count());
-        a_phi = fmat(settings->k, data->entity_count());
-        b_phi = fmat(settings->k, data->entity_count());
+        if (!settings->low_memory) {
+            phi = arena.matrix(settings->k, data->entity_count());
+            logphi = arena.matrix(settings->k, data->entity_count());
+        }
+        a_phi = arena.matrix(settings->k, data->entity_count());
+        b_phi = arena.matrix(settings->k, data->entity_count());
         // keep track of old parameters for SVI
-        a_phi_old = fmat(settings->k, data->entity_count());
+        a_phi_old = arena.matrix(settings->k, data->entity_count());
         a_phi_old.fill(settings->a_phi);
-        b_phi_old = fmat(settings->k, data->entity_count());
+        b_phi_old = arena.matrix(settings->k, data->entity_count());
         b_phi_old.fill(settings->b_phi);
 
         // theta: doc topics
         printf("\t\t\tdoc topics (theta)\n");
-        theta = fmat(settings->k, data->doc_count());
-        logtheta = fmat(settings->k, data->doc_count());
-        a_theta = fmat(settings->k, data->doc_count());
-        b_theta = fmat(settings->k, data->doc_count());
+        if (!settings->low_memory) {
+            theta = arena.matrix(settings->k, data->doc_count());
+            logtheta = arena.matrix(settings->k, data->doc_count());
+        }
+        a_theta = arena.matrix(settings->k, data->doc_count());
+        b_theta = arena.matrix(settings->k, data->doc_count());
     }
 
     if (settings->incl_events) {
         printf("\t\tevent parameters\n");
         // pi: event descriptions
         printf("\t\t\tevent descriptions (pi)\n");
-        pi = fmat(data->date_count(), data->term_count());
-        logpi = fmat(data->date_count(), data->term_count());
-        a_pi = fmat(data->date_count(), data->term_count());
-        // keep track of old a parameters for SVI
-        a_pi_old = fmat(data->date_count(), data->term_count());
-        a_pi_old.fill(settings->a_pi);
+        build_event_descriptions();
+        if (skipping())
+            pi_frozen = arena.column(pi.nnz());
 
         // psi: event strengths
         printf("\t\t\tevent strengths (psi)\n");
-        psi = fvec(data->date_count());
-        logpsi = fvec(data->date_count());
-        a_psi = fvec(data->date_count());
-        b_psi = fvec(data->date_count());
+        psi = arena.column(data->date_count());
+        logpsi = arena.column(data->date_count());
+        a_psi = arena.column(data->date_count());
+        b_psi = arena.column(data->date_count());
         // keep track of old parameters for SVI
-        a_psi_old = fvec(data->date_count());
+        a_psi_old = arena.column(data->date_count());
         a_psi_old.fill(settings->a_psi);
-        b_psi_old = fvec(data->date_count());
+        b_psi_old = arena.column(data->date_count());
         b_psi_old.fill(settings->b_psi);
 
         // epsilon: doc events
         printf("\t\t\tdoc events (epsilon)\n");
-        epsilon = sp_fmat(data->date_count(), data->doc_count());
-        logepsilon = sp_fmat(data->date_count(), data->doc_count());
+        if (!settings->low_memory) {
+            epsilon = sp_fmat(data->date_count(), data->doc_count());
+            logepsilon = sp_fmat(data->date_count(), data->doc_count());
+        }
         a_epsilon = sp_fmat(data->date_count(), data->doc_count());
         b_epsilon = sp_fmat(data->date_count(), data->doc_count());
 
         // decay function, for ease
-        decay = fmat(data->date_count(), data->date_count());
-        logdecay = fmat(data->date_count(), data->date_count());
+        decay = arena.matrix(data->date_count(), data->date_count());
+        logdecay = arena.matrix(data->date_count(), data->date_count());
     }
 
     if (settings->incl_entity) {
         printf("\t\tentity parameters\n");
         // eta: entity descriptions
         printf("\t\t\tentity descriptions (eta)\n");
-        eta = fmat(data->entity_count(), data->term_count());
-        logeta = fmat(data->entity_count(), data->term_count());
-        a_eta = fmat(data->entity_count(), data->term_count());
-        // keep track of old a parameters for SVI
-        a_eta_old = fmat(data->entity_count(), data->term_count());
-        a_eta_old.fill(settings->a_eta);
+        build_entity_descriptions();
+        if (skipping())
+            eta_frozen = arena.column(eta.nnz());
 
         // xi: entity strengths
         printf("\t\t\tentity strengths (xi)\n");
-        xi = fvec(data->entity_count());
-        logxi = fvec(data->entity_count());
-        a_xi = fvec(data->entity_count());
-        b_xi = fvec(data->entity_count());
+        xi = arena.column(data->entity_count());
+        logxi = arena.column(data->entity_count());
+        a_xi = arena.column(data->entity_count());
+        b_xi = arena.column(data->entity_count());
         // keep track of old a parameters for SVI
-        a_xi_old = fvec(data->entity_count());
+        a_xi_old = arena.column(data->entity_count());
         a_xi_old.fill(settings->a_xi);
-        b_xi_old = fvec(data->entity_count());
+        b_xi_old = arena.column(data->entity_count());
         b_xi_old.fill(settings->b_xi);
 
         // zeta: doc entity relvance
         printf("\t\t\tdoc entity relevance (zeta)\n");
-        zeta = fvec(data->doc_count());
-        logzeta = fvec(data->doc_count());
-        a_zeta = fvec(data->doc_count());
-        b_zeta = fvec(data->doc_count());
+        if (!settings->low_memory) {
+            zeta = arena.column(data->doc_count());
+            logzeta = arena.column(data->doc_count());
+        }
+        a_zeta = arena.column(data->doc_count());
+        b_zeta = arena.column(data->doc_count());
     }
 
     printf("\tsetting random seed\n");
-    rand_gen = gsl_rng_alloc(gsl_rng_taus);
-    gsl_rng_set(rand_gen, (long) settings->seed); // init the seed
+    rng = Philox(settings->seed);
 
     printf("\tinitializing parameters\n");
     initialize_parameters();
 
     scale = settings->svi ? float(data->train_doc_count()) / float(settings->sample_size) : 1;
-    ent_scale = fvec(data->entity_count());
-    evt_scale = fvec(data->date_count());
+    ent_scale = arena.column(data->entity_count());
+    evt_scale = arena.column(data->date_count());
     if (settings->svi) {
         for (int e = 0; e < data->entity_count(); e++) {
             ent_scale(e) = float(data->train_doc_count_by_entity(e)) / float(settings->sample_size);
@@ -125,6 +171,154 @@ Capsule::Capsule(model_settings* model_set, Data* dataset) {
         ent_scale.fill(1);
         evt_scale.fill(1);
     }
+    arena.print(stdout);
+
+    if (settings->cache_stats) {
+        bool opened = cache_misses.open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+        opened = l1d_misses.open(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+            (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)) && opened;
+        if (!opened)
+            printf("\tsome hardware cache counters are not available; they log as -1\n");
+    }
+}
+
+// Warm start from the final binary parameters of a previous fit on an
+// earlier version of this corpus: the same document, entity, and date ids,
+// with new dates appended.  They replace the fresh initialization wherever
+// they exist; new terms, entities, dates, and documents keep their initial
+// values.  Loaded means stand in for the expected logs of the local and
+// entity parameters until those are next updated.
+//
+// New documents reach the events of the last event_dur - 1 old dates, so
+// training then refits the documents from focus_date on, whose events are
+// the only ones they share, plus the new entities.  Everything else (beta,
+// and eta, phi, xi of the old entities) stays fixed between refreshes.
+bool Capsule::warm_start(string dir) {
+    string suffix = "-final.bin";
+    int old_docs = data->doc_count();
+    int old_entities = data->entity_count();
+    int old_dates = -1;
+    int n;
+
+    if (settings->incl_topics) {
+        fmat prev_beta, prev_phi, prev_theta;
+        if (!read_binary(dir + "/a_beta" + suffix, prev_beta) ||
+            !read_binary(dir + "/phi" + suffix, prev_phi) ||
+            !read_binary(dir + "/theta" + suffix, prev_theta))
+            return false;
+        if ((int) prev_beta.n_rows != settings->k) {
+            printf("a_beta has %d topics, but K = %d\n", (int) prev_beta.n_rows, settings->k);
+            return false;
+        }
+
+        a_beta.fill(settings->a_beta);
+        if (data->terms_mapped()) {
+            // saved in the input's term ids
+            for (int term = 0; term < data->term_count(); term++) {
+                if (data->external_term(term) < (int) prev_beta.n_cols)
+                    a_beta.col(term) = prev_beta.col(data->external_term(term));
+            }
+        } else {
+            n = min((int) prev_beta.n_cols, data->term_count());
+            if (n > 0)
+                a_beta.cols(0, n - 1) = prev_beta.cols(0, n - 1);
+        }
+        update_beta(0);
+
+        old_entities = min((int) prev_phi.n_cols, data->entity_count());
+        if (old_entities > 0) {
+            phi.cols(0, old_entities - 1) = prev_phi.cols(0, old_entities - 1);
+            logphi.cols(0, old_entities - 1) = log(prev_phi.cols(0, old_entities - 1));
+        }
+
+        old_docs = min((int) prev_theta.n_cols, data->doc_count());
+        if (old_docs > 0) {
+            theta.cols(0, old_docs - 1) = prev_theta.cols(0, old_docs - 1);
+            logtheta.cols(0, old_docs - 1) = log(prev_theta.cols(0, old_docs - 1));
+        }
+    }
+
+    if (settings->incl_entity) {
+        fvec prev_xi, prev_zeta;
+        sparse_rows prev_eta;
+        if (!read_binary(dir + "/xi" + suffix, prev_xi) ||
+            !read_binary(dir + "/zeta" + suffix, prev_zeta) ||
+            !read_binary(dir + "/a_eta" + suffix, prev_eta))
+            return false;
+
+        old_entities = min((int) prev_xi.n_elem, data->entity_count());
+        for (int entity = 0; entity < old_entities; entity++) {
+            xi(entity) = prev_xi(entity);
+            logxi(entity) = log(prev_xi(entity));
+        }
+
+        old_docs = min((int) prev_zeta.n_elem, data->doc_count());
+        for (int doc = 0; doc < old_docs; doc++) {
+            zeta(doc) = prev_zeta(doc);
+            logzeta(doc) = log(prev_zeta(doc));
+        }
+
+        if (data->terms_mapped())
+            map_terms(prev_eta, false);
+        eta.load(prev_eta);
+        for (int entity = 0; entity < data->entity_count(); entity++)
+            eta.normalize(entity);
+    }
+
+    if (settings->incl_events) {
+        fvec prev_psi;
+        sparse_rows prev_pi;
+        vector<event_record> prev_epsilon;
+        if (!read_binary(dir + "/psi" + suffix, prev_psi) ||
+            !read_binary(dir + "/a_pi" + suffix, prev_pi) ||
+            !read_binary(dir + "/epsilon" + suffix, prev_epsilon))
+            return false;
+
+        old_dates = min((int) prev_psi.n_elem, data->date_count());
+        for (int date = 0; date < old_dates; date++) {
+            psi(date) = prev_psi(date);
+            logpsi(date) = log(prev_psi(date));
+        }
+
+        if (data->terms_mapped())
+            map_terms(prev_pi, false);
+        pi.load(prev_pi);
+        for (int date = 0; date < data->date_count(); date++)
+            pi.normalize(date);
+
+        // values below the previous fit's --epsilon_min were not saved and
+        // keep their initial values
+        for (size_t i = 0; i < prev_epsilon.size(); i++) {
+            event_record& rec = prev_epsilon[i];
+            if (rec.doc >= data->doc_count() || rec.date > data->get_date(rec.doc) ||
+                rec.date <= data->get_date(rec.doc) - settings->event_dur)
+                continue;
+            epsilon(rec.date, rec.doc) = rec.val;
+            logepsilon(rec.date, rec.doc) = log(rec.val);
+        }
+    }
+
+    // without event parameters, the old dates are those of the old documents
+    if (old_dates < 0) {
+        old_dates = 0;
+        for (int doc = 0; doc < old_docs; doc++)
+            old_dates = max(old_dates, data->get_date(doc) + 1);
+    }
+
+    focus_date = max(0, old_dates - settings->event_dur + 1);
+    first_new_entity = old_entities;
+    focus_docs.clear();
+    for (int i = 0; i < data->doc_count(); i++) {
+        if (data->get_date(data->visit(i)) >= focus_date)
+            focus_docs.push_back(data->visit(i));
+    }
+
+    printf("\twarm start from %s: %d of %d dates, %d of %d entities are new\n",
+        dir.c_str(), data->date_count() - old_dates, data->date_count(),
+        data->entity_count() - first_new_entity, data->entity_count());
+    printf("\t\trefitting %d of %d documents (dates %d on)\n",
+        (int) focus_docs.size(), data->doc_count(), focus_date);
+    return true;
 }
 
 void Capsule::learn() {
@@ -142,6 +336,9 @@ void Capsule::learn() {
     set<int> terms;
     set<int> entities;
     set<int> dates;
+
+    vector<int> minibatch;
+    vector<int> doc_terms, doc_counts;
     if (!settings->svi) {
         printf("itemizing terms, entities, and dates\n");
         for (term = 0; term < data->term_count(); term++)
@@ -155,9 +352,16 @@ void Capsule::learn() {
     while (!converged) {
         time(&start_time);
         iteration++;
-        printf("iteration %d\n", iteration);
+        refit_globals = settings->warm_start == "" ||
+            (settings->refresh_freq > 0 && iteration % settings->refresh_freq == 0);
+        if (settings->warm_start != "" && refit_globals)
+            printf("iteration %d (full refresh)\n", iteration);
+        else
+            printf("iteration %d\n", iteration);
 
         reset_helper_params();
+        if (skipping())
+            add_frozen(iteration);
 
         if (settings->svi) {
             terms.clear();
@@ -169,91 +373,203 @@ void Capsule::learn() {
         time(&sst);
         time(&st);
 
-        for (int i = 0; i < settings->sample_size; i++) {
+        // draw the whole minibatch first, so its documents can be read ahead
+        if (settings->svi) {
+            minibatch.resize(settings->sample_size);
+            uint64_t stream = Philox::stream(RNG_MINIBATCH, iteration,
+                cluster ? cluster->get_rank() : 0);
+            #pragma omp parallel for schedule(static)
+            for (int i = 0; i < settings->sample_size; i++)
+                minibatch[i] = rng.uniform_int(stream, i, data->train_doc_count());
+            if (settings->doc_order != "id") {
+                sort(minibatch.begin(), minibatch.end(), [this](int a, int b) {
+                    return data->visit_rank(a) < data->visit_rank(b);
+                });
+            }
+            data->prefetch(minibatch);
+        }
+
+        // the bound on the topics left out of a token, from this pass's beta
+        if (truncating()) {
+            term_max_beta = exp(max(logbeta, 0)).t();
+            tokens_truncated = 0;
+            tokens_exact = 0;
+        }
+
+        long tokens = 0;
+        int docs_skipped = 0;
+        inner_passes = 0;
+        cache_misses.start();
+        l1d_misses.start();
+
+        // batch: walk the whole visiting order, but only the documents below
+        // the sample size are fitted (all of them, or only the training ones
+        // on the final pass, wherever the order puts them)
+        int n_docs = !refit_globals ? focus_docs.size() :
+            settings->svi ? settings->sample_size : data->doc_count();
+        for (int i = 0; i < n_docs; i++) {
             if (settings->svi) {
-                doc = gsl_rng_uniform_int(rand_gen, data->train_doc_count());
+                doc = minibatch[i];
             } else {
-                doc = i;
-                if (doc > 0 && doc % 10000 == 0) {
+                doc = refit_globals ? data->visit(i) : focus_docs[i];
+                if (i > 0 && i % 10000 == 0) {
                     time(&et);
-                    double rmt = (difftime(et, sst) / doc) * (data->doc_count() - doc);
-                    printf("\t doc %d / %d\t%ds (est. %f 'til end of iter)\n", doc, data->doc_count(), int(difftime(et, st)), rmt);
+                    double rmt = (difftime(et, sst) / i) * (n_docs - i);
+                    printf("\t doc %d / %d\t%ds (est. %f 'til end of iter)\n", i, n_docs, int(difftime(et, st)), rmt);
                     time(&st);
                 }
+                if (doc >= settings->sample_size || !owns(doc))
+                    continue;
             }
 
             int entity = data->get_entity(doc);
+            date = data->get_date(doc);
+            if (entity != cell_entity || date != cell_date) {
+                end_cell();
+                begin_cell(entity, date);
+            }
+            cell_docs++;
+
+            // a settled document keeps its locals, and its contributions to
+            // the globals are among the frozen ones; only its cell's sums
+            // need it
+            if (skipping() && doc_state[doc] == DOC_FROZEN) {
+                if (settings->incl_topics)
+                    cell_theta_sum += theta.col(doc);
+                if (settings->incl_events) {
+                    for (int d = max(0, date - settings->event_dur + 1); d <= date; d++)
+                        cell_epsilon_sum(date - d) += epsilon(d, doc);
+                }
+                if (settings->incl_entity)
+                    cell_zeta_sum += zeta(doc);
+                docs_skipped++;
+                continue;
+            }
 
             if (settings->svi)
                 entities.insert(entity);
 
-            date = data->get_date(doc);
+            if (settings->low_memory)
+                begin_doc(doc, date);
+
             if (settings->incl_events) {
                 for (int d = max(0, date - settings->event_dur + 1); d <= date; d++) {
                     if (settings->svi) {
                         dates.insert(d);
                         a_epsilon(d, doc) = settings->a_epsilon;
                     }
-                    b_epsilon(d, doc) = decay(date, d) * accu(pi.row(d));
+                    b_epsilon(d, doc) = cell_epsilon_rate(date - d);
                 }
             }
 
-            // look at all the document's terms
-            for (int j = 0; j < data->term_count(doc); j++) {
-                term = data->get_term(doc, j);
+            // look at all the document's terms: first refining its locals
+            // alone, while the terms are in cache, then adding to the globals
+            data->get_doc(doc, doc_terms, doc_counts);
+            tokens += doc_terms.size();
+            if (settings->inner_iter > 1)
+                inner_passes += refine_locals(doc, date, doc_terms, doc_counts);
+            inner_passes++;
+
+            if (truncating())
+                select_topics(doc);
+            freezing = skipping() && doc_state[doc] == DOC_FREEZING;
+            for (size_t j = 0; j < doc_terms.size(); j++) {
+                term = doc_terms[j];
                 if (settings->svi)
                     terms.insert(term);
 
-                count = data->get_term_count(doc, j);
+                count = doc_counts[j];
                 update_shape(doc, term, count);
             }
 
+            // the largest change of an expected log, when skipping
+            double change = 0;
             if (settings->incl_topics) {
-                b_theta.col(doc) += phi.col(entity);
-                b_theta.col(doc) += sum(beta, 1);
+                if (skipping())
+                    omega_topics = logtheta.col(doc);
+                b_theta.col(doc) = cell_theta_rate;
                 update_theta(doc);
+                cell_theta_sum += theta_col(doc);
+                if (skipping())
+                    change = max(change, (double) max(abs(logtheta.col(doc) - omega_topics)));
             }
 
             if (settings->incl_events) {
-                for (int d = max(0, date - settings->event_dur + 1); d <= date; d++) {
-                    b_epsilon(d, doc) += psi(date);
+                int first = max(0, date - settings->event_dur + 1);
+                if (skipping()) {
+                    for (int d = first; d <= date; d++)
+                        omega_event(date - d) = logepsilon(d, doc);
                 }
                 update_epsilon(doc, date);
+                for (int d = first; d <= date; d++) {
+                    cell_epsilon_sum(date - d) += epsilon_at(d, doc);
+                    if (skipping())
+                        change = max(change, (double) fabs(logepsilon(d, doc) - omega_event(date - d)));
+                }
             }
 
             if (settings->incl_entity) {
-                b_zeta(doc) = xi(entity) + accu(eta.row(entity));
+                double old_logzeta = skipping() ? logzeta(doc) : 0;
+                b_zeta(doc) = cell_zeta_rate;
                 update_zeta(doc);
-                a_xi(entity) += settings->a_zeta * ent_scale[entity];
-                b_xi(entity) += zeta(doc) * ent_scale[entity];
+                cell_zeta_sum += zeta_at(doc);
+                if (skipping())
+                    change = max(change, fabs(logzeta(doc) - old_logzeta));
             }
 
-            if (settings->incl_topics) {
-                for (int k = 0; k < settings->k; k++) {
-                    a_phi(k, entity) += settings->a_theta * scale;
-                    b_phi(k, entity) += theta(k, doc) * scale;
-                }
-            }
+            // a document that has settled adds to the frozen sums on its
+            // next pass, and is skipped from then on
+            if (freezing)
+                doc_state[doc] = DOC_FROZEN;
+            else if (skipping() && change < settings->skip_tol)
+                doc_state[doc] = DOC_FREEZING;
+            freezing = false;
         }
-
+        end_cell();
+        cell_entity = -1;
+        cell_date = -1;
+        if (settings->cache_stats)
+            log_cache(iteration, tokens, cache_misses.stop(), l1d_misses.stop());
+        if (truncating())
+            log_truncation(iteration);
+        if (settings->inner_iter > 1)
+            printf("\t%.2f passes per document\n", n_docs > 0 ? (double) inner_passes / n_docs : 0.0);
+        if (skipping())
+            printf("\t%d settled documents skipped\n", docs_skipped);
+
+        if (cluster)
+            reduce_statistics();
+
+        // between warm-start refreshes only the new entities and the
+        // events from focus_date on have all their documents in the pass
         set<int>::iterator it;
-        for (it = entities.begin(); it != entities.end(); it++) {
+        set<int>::iterator first_entity = refit_globals ? entities.begin() :
+            entities.lower_bound(first_new_entity);
+        for (it = first_entity; it != entities.end(); it++) {
             entity = *it;
             iter_count_entity[entity]++;
             if (settings->incl_topics)
                 update_phi(entity);
-            if (settings->incl_entity)
+            if (settings->incl_entity) {
                 update_xi(entity);
+                if (!refit_globals)
+                    eta.normalize(entity);
+            }
         }
 
-        if (settings->incl_topics)
+        if (settings->incl_topics && refit_globals) {
             update_beta(iteration);
+            if (settings->prune_patience > 0)
+                prune_topics(iteration);
+        }
 
-        if (settings->incl_entity)
+        if (settings->incl_entity && refit_globals)
             update_eta(iteration);
 
         if (settings->incl_events) {
-            for (it = dates.begin(); it != dates.end(); it++) {
+            set<int>::iterator first_date = refit_globals ? dates.begin() :
+                dates.lower_bound(focus_date);
+            for (it = first_date; it != dates.end(); it++) {
                 date = *it;
                 iter_count_date[date]++;
                 update_psi(date);
@@ -347,15 +663,15 @@ double Capsule::predict(int doc, int term) {
     double prediction = 0;
 
     if (settings->incl_topics)
-        prediction += accu(theta.col(doc) % beta.col(term));
+        prediction += accu(theta_col(doc) % beta_col(term));
 
     if (settings->incl_entity)
-        prediction += zeta(doc) * eta(data->get_entity(doc), term);
+        prediction += zeta_at(doc) * eta(data->get_entity(doc), term);
 
     if (settings->incl_events) {
         int date = data->get_date(doc);
         for (int d = max(0, date - settings->event_dur + 1); d <= date; d++)
-            prediction += f(date, d) * epsilon(d, doc) * pi(d,term);
+            prediction += f(date, d) * epsilon_at(d, doc) * pi(d,term);
     }
 
     return prediction;
@@ -386,13 +702,12 @@ void Capsule::evaluate(string label, bool write_rankings) {
     time_t start_time, end_time;
     time(&start_time);
 
-    // open file for eval
-    FILE* file = fopen((settings->outdir+"/eval.dat").c_str(), "a");
-
     double prediction, likelihood = 0;
     int doc, term, count;
     for (int i = 0; i < data->num_test(); i++) {
         doc = data->get_test_doc(i);
+        if (!owns(doc))
+            continue;
         term = data->get_test_term(i);
         count = data->get_test_count(i);
 
@@ -400,7 +715,14 @@ void Capsule::evaluate(string label, bool write_rankings) {
 
         likelihood += point_likelihood(prediction, count);
     }
+    if (cluster) {
+        cluster->sum(&likelihood, 1);
+        if (cluster->get_rank() != 0)
+            return;
+    }
 
+    // open file for eval
+    FILE* file = fopen((settings->outdir+"/eval.dat").c_str(), "a");
     fprintf(file, "held out log likelihood @ %s:\t%e\n", label.c_str(), likelihood);
     fclose(file);
 
@@ -412,31 +734,124 @@ void Capsule::evaluate(string label, bool write_rankings) {
 
 /* PRIVATE */
 
+// eta: every (entity, term) pair in the training data is an observed cell
+void Capsule::build_entity_descriptions() {
+    vector<vector<int> > observed(data->entity_count());
+    vector<int> terms, counts;
+    for (int doc = 0; doc < data->train_doc_count(); doc++) {
+        if (!entity_kept[data->get_entity(doc)])
+            continue;
+        vector<int>& row = observed[data->get_entity(doc)];
+        data->get_doc(doc, terms, counts);
+        row.insert(row.end(), terms.begin(), terms.end());
+    }
+    eta.build(data->entity_count(), data->term_count(), settings->a_eta, observed,
+        settings->low_memory, &arena);
+    printf("\t\t\t\t%lu observed cells (%.2f%% of dense)\n", (unsigned long) eta.nnz(),
+        100.0 * eta.nnz() / ((double) data->entity_count() * data->term_count()));
+}
+
+// pi: a date's row can receive mass from every term of every document dated
+// within event_dur of it
+void Capsule::build_event_descriptions() {
+    // with date shards, only the documents that reach a kept row matter
+    vector<char> reaches(data->date_count(), 0);
+    for (int d = 0; d < data->date_count(); d++) {
+        for (int date = d; date_kept[d] && date < min(d + settings->event_dur, data->date_count()); date++)
+            reaches[date] = 1;
+    }
+
+    vector<vector<int> > date_terms(data->date_count());
+    vector<int> terms, counts;
+    for (int doc = 0; doc < data->train_doc_count(); doc++) {
+        if (!reaches[data->get_date(doc)])
+            continue;
+        vector<int>& row = date_terms[data->get_date(doc)];
+        data->get_doc(doc, terms, counts);
+        row.insert(row.end(), terms.begin(), terms.end());
+    }
+    for (int date = 0; date < data->date_count(); date++) {
+        sort(date_terms[date].begin(), date_terms[date].end());
+        date_terms[date].erase(unique(date_terms[date].begin(), date_terms[date].end()),
+            date_terms[date].end());
+    }
+
+    vector<vector<int> > observed(data->date_count());
+    for (int d = 0; d < data->date_count(); d++) {
+        for (int date = d; date_kept[d] && date < min(d + settings->event_dur, data->date_count()); date++)
+            observed[d].insert(observed[d].end(), date_terms[date].begin(), date_terms[date].end());
+    }
+    vector<vector<int> >().swap(date_terms);
+
+    pi.build(data->date_count(), data->term_count(), settings->a_pi, observed,
+        settings->low_memory, &arena);
+    printf("\t\t\t\t%lu observed cells (%.2f%% of dense)\n", (unsigned long) pi.nnz(),
+        100.0 * pi.nnz() / ((double) data->date_count() * data->term_count()));
+
+    pi_cells.resize(settings->event_dur);
+    omega_event = arena.column(settings->event_dur);
+    cell_epsilon_rate = arena.column(settings->event_dur);
+    cell_epsilon_sum = arena.column(settings->event_dur);
+}
+
 void Capsule::initialize_parameters() {
     if (settings->incl_topics) {
         printf("\t\ttopic parameters\n");
-        // entity concerns
-        phi.fill(settings->a_phi / settings->b_phi);
-        logphi.fill(gsl_sf_psi(settings->a_phi) - log(settings->b_phi));
-
-        // document topics
-        theta.fill(settings->a_theta / (settings->a_phi / settings->b_phi));
-        logtheta.fill(gsl_sf_psi(settings->a_theta) - log(settings->a_phi / settings->b_phi));
-
-        // topics
-        for (int k = 0; k < settings->k; k++) {
+        if (settings->low_memory) {
+            // entity concerns and document topics are kept only as their
+            // shapes and rates: phi in the _old copies, theta in a/b_theta
+            a_theta.fill(settings->a_theta);
+            b_theta.fill(settings->a_phi / settings->b_phi);
+
+            // topics: the initial draws serve as normalized shapes; threads
+            // take whole columns (contiguous in memory), and draw (k, v) is
+            // the same whichever thread makes it
+            uint64_t stream = Philox::stream(RNG_BETA, 0);
+            #pragma omp parallel for schedule(static)
             for (int v = 0; v < data->term_count(); v++) {
-                if (k == 0) {
-                    beta(k, v) = (float)data->term_count(v) / (float)data->total_terms();
-                } else {
-                    beta(k, v) = (settings->a_beta +
-                        gsl_rng_uniform_pos(rand_gen));
+                for (int k = 0; k < settings->k; k++) {
+                    if (k == 0) {
+                        a_beta_old(k, v) = (float)data->term_count(v) / (float)data->total_terms();
+                    } else {
+                        a_beta_old(k, v) = (settings->a_beta +
+                            rng.uniform_pos(stream, (uint64_t) k * data->term_count() + v));
+                    }
+                }
+            }
+            for (int k = 0; k < settings->k; k++) {
+                beta_sum(k) = accu(a_beta_old.row(k));
+                beta_psi_sum(k) = gsl_sf_psi(beta_sum(k));
+            }
+            beta_total.fill(1.0);
+        } else {
+            // entity concerns
+            phi.fill(settings->a_phi / settings->b_phi);
+            logphi.fill(gsl_sf_psi(settings->a_phi) - log(settings->b_phi));
+
+            // document topics
+            theta.fill(settings->a_theta / (settings->a_phi / settings->b_phi));
+            logtheta.fill(gsl_sf_psi(settings->a_theta) - log(settings->a_phi / settings->b_phi));
+
+            // topics: threads take whole columns, as above
+            uint64_t stream = Philox::stream(RNG_BETA, 0);
+            #pragma omp parallel for schedule(static)
+            for (int v = 0; v < data->term_count(); v++) {
+                for (int k = 0; k < settings->k; k++) {
+                    if (k == 0) {
+                        beta(k, v) = (float)data->term_count(v) / (float)data->total_terms();
+                    } else {
+                        beta(k, v) = (settings->a_beta +
+                            rng.uniform_pos(stream, (uint64_t) k * data->term_count() + v));
+                    }
+                    if (beta(k, v) != 0)
+                        logbeta(k, v) = gsl_sf_psi(beta(k, v));
                 }
-                if (beta(k, v) != 0)
-                    logbeta(k, v) = gsl_sf_psi(beta(k, v));
             }
-            logbeta.row(k) -= log(accu(beta.row(k)));
-            beta.row(k) /= accu(beta.row(k));
+            for (int k = 0; k < settings->k; k++) {
+                logbeta.row(k) -= log(accu(beta.row(k)));
+                beta.row(k) /= accu(beta.row(k));
+            }
+            beta_total = sum(beta, 1);
         }
     }
 
@@ -447,19 +862,23 @@ void Capsule::initialize_parameters() {
         logxi.fill(gsl_sf_psi(settings->a_xi) - log(settings->b_xi));
 
         // document specific entity strength
-        zeta.fill(settings->a_zeta / (settings->a_xi / settings->b_xi));
-        logzeta.fill(gsl_sf_psi(settings->a_zeta) - log(settings->a_xi / settings->b_xi));
-
-        // entity descriptions
-        for (int i = 0; i < data->entity_count(); i++) {
-            for (int v = 0; v < data->term_count(); v++) {
-                eta(i, v) = (settings->a_eta +
-                    gsl_rng_uniform_pos(rand_gen));
-                logeta(i, v) = gsl_sf_psi(eta(i, v));
-            }
-            logeta.row(i) -= log(accu(eta.row(i)));
-            eta.row(i) /= accu(eta.row(i));
+        if (settings->low_memory) {
+            a_zeta.fill(settings->a_zeta);
+            b_zeta.fill(settings->a_xi / settings->b_xi);
+        } else {
+            zeta.fill(settings->a_zeta / (settings->a_xi / settings->b_xi));
+            logzeta.fill(gsl_sf_psi(settings->a_zeta) - log(settings->a_xi / settings->b_xi));
         }
+
+        // entity descriptions: random observed cells; the prior cells
+        // all start at the expected value of the same draw
+        uint64_t stream = Philox::stream(RNG_ETA, 0);
+        #pragma omp parallel for schedule(static)
+        for (uword i = 0; i < eta.nnz(); i++)
+            eta.set_shape(i, settings->a_eta + rng.uniform_pos(stream, i));
+        eta.set_base(settings->a_eta + 0.5);
+        for (int i = 0; i < data->entity_count(); i++)
+            eta.normalize(i);
     }
 
     if (settings->incl_events) {
@@ -469,12 +888,8 @@ void Capsule::initialize_parameters() {
         logpsi.fill(gsl_sf_psi(settings->a_psi) - log(settings->b_psi));
 
         // event descriptions
-        pi.fill(settings->a_pi / 1.0);
-        logpi.fill(gsl_sf_psi(settings->a_pi) - log(1.0));
-        for (int d = 0; d < data->date_count(); d++) {
-            logpi.row(d) -= log(accu(pi.row(d)));
-            pi.row(d) /= accu(pi.row(d));
-        }
+        for (int d = 0; d < data->date_count(); d++)
+            pi.normalize(d);
 
         // log f function
         for (int i = 0; i < data->date_count(); i++) {
@@ -507,9 +922,15 @@ void Capsule::initialize_parameters() {
             }
         }
         event_cells = sp_fmat(locations, values, data->date_count(), data->doc_count());
-        epsilon = event_cells * (settings->a_epsilon / (settings->a_psi / settings->b_psi));
-        logepsilon = event_cells * (gsl_sf_psi(settings->a_theta) - log(settings->a_psi / settings->b_psi));
-        b_epsilon = event_cells * 1.0; //placeholder to create the correct shape matrix (a_eps is done in reset)
+        if (settings->low_memory) {
+            a_epsilon = event_cells * settings->a_epsilon;
+            b_epsilon = event_cells * (settings->a_psi / settings->b_psi);
+        } else {
+            epsilon = event_cells * (settings->a_epsilon / (settings->a_psi / settings->b_psi));
+            logepsilon = event_cells * (gsl_sf_psi(settings->a_theta) - log(settings->a_psi / settings->b_psi));
+            b_epsilon = event_cells * 1.0; //placeholder to create the correct shape matrix (a_eps is done in reset)
+        }
+        doc_logepsilon = fvec(settings->event_dur);
     }
 }
 
@@ -520,163 +941,864 @@ void Capsule::reset_helper_params() {
     b_psi.fill(settings->b_psi);
     a_xi.fill(settings->a_xi);
     b_xi.fill(settings->b_xi);
+    if (refit_globals) {
+        a_beta.fill(settings->a_beta);
+        pi.reset();
+        eta.reset();
+    } else {
+        // warm start: the other rows keep their loaded shapes
+        for (int d = focus_date; d < data->date_count(); d++)
+            pi.reset(d);
+        for (int n = first_new_entity; n < data->entity_count(); n++)
+            eta.reset(n);
+    }
+
+    // in low-memory mode the local shapes and rates are the only copy of
+    // theta, zeta and epsilon; they are reset per document in begin_doc
+    if (settings->low_memory)
+        return;
+
     a_theta.fill(settings->a_theta);
     b_theta.fill(0.0);
     a_zeta.fill(settings->a_zeta);
     b_zeta.fill(0.0);
-    a_beta.fill(settings->a_beta);
-    a_pi.fill(settings->a_pi);
-    a_eta.fill(settings->a_eta);
     if (!settings->svi) {
         a_epsilon = event_cells * settings->a_epsilon;
     }
 }
 
+// low memory: load a document's expected logs into per-document tiles, then
+// restart accumulation of its local shapes and rates
+void Capsule::begin_doc(int doc, int date) {
+    if (settings->incl_topics) {
+        for (int k = 0; k < settings->k; k++)
+            doc_logtheta(k) = gsl_sf_psi(a_theta(k, doc)) - log(b_theta(k, doc));
+        a_theta.col(doc).fill(settings->a_theta);
+        b_theta.col(doc).fill(0.0);
+    }
+
+    if (settings->incl_entity) {
+        doc_logzeta = gsl_sf_psi(a_zeta(doc)) - log(b_zeta(doc));
+        a_zeta(doc) = settings->a_zeta;
+        b_zeta(doc) = 0;
+    }
+
+    if (settings->incl_events) {
+        for (int d = max(0, date - settings->event_dur + 1); d <= date; d++) {
+            doc_logepsilon(date - d) = gsl_sf_psi(a_epsilon(d, doc)) - log(b_epsilon(d, doc));
+            a_epsilon(d, doc) = settings->a_epsilon;
+        }
+    }
+}
+
+fvec Capsule::theta_col(int doc) {
+    if (settings->low_memory)
+        return a_theta.col(doc) / b_theta.col(doc);
+    return theta.col(doc);
+}
+
+fvec Capsule::phi_col(int entity) {
+    if (settings->low_memory)
+        return a_phi_old.col(entity) / b_phi_old.col(entity);
+    return phi.col(entity);
+}
+
+fvec Capsule::beta_col(int term) {
+    if (settings->low_memory)
+        return a_beta_old.col(term) / beta_sum;
+    return beta.col(term);
+}
+
+double Capsule::zeta_at(int doc) {
+    if (settings->low_memory)
+        return a_zeta(doc) / b_zeta(doc);
+    return zeta(doc);
+}
+
+double Capsule::epsilon_at(int date, int doc) {
+    if (settings->low_memory)
+        return a_epsilon(date, doc) / b_epsilon(date, doc);
+    return epsilon(date, doc);
+}
+
+// full matrices of means, for saving and the ELBO
+fmat Capsule::theta_mean() {
+    if (settings->low_memory)
+        return a_theta / b_theta;
+    return theta;
+}
+
+fmat Capsule::phi_mean() {
+    if (settings->low_memory)
+        return a_phi_old / b_phi_old;
+    return phi;
+}
+
+fmat Capsule::beta_mean() {
+    if (!settings->low_memory)
+        return beta;
+    fmat means = a_beta_old;
+    for (int k = 0; k < settings->k; k++)
+        means.row(k) /= beta_sum(k);
+    return means;
+}
+
+fvec Capsule::zeta_mean() {
+    if (settings->low_memory)
+        return a_zeta / b_zeta;
+    return zeta;
+}
+
+// the sum of each row's shapes, with `extra` more columns at the default
+static fvec row_sums(const sparse_rows& m, int extra) {
+    fvec sums(m.rows);
+    for (uword r = 0; r < m.rows; r++) {
+        uword cells = m.row_ptr[r+1] - m.row_ptr[r];
+        double total = (m.cols + extra - cells) * (double) m.defaults(r);
+        for (uword i = m.row_ptr[r]; i < m.row_ptr[r+1]; i++)
+            total += m.values(i);
+        sums(r) = total;
+    }
+    return sums;
+}
+
 void Capsule::save_parameters(string label) {
-    FILE* file;
+    // copy-on-save: snapshot the parameters so training can continue
+    // while the background writer formats and writes them out
+    shared_ptr<param_snapshot> snap = make_shared<param_snapshot>();
+
+    // multi-process: the aggregator saves for everyone
+    if (cluster) {
+        gather_locals(snap.get());
+        if (cluster->get_rank() != 0)
+            return;
+    }
+
+    // in top-N mode only the selected terms of the means are kept, not the
+    // dense rows, and of the shapes only their row sums unless --save_shapes
+    // asks for them (warm starts and fold-in need them)
+    bool top = settings->save_top > 0;
+    bool shapes = !top || settings->save_shapes;
+    // terms pruned from the input count toward the sums with the prior shape
+    int pruned = data->terms_mapped() ? data->external_term_count() - data->term_count() : 0;
 
     if (settings->incl_topics) {
-        int k;
-
-        // write out phi
-        file = fopen((settings->outdir+"/phi-"+label+".dat").c_str(), "w");
-        for (int entity = 0; entity < data->entity_count(); entity++) {
-            fprintf(file, "%d", entity);
-            for (k = 0; k < settings->k; k++)
-                fprintf(file, "\t%e", phi(k, entity));
-            fprintf(file, "\n");
+        snap->phi = phi_mean();
+        snap->theta = theta_mean();
+        if (top) {
+            select_top(beta_mean(), settings->save_top, snap->beta_residual, snap->beta_top);
+        } else {
+            snap->beta = beta_mean();
+        }
+        if (shapes) {
+            snap->a_beta = a_beta;
+        } else {
+            snap->a_beta_sum = fvec(a_beta.n_rows);
+            for (uword k = 0; k < a_beta.n_rows; k++)
+                snap->a_beta_sum(k) = accu(a_beta.row(k)) + pruned * settings->a_beta;
         }
-        fclose(file);
+    }
 
-        // write out beta
-        file = fopen((settings->outdir+"/beta-"+label+".dat").c_str(), "w");
-        for (int term = 0; term < data->term_count(); term++) {
-            fprintf(file, "%d", term);
-            for (k = 0; k < settings->k; k++)
-                fprintf(file, "\t%e", beta(k, term));
-            fprintf(file, "\n");
+    if (settings->incl_entity) {
+        snap->xi = xi;
+        snap->zeta = zeta_mean();
+        // with shards, already gathered from the ranks; otherwise the means
+        // go first, so that in top-N mode only one copy is held at a time
+        bool gathered = cluster && settings->shard_entities;
+        if (!gathered)
+            eta.snapshot(snap->eta, false);
+        if (top) {
+            select_top(snap->eta, settings->save_top, snap->eta_residual, snap->eta_top);
+            snap->eta = sparse_rows();
         }
-        fclose(file);
+        if (!gathered)
+            eta.snapshot(snap->a_eta, true);
+        if (!shapes) {
+            snap->a_eta_sum = row_sums(snap->a_eta, pruned);
+            snap->a_eta = sparse_rows();
+        }
+    }
 
-        file = fopen((settings->outdir+"/a_beta-"+label+".dat").c_str(), "w");
-        for (int term = 0; term < data->term_count(); term++) {
-            fprintf(file, "%d", term);
-            for (k = 0; k < settings->k; k++)
-                fprintf(file, "\t%e", a_beta(k, term));
-            fprintf(file, "\n");
+    if (settings->incl_events) {
+        snap->psi = psi;
+        // as for eta
+        bool gathered = cluster && settings->shard_dates;
+        if (!gathered)
+            pi.snapshot(snap->pi, false);
+        if (top) {
+            select_top(snap->pi, settings->save_top, snap->pi_residual, snap->pi_top);
+            snap->pi = sparse_rows();
+        }
+        if (!gathered)
+            pi.snapshot(snap->a_pi, true);
+        if (!shapes) {
+            snap->a_pi_sum = row_sums(snap->a_pi, pruned);
+            snap->a_pi = sparse_rows();
         }
-        fclose(file);
 
-        // write out theta
-        file = fopen((settings->outdir+"/theta-"+label+".dat").c_str(), "w");
+        event_record rec;
         for (int doc = 0; doc < data->doc_count(); doc++) {
-            fprintf(file, "%d", doc);
-            for (k = 0; k < settings->k; k++)
-                fprintf(file, "\t%e", theta(k, doc));
-            fprintf(file, "\n");
+            int date = data->get_date(doc);
+            for (int d = max(0, date - settings->event_dur + 1); d <= date; d++) {
+                rec.val = epsilon_at(d, doc);
+                if (rec.val < settings->epsilon_min)
+                    continue;
+                rec.doc = doc;
+                rec.date = d;
+                rec.decayed = rec.val * decay(date, d);
+                snap->epsilon.push_back(rec);
+            }
         }
-        fclose(file);
     }
 
-    if (settings->incl_entity) {
-        int t;
+    string previous = settings->overwrite ? last_save : "";
+    writer.submit([this, snap, label, previous]() {
+        // the previous save goes only once this one is complete
+        if (!write_parameters(snap.get(), label))
+            printf("saving the %s parameters failed; keeping the previous ones\n", label.c_str());
+        else if (previous != "")
+            remove_parameters(previous);
+    });
+    last_save = label;
+}
 
-        // write out xi
-        file = fopen((settings->outdir+"/xi-"+label+".dat").c_str(), "w");
-        for (int entity = 0; entity < data->entity_count(); entity++)
-            fprintf(file, "%e\n", xi(entity));
-        fclose(file);
-
-        // write out eta
-        file = fopen((settings->outdir+"/eta-"+label+".dat").c_str(), "w");
-        for (int entity = 0; entity < data->entity_count(); entity++) {
-            fprintf(file, "%d", entity);
-            for (t = 0; t < data->term_count(); t++)
-                fprintf(file, "\t%e", eta(entity, t));
-            fprintf(file, "\n");
+// top-n entries of each row by weight (partial selection, rows in parallel),
+// plus the residual mass of the row not covered by them
+void Capsule::select_top(const fmat& m, int n, fvec& residual, vector<top_entry>& top) {
+    int rows = m.n_rows;
+    int cols = m.n_cols;
+    int keep = min(n, cols);
+    residual = fvec(rows);
+    top.assign((size_t) rows * n, top_entry());
+
+    #pragma omp parallel
+    {
+        vector<int> order(cols);
+
+        #pragma omp for schedule(dynamic)
+        for (int r = 0; r < rows; r++) {
+            for (int c = 0; c < cols; c++)
+                order[c] = c;
+            auto heavier = [&m, r](int a, int b) { return m(r, a) > m(r, b); };
+            nth_element(order.begin(), order.begin() + keep - 1, order.end(), heavier);
+            sort(order.begin(), order.begin() + keep, heavier);
+
+            double total = 0;
+            for (int c = 0; c < cols; c++)
+                total += m(r, c);
+
+            top_entry* entries = &top[(size_t) r * n];
+            for (int i = 0; i < n; i++) {
+                if (i < keep) {
+                    entries[i].term = order[i];
+                    entries[i].weight = m(r, order[i]);
+                    total -= entries[i].weight;
+                } else {
+                    entries[i].term = -1;
+                    entries[i].weight = 0;
+                }
+            }
+            residual(r) = max(0.0, total);
         }
-        fclose(file);
+    }
+}
 
-        file = fopen((settings->outdir+"/a_eta-"+label+".dat").c_str(), "w");
-        for (int entity = 0; entity < data->entity_count(); entity++) {
-            fprintf(file, "%d", entity);
-            for (t = 0; t < data->term_count(); t++)
-                fprintf(file, "\t%e", a_eta(entity, t));
-            fprintf(file, "\n");
-        }
-        fclose(file);
+// as above, for sparse rows: only stored cells are candidates, since every
+// other cell of a row holds the (smaller) prior weight and is left to the
+// residual
+void Capsule::select_top(const sparse_rows& m, int n, fvec& residual, vector<top_entry>& top) {
+    int rows = m.rows;
+    residual = fvec(rows);
+    top.assign((size_t) rows * n, top_entry());
+
+    #pragma omp parallel
+    {
+        vector<uword> order;
+
+        #pragma omp for schedule(dynamic)
+        for (int r = 0; r < rows; r++) {
+            order.clear();
+            for (uword i = m.row_ptr[r]; i < m.row_ptr[r+1]; i++)
+                order.push_back(i);
+            int keep = min((int) order.size(), n);
+            auto heavier = [&m](uword a, uword b) { return m.values(a) > m.values(b); };
+            if (keep > 0) {
+                nth_element(order.begin(), order.begin() + keep - 1, order.end(), heavier);
+                sort(order.begin(), order.begin() + keep, heavier);
+            }
 
-        // write out zeta
-        file = fopen((settings->outdir+"/zeta-"+label+".dat").c_str(), "w");
-        for (int doc = 0; doc < data->doc_count(); doc++) {
-            fprintf(file, "%d\t%e\n", doc, zeta(doc));
+            double total = (m.cols - order.size()) * m.defaults(r);
+            for (size_t i = 0; i < order.size(); i++)
+                total += m.values(order[i]);
+
+            top_entry* entries = &top[(size_t) r * n];
+            for (int i = 0; i < n; i++) {
+                if (i < keep) {
+                    entries[i].term = m.col_idx[order[i]];
+                    entries[i].weight = m.values(order[i]);
+                    total -= entries[i].weight;
+                } else {
+                    entries[i].term = -1;
+                    entries[i].weight = 0;
+                }
+            }
+            residual(r) = max(0.0, total);
         }
-        fclose(file);
     }
+}
 
-    if (settings->incl_events) {
-        int t;
+// dense text rows ("row  value  value ..."), filling in the default values
+static bool write_text(string filename, const sparse_rows& m) {
+    return write_text_file(filename, [&m](FILE* file) {
+        for (uword r = 0; r < m.rows; r++) {
+            fprintf(file, "%d", (int) r);
+            uword i = m.row_ptr[r];
+            for (uword t = 0; t < m.cols; t++) {
+                if (i < m.row_ptr[r+1] && m.col_idx[i] == (int) t)
+                    fprintf(file, "\t%e", m.values(i++));
+                else
+                    fprintf(file, "\t%e", m.defaults(r));
+            }
+            fprintf(file, "\n");
+        }
+    });
+}
 
-        // write out psi
-        file = fopen((settings->outdir+"/psi-"+label+".dat").c_str(), "w");
-        for (int date = 0; date < data->date_count(); date++)
-            fprintf(file, "%e\n", psi(date));
-        fclose(file);
-
-        // write out pi
-        file = fopen((settings->outdir+"/pi-"+label+".dat").c_str(), "w");
-        for (int date = 0; date < data->date_count(); date++) {
-            fprintf(file, "%d", date);
-            for (t = 0; t < data->term_count(); t++)
-                fprintf(file, "\t%e", pi(date, t));
+// sparse text rows ("row  default  col:value ..."), for the shapes, whose
+// rows are mostly the default
+static bool write_sparse_text(string filename, const sparse_rows& m) {
+    return write_text_file(filename, [&m](FILE* file) {
+        for (uword r = 0; r < m.rows; r++) {
+            fprintf(file, "%d\t%e", (int) r, m.defaults(r));
+            for (uword i = m.row_ptr[r]; i < m.row_ptr[r+1]; i++)
+                fprintf(file, "\t%d:%e", m.col_idx[i], m.values(i));
             fprintf(file, "\n");
         }
-        fclose(file);
+    });
+}
+
+// one value per row ("row  value"), as for zeta and the shape sums
+static bool write_text(string filename, const fvec& v) {
+    return write_text_file(filename, [&v](FILE* file) {
+        for (uword r = 0; r < v.n_elem; r++)
+            fprintf(file, "%d\t%e\n", (int) r, v(r));
+    });
+}
 
-        file = fopen((settings->outdir+"/a_pi-"+label+".dat").c_str(), "w");
-        for (int date = 0; date < data->date_count(); date++) {
-            fprintf(file, "%d", date);
-            for (t = 0; t < data->term_count(); t++)
-                fprintf(file, "\t%e", a_pi(date, t));
+// one line per column ("column  value  value ..."), as for phi, beta, theta
+static bool write_text(string filename, const fmat& m) {
+    return write_text_file(filename, [&m](FILE* file) {
+        for (uword c = 0; c < m.n_cols; c++) {
+            fprintf(file, "%d", (int) c);
+            for (uword r = 0; r < m.n_rows; r++)
+                fprintf(file, "\t%e", m(r, c));
             fprintf(file, "\n");
         }
-        fclose(file);
+    });
+}
 
-        // write out epsilon
-        file = fopen((settings->outdir+"/epsilon-"+label+".dat").c_str(), "w");
-        for (int doc = 0; doc < data->doc_count(); doc++) {
-            int date = data->get_date(doc);
-            for (int d = max(0, date - settings->event_dur + 1); d <= date; d++) {
-                double val = epsilon(d, doc);
-                fprintf(file, "%d\t%d\t%e\t%e\n", doc, d, val, val*decay(date,d));
+bool Capsule::write_top(string filename, const fvec& residual, const vector<top_entry>& top) {
+    int n = settings->save_top;
+    if (!settings->save_text)
+        return write_binary(filename, residual, top, n);
+
+    return write_text_file(filename, [&residual, &top, n](FILE* file) {
+        for (uint r = 0; r < residual.n_elem; r++) {
+            fprintf(file, "%d\t%e", r, residual(r));
+            for (int i = 0; i < n; i++) {
+                const top_entry& entry = top[(size_t) r * n + i];
+                if (entry.term >= 0)
+                    fprintf(file, "\t%d:%e", entry.term, entry.weight);
             }
+            fprintf(file, "\n");
+        }
+    });
+}
+
+string Capsule::param_file(string name, string label) {
+    return settings->outdir + "/" + name + "-" + label +
+        (settings->save_text ? ".dat" : ".bin");
+}
+
+// the columns of a sparse parameter renumbered, dropping cells without a
+// counterpart, and each row sorted again
+void Capsule::map_terms(sparse_rows& m, bool to_external) {
+    vector<uword> row_ptr(m.rows + 1, 0);
+    vector<int> col_idx;
+    vector<float> values;
+    vector<pair<int, float> > cells;
+    for (uword r = 0; r < m.rows; r++) {
+        cells.clear();
+        for (uword i = m.row_ptr[r]; i < m.row_ptr[r+1]; i++) {
+            int term = to_external ? data->external_term(m.col_idx[i]) :
+                data->internal_term(m.col_idx[i]);
+            if (term >= 0)
+                cells.push_back(make_pair(term, m.values(i)));
+        }
+        sort(cells.begin(), cells.end());
+        for (size_t i = 0; i < cells.size(); i++) {
+            col_idx.push_back(cells[i].first);
+            values.push_back(cells[i].second);
         }
-        fclose(file);
+        row_ptr[r+1] = col_idx.size();
     }
+    m.cols = to_external ? data->external_term_count() : data->term_count();
+    m.row_ptr.swap(row_ptr);
+    m.col_idx.swap(col_idx);
+    m.values = fvec(values.size());
+    copy(values.begin(), values.end(), m.values.memptr());
+}
+
+// the snapshot in the input's term ids; pruned terms get empty beta columns,
+// with the prior as their shape
+void Capsule::restore_terms(param_snapshot* snap) {
+    if (!data->terms_mapped())
+        return;
 
-    if (settings->overwrite && last_save != "") {
+    int terms = data->external_term_count();
+    if (snap->beta.n_elem > 0) {
+        fmat beta_in(snap->beta.n_rows, terms);
+        beta_in.zeros();
+        for (uword term = 0; term < snap->beta.n_cols; term++)
+            beta_in.col(data->external_term(term)) = snap->beta.col(term);
+        snap->beta = beta_in;
+    }
+    // the shapes, which top-N mode leaves out unless --save_shapes
+    if (snap->a_beta.n_elem > 0) {
+        fmat a_beta_in(snap->a_beta.n_rows, terms);
+        a_beta_in.fill(settings->a_beta);
+        for (uword term = 0; term < snap->a_beta.n_cols; term++)
+            a_beta_in.col(data->external_term(term)) = snap->a_beta.col(term);
+        snap->a_beta = a_beta_in;
+    }
+    if (snap->eta.rows > 0)
+        map_terms(snap->eta, true);
+    if (snap->a_eta.rows > 0)
+        map_terms(snap->a_eta, true);
+    if (snap->pi.rows > 0)
+        map_terms(snap->pi, true);
+    if (snap->a_pi.rows > 0)
+        map_terms(snap->a_pi, true);
+
+    vector<top_entry>* tops[] = {&snap->beta_top, &snap->eta_top, &snap->pi_top};
+    for (int t = 0; t < 3; t++) {
+        for (size_t i = 0; i < tops[t]->size(); i++) {
+            if ((*tops[t])[i].term >= 0)
+                (*tops[t])[i].term = data->external_term((*tops[t])[i].term);
+        }
+    }
+}
+
+bool Capsule::write_parameters(param_snapshot* snap, string label) {
+    restore_terms(snap);
+    bool ok = true;
+
+    if (settings->save_top > 0) {
+        if (settings->incl_topics)
+            ok = write_top(param_file("beta_top", label), snap->beta_residual,
+                snap->beta_top) && ok;
+        if (settings->incl_entity)
+            ok = write_top(param_file("eta_top", label), snap->eta_residual,
+                snap->eta_top) && ok;
+        if (settings->incl_events)
+            ok = write_top(param_file("pi_top", label), snap->pi_residual,
+                snap->pi_top) && ok;
+    }
+
+    // without the shapes (top-N mode), their row sums
+    bool shapes = settings->save_top <= 0 || settings->save_shapes;
+
+    if (!settings->save_text) {
         if (settings->incl_topics) {
-            remove((settings->outdir+"/phi-"+last_save+".dat").c_str());
-            remove((settings->outdir+"/beta-"+last_save+".dat").c_str());
-            remove((settings->outdir+"/a_beta-"+last_save+".dat").c_str());
-            remove((settings->outdir+"/theta-"+last_save+".dat").c_str());
+            ok = write_binary(param_file("phi", label), snap->phi) && ok;
+            if (settings->save_top <= 0)
+                ok = write_binary(param_file("beta", label), snap->beta) && ok;
+            if (shapes)
+                ok = write_binary(param_file("a_beta", label), snap->a_beta) && ok;
+            else
+                ok = write_binary(param_file("a_beta_sum", label), snap->a_beta_sum) && ok;
+            ok = write_binary(param_file("theta", label), snap->theta) && ok;
         }
 
         if (settings->incl_entity) {
-            remove((settings->outdir+"/xi-"+last_save+".dat").c_str());
-            remove((settings->outdir+"/eta-"+last_save+".dat").c_str());
-            remove((settings->outdir+"/a_eta-"+last_save+".dat").c_str());
-            remove((settings->outdir+"/zeta-"+last_save+".dat").c_str());
+            ok = write_binary(param_file("xi", label), snap->xi) && ok;
+            if (settings->save_top <= 0)
+                ok = write_binary(param_file("eta", label), snap->eta) && ok;
+            if (shapes)
+                ok = write_binary(param_file("a_eta", label), snap->a_eta) && ok;
+            else
+                ok = write_binary(param_file("a_eta_sum", label), snap->a_eta_sum) && ok;
+            ok = write_binary(param_file("zeta", label), snap->zeta) && ok;
         }
 
         if (settings->incl_events) {
-            remove((settings->outdir+"/psi-"+last_save+".dat").c_str());
-            remove((settings->outdir+"/pi-"+last_save+".dat").c_str());
-            remove((settings->outdir+"/a_pi-"+last_save+".dat").c_str());
-            remove((settings->outdir+"/epsilon-"+last_save+".dat").c_str());
+            ok = write_binary(param_file("psi", label), snap->psi) && ok;
+            if (settings->save_top <= 0)
+                ok = write_binary(param_file("pi", label), snap->pi) && ok;
+            if (shapes)
+                ok = write_binary(param_file("a_pi", label), snap->a_pi) && ok;
+            else
+                ok = write_binary(param_file("a_pi_sum", label), snap->a_pi_sum) && ok;
+            ok = write_binary(param_file("epsilon", label), snap->epsilon) && ok;
         }
+        return ok;
     }
-    last_save = label;
+
+    if (settings->incl_topics) {
+        ok = write_text(param_file("phi", label), snap->phi) && ok;
+        if (settings->save_top <= 0)
+            ok = write_text(param_file("beta", label), snap->beta) && ok;
+        if (shapes)
+            ok = write_text(param_file("a_beta", label), snap->a_beta) && ok;
+        else
+            ok = write_text(param_file("a_beta_sum", label), snap->a_beta_sum) && ok;
+        ok = write_text(param_file("theta", label), snap->theta) && ok;
+    }
+
+    if (settings->incl_entity) {
+        ok = write_text_file(param_file("xi", label), [snap](FILE* file) {
+            for (uint entity = 0; entity < snap->xi.n_elem; entity++)
+                fprintf(file, "%e\n", snap->xi(entity));
+        }) && ok;
+
+        if (settings->save_top <= 0)
+            ok = write_text(param_file("eta", label), snap->eta) && ok;
+        if (shapes)
+            ok = write_sparse_text(param_file("a_eta", label), snap->a_eta) && ok;
+        else
+            ok = write_text(param_file("a_eta_sum", label), snap->a_eta_sum) && ok;
+
+        ok = write_text(param_file("zeta", label), snap->zeta) && ok;
+    }
+
+    if (settings->incl_events) {
+        ok = write_text_file(param_file("psi", label), [snap](FILE* file) {
+            for (uint date = 0; date < snap->psi.n_elem; date++)
+                fprintf(file, "%e\n", snap->psi(date));
+        }) && ok;
+
+        if (settings->save_top <= 0)
+            ok = write_text(param_file("pi", label), snap->pi) && ok;
+        if (shapes)
+            ok = write_sparse_text(param_file("a_pi", label), snap->a_pi) && ok;
+        else
+            ok = write_text(param_file("a_pi_sum", label), snap->a_pi_sum) && ok;
+
+        ok = write_text_file(param_file("epsilon", label), [snap](FILE* file) {
+            for (size_t i = 0; i < snap->epsilon.size(); i++) {
+                const event_record& rec = snap->epsilon[i];
+                fprintf(file, "%d\t%d\t%e\t%e\n", rec.doc, rec.date, rec.val, rec.decayed);
+            }
+        }) && ok;
+    }
+    return ok;
+}
+
+void Capsule::remove_parameters(string label) {
+    if (settings->incl_topics) {
+        remove(param_file("phi", label).c_str());
+        remove(param_file("beta", label).c_str());
+        remove(param_file("a_beta", label).c_str());
+        remove(param_file("a_beta_sum", label).c_str());
+        remove(param_file("theta", label).c_str());
+        remove(param_file("beta_top", label).c_str());
+    }
+
+    if (settings->incl_entity) {
+        remove(param_file("xi", label).c_str());
+        remove(param_file("eta", label).c_str());
+        remove(param_file("a_eta", label).c_str());
+        remove(param_file("a_eta_sum", label).c_str());
+        remove(param_file("zeta", label).c_str());
+        remove(param_file("eta_top", label).c_str());
+    }
+
+    if (settings->incl_events) {
+        remove(param_file("psi", label).c_str());
+        remove(param_file("pi", label).c_str());
+        remove(param_file("a_pi", label).c_str());
+        remove(param_file("a_pi_sum", label).c_str());
+        remove(param_file("epsilon", label).c_str());
+        remove(param_file("pi_top", label).c_str());
+    }
+}
+
+// multi-process: which rank visits each document.  By default documents are
+// dealt round-robin.  With date shards, each rank gets a contiguous range of
+// dates with about the same number of training documents; a document only
+// reaches the event_dur dates ending at its own, so a rank keeps only the pi
+// rows of its dates and the event_dur - 1 before them.  Rows just before a
+// shard boundary (the halos) are reached from both sides, so every rank keeps
+// them and their statistics are summed; every other row is only touched by
+// one rank.
+void Capsule::partition() {
+    doc_owner.assign(data->doc_count(), 0);
+    date_kept.assign(data->date_count(), 1);
+    entity_kept.assign(data->entity_count(), 1);
+    if (!cluster)
+        return;
+
+    int size = cluster->get_size();
+    if (settings->shard_entities) {
+        partition_entities();
+        return;
+    }
+    if (!settings->shard_dates) {
+        for (int doc = 0; doc < data->doc_count(); doc++)
+            doc_owner[doc] = doc % size;
+        return;
+    }
+
+    // cut after the date that brings the running count past the next
+    // rank's share, keeping at least one date for each rank still to come
+    int dates = data->date_count();
+    long total = data->train_doc_count();
+    long seen = 0;
+    vector<int> shard_start(size + 1, dates);
+    shard_start[0] = 0;
+    for (int d = 0, r = 1; d < dates - 1 && r < size; d++) {
+        seen += data->train_doc_count_by_date(d);
+        if (seen * size >= total * r || dates - (d + 1) <= size - r)
+            shard_start[r++] = d + 1;
+    }
+
+    date_owner.assign(dates, 0);
+    for (int r = 0; r < size; r++) {
+        for (int d = shard_start[r]; d < shard_start[r + 1]; d++)
+            date_owner[d] = r;
+    }
+    for (int doc = 0; doc < data->doc_count(); doc++)
+        doc_owner[doc] = date_owner[data->get_date(doc)];
+
+    int rank = cluster->get_rank();
+    date_kept.assign(dates, 0);
+    for (int d = max(0, shard_start[rank] - settings->event_dur + 1); d < shard_start[rank + 1]; d++)
+        date_kept[d] = 1;
+    vector<char> halo(dates, 0);
+    for (int r = 1; r < size; r++) {
+        for (int d = max(0, shard_start[r] - settings->event_dur + 1); d < shard_start[r]; d++)
+            halo[d] = 1;
+    }
+    halo_dates.clear();
+    for (int d = 0; d < dates; d++) {
+        if (halo[d]) {
+            date_kept[d] = 1;
+            halo_dates.push_back(d);
+        }
+    }
+    printf("\trank %d: dates %d to %d, %lu halo dates\n", rank, shard_start[rank],
+        shard_start[rank + 1] - 1, (unsigned long) halo_dates.size());
+}
+
+// entity shards: each rank owns whole entities, with their documents, eta
+// rows, xi and phi columns, so only beta, psi and pi need summing.  Entity
+// sizes are skewed, so entities are dealt largest first to the rank with the
+// fewest training documents so far (longest processing time first)
+void Capsule::partition_entities() {
+    int size = cluster->get_size();
+    vector<int> order(data->entity_count());
+    for (int e = 0; e < data->entity_count(); e++)
+        order[e] = e;
+    stable_sort(order.begin(), order.end(), [this](int a, int b) {
+        return data->train_doc_count_by_entity(a) > data->train_doc_count_by_entity(b);
+    });
+
+    // (load, rank) min-heap; ties go to the lower rank, so every rank
+    // computes the same assignment
+    vector<pair<long, int> > load(size);
+    for (int r = 0; r < size; r++)
+        load[r] = make_pair(0L, r);
+    entity_owner.assign(data->entity_count(), 0);
+    for (size_t i = 0; i < order.size(); i++) {
+        pop_heap(load.begin(), load.end(), greater<pair<long, int> >());
+        entity_owner[order[i]] = load.back().second;
+        load.back().first += data->train_doc_count_by_entity(order[i]);
+        push_heap(load.begin(), load.end(), greater<pair<long, int> >());
+    }
+
+    int rank = cluster->get_rank();
+    int entities = 0;
+    for (int e = 0; e < data->entity_count(); e++) {
+        entity_kept[e] = entity_owner[e] == rank;
+        entities += entity_kept[e];
+    }
+    for (int doc = 0; doc < data->doc_count(); doc++)
+        doc_owner[doc] = entity_owner[data->get_entity(doc)];
+
+    long docs = 0;
+    for (int r = 0; r < size; r++) {
+        if (load[r].second == rank)
+            docs = load[r].first;
+    }
+    printf("\trank %d: %d entities, %ld training documents\n", rank, entities, docs);
+}
+
+// multi-process: add up the statistics of every rank's documents, which all
+// start from the priors set in reset_helper_params, so that every rank runs
+// the same global updates on the totals
+void Capsule::reduce_statistics() {
+    if (settings->incl_topics)
+        cluster->sum(a_beta.memptr(), a_beta.n_elem, settings->a_beta);
+
+    // with entity shards, each entity's statistics come from one rank only
+    if (settings->incl_topics && !settings->shard_entities) {
+        cluster->sum(a_phi.memptr(), a_phi.n_elem, settings->a_phi);
+        cluster->sum(b_phi.memptr(), b_phi.n_elem, settings->b_phi);
+    }
+
+    if (settings->incl_entity && !settings->shard_entities) {
+        cluster->sum(a_xi.memptr(), a_xi.n_elem, settings->a_xi);
+        cluster->sum(b_xi.memptr(), b_xi.n_elem, settings->b_xi);
+        cluster->sum(eta.shape_data(), eta.nnz(), settings->a_eta);
+    }
+
+    if (settings->incl_events) {
+        cluster->sum(a_psi.memptr(), a_psi.n_elem, settings->a_psi);
+        cluster->sum(b_psi.memptr(), b_psi.n_elem, settings->b_psi);
+        if (settings->shard_dates)
+            exchange_halos();
+        else
+            cluster->sum(pi.shape_data(), pi.nnz(), settings->a_pi);
+    }
+}
+
+// date shards: sum the pi statistics of the halo rows, the only rows that
+// more than one rank adds to
+void Capsule::exchange_halos() {
+    vector<float> shapes;
+    for (size_t i = 0; i < halo_dates.size(); i++) {
+        float* row = pi.shape_data(halo_dates[i]);
+        shapes.insert(shapes.end(), row, row + pi.nnz(halo_dates[i]));
+    }
+    cluster->sum(shapes.data(), shapes.size(), settings->a_pi);
+    for (size_t i = 0, j = 0; i < halo_dates.size(); i++) {
+        float* row = pi.shape_data(halo_dates[i]);
+        for (uword c = 0; c < pi.nnz(halo_dates[i]); c++)
+            row[c] = shapes[j++];
+    }
+}
+
+// multi-process: collect the local parameters of every rank's documents on
+// the aggregator, for saving; with date or entity shards, also the global
+// parameters that only their owners keep up to date (pi or eta into snap)
+void Capsule::gather_locals(param_snapshot* snap) {
+    if (settings->incl_topics) {
+        cluster->gather(theta.memptr(), theta.n_rows, doc_owner);
+        if (settings->shard_entities)
+            cluster->gather(phi.memptr(), phi.n_rows, entity_owner);
+    }
+
+    if (settings->incl_entity) {
+        cluster->gather(zeta.memptr(), 1, doc_owner);
+        if (settings->shard_entities) {
+            cluster->gather(xi.memptr(), 1, entity_owner);
+            gather_rows(eta, entity_owner, snap->eta, snap->a_eta);
+        }
+    }
+
+    if (settings->incl_events) {
+        // epsilon is sparse; send each document's window, by lag
+        fmat by_lag(settings->event_dur, data->doc_count());
+        by_lag.zeros();
+        for (int doc = 0; doc < data->doc_count(); doc++) {
+            if (!owns(doc))
+                continue;
+            int date = data->get_date(doc);
+            for (int d = max(0, date - settings->event_dur + 1); d <= date; d++)
+                by_lag(date - d, doc) = epsilon(d, doc);
+        }
+        cluster->gather(by_lag.memptr(), by_lag.n_rows, doc_owner);
+
+        if (cluster->get_rank() == 0) {
+            for (int doc = 0; doc < data->doc_count(); doc++) {
+                if (owns(doc))
+                    continue;
+                int date = data->get_date(doc);
+                for (int d = max(0, date - settings->event_dur + 1); d <= date; d++)
+                    epsilon(d, doc) = by_lag(date - d, doc);
+            }
+        }
+
+        if (settings->shard_dates)
+            gather_rows(pi, date_owner, snap->pi, snap->a_pi);
+    }
+}
+
+// date or entity shards: every rank sends the rows it owns, as (cells, mean
+// default, shape default, terms, means, shapes) per row, and the aggregator
+// assembles the whole of pi or eta, only for as long as it takes to save
+void Capsule::gather_rows(const SparseDirichlet& dist, const vector<int>& row_owner,
+    sparse_rows& means, sparse_rows& shapes) {
+    int rank = cluster->get_rank();
+    sparse_rows my_means, my_shapes;
+    dist.snapshot(my_means, false);
+    dist.snapshot(my_shapes, true);
+
+    vector<char> mine;
+    for (int row = 0; rank > 0 && row < dist.rows(); row++) {
+        if (row_owner[row] != rank)
+            continue;
+        uint32_t cells = my_means.row_ptr[row+1] - my_means.row_ptr[row];
+        uword first = my_means.row_ptr[row];
+        const char* fields[] = {(const char*) &cells, (const char*) &my_means.defaults(row),
+            (const char*) &my_shapes.defaults(row), (const char*) (my_means.col_idx.data() + first),
+            (const char*) (my_means.values.memptr() + first),
+            (const char*) (my_shapes.values.memptr() + first)};
+        size_t bytes[] = {sizeof(cells), sizeof(float), sizeof(float),
+            cells * sizeof(int), cells * sizeof(float), cells * sizeof(float)};
+        for (int f = 0; f < 6; f++)
+            mine.insert(mine.end(), fields[f], fields[f] + bytes[f]);
+    }
+    vector<vector<char> > received;
+    cluster->collect(mine, received);
+    if (rank > 0)
+        return;
+
+    means.rows = shapes.rows = my_means.rows;
+    means.cols = shapes.cols = my_means.cols;
+    means.row_ptr.assign(1, 0);
+    means.col_idx.clear();
+    means.defaults = fvec(means.rows);
+    shapes.defaults = fvec(shapes.rows);
+    vector<float> mean_values, shape_values;
+    vector<const char*> next(cluster->get_size());
+    for (int r = 0; r < cluster->get_size(); r++)
+        next[r] = received[r].data();
+    for (int row = 0; row < dist.rows(); row++) {
+        if (row_owner[row] == 0) {
+            uword first = my_means.row_ptr[row], last = my_means.row_ptr[row+1];
+            means.defaults(row) = my_means.defaults(row);
+            shapes.defaults(row) = my_shapes.defaults(row);
+            means.col_idx.insert(means.col_idx.end(), my_means.col_idx.data() + first,
+                my_means.col_idx.data() + last);
+            mean_values.insert(mean_values.end(), my_means.values.memptr() + first,
+                my_means.values.memptr() + last);
+            shape_values.insert(shape_values.end(), my_shapes.values.memptr() + first,
+                my_shapes.values.memptr() + last);
+        } else {
+            const char*& p = next[row_owner[row]];
+            uint32_t cells;
+            memcpy(&cells, p, sizeof(cells));
+            p += sizeof(cells);
+            memcpy(&means.defaults(row), p, sizeof(float));
+            memcpy(&shapes.defaults(row), p + sizeof(float), sizeof(float));
+            p += 2 * sizeof(float);
+            const int* terms = (const int*) p;
+            means.col_idx.insert(means.col_idx.end(), terms, terms + cells);
+            p += cells * sizeof(int);
+            const float* values = (const float*) p;
+            mean_values.insert(mean_values.end(), values, values + cells);
+            shape_values.insert(shape_values.end(), values + cells, values + 2 * cells);
+            p += 2 * cells * sizeof(float);
+        }
+        means.row_ptr.push_back(means.col_idx.size());
+    }
+    means.values = fvec(mean_values.size());
+    copy(mean_values.begin(), mean_values.end(), means.values.memptr());
+    shapes.values = fvec(shape_values.size());
+    copy(shape_values.begin(), shape_values.end(), shapes.values.memptr());
+    shapes.row_ptr = means.row_ptr;
+    shapes.col_idx = means.col_idx;
 }
 
 void Capsule::update_shape(int doc, int term, int count) {
@@ -685,49 +1807,273 @@ void Capsule::update_shape(int doc, int term, int count) {
 
     double omega_sum = 0;
 
-    fvec omega_topics, omega_event;
     double omega_entity = 0;
+    long eta_cell = 0;
 
+    bool truncated = false;
     if (settings->incl_topics) {
-        omega_topics = exp(logtheta.col(doc) + logbeta.col(term));
-        omega_sum += accu(omega_topics);
+        double topic_sum;
+        if (settings->low_memory) {
+            for (int k = 0; k < settings->k; k++)
+                tile_logbeta(k) = gsl_sf_psi(a_beta_old(k, term)) - beta_psi_sum(k);
+            omega_topics = exp(doc_logtheta + tile_logbeta);
+            topic_sum = accu(omega_topics);
+        } else if (truncating() && truncated_topics(doc, term, topic_sum)) {
+            truncated = true;
+        } else {
+            omega_topics = exp(logtheta.col(doc) + logbeta.col(term));
+            topic_sum = accu(omega_topics);
+        }
+        omega_sum += topic_sum;
     }
 
     if (settings->incl_entity) {
-        omega_entity = exp(logzeta(doc) + logeta(entity, term));
+        // training terms are observed cells of their entity's row; should
+        // one be missing, it takes the prior's expected log and keeps no mass
+        eta_cell = eta.find(entity, term);
+        omega_entity = exp((settings->low_memory ? doc_logzeta : logzeta(doc)) +
+            eta.log_at(entity, eta_cell));
         omega_sum += omega_entity;
     }
 
     if (settings->incl_events) {
-        omega_event = fvec(data->date_count());
         for (int d = max(0, date - settings->event_dur + 1); d <= date; d++) {
-            omega_event(d) = exp(logepsilon(d) + logpi(d, term) + logdecay(date, d));
-            omega_sum += omega_event(d);
+            pi_cells[date - d] = pi.find(d, term);
+            double logeps = settings->low_memory ? doc_logepsilon(date - d) : logepsilon(d, doc);
+            omega_event(date - d) = exp(logeps + pi.log_at(d, pi_cells[date - d]) + logdecay(date, d));
+            omega_sum += omega_event(date - d);
         }
     }
 
     if (omega_sum == 0)
         return;
 
-    if (settings->incl_topics) {
+    if (settings->incl_topics && truncated) {
+        omega_top *= count / omega_sum;
+        for (size_t i = 0; i < doc_top.size(); i++) {
+            a_theta(doc_top[i], doc) += omega_top(i);
+            if (refit_globals && !locals_only)
+                a_beta(doc_top[i], term) += omega_top(i) * scale;
+            if (freezing && !locals_only)
+                a_beta_frozen(doc_top[i], term) += omega_top(i) * scale;
+        }
+    } else if (settings->incl_topics) {
         omega_topics *= count / omega_sum;
         a_theta.col(doc) += omega_topics;
-        a_beta.col(term) += omega_topics * scale;
+        if (refit_globals && !locals_only)
+            a_beta.col(term) += omega_topics * scale;
+        if (freezing && !locals_only)
+            a_beta_frozen.col(term) += omega_topics * scale;
     }
 
     if (settings->incl_entity) {
         omega_entity *= count / omega_sum;
         a_zeta(doc) += omega_entity;
-        a_eta(entity, term) += omega_entity * ent_scale[entity];
+        if (eta_cell >= 0 && !locals_only && (refit_globals || entity >= first_new_entity))
+            eta.add(eta_cell, omega_entity * ent_scale[entity]);
+        if (eta_cell >= 0 && freezing && !locals_only)
+            eta_frozen(eta_cell) += omega_entity * ent_scale[entity];
     }
 
     if (settings->incl_events) {
         omega_event *= count / omega_sum;
         for (int d = max(0, date - settings->event_dur + 1); d <= date; d++) {
-            a_epsilon(d, doc) += omega_event[d];
-            a_pi(d, term) += omega_event[d] * evt_scale[d];
+            a_epsilon(d, doc) += omega_event[date - d];
+            long cell = pi_cells[date - d];
+            if (cell < 0)
+                continue;
+            if (!locals_only && (refit_globals || d >= focus_date))
+                pi.add(cell, omega_event[date - d] * evt_scale[d]);
+            if (freezing && !locals_only)
+                pi_frozen(cell) += omega_event[date - d] * evt_scale[d];
+        }
+    }
+}
+
+// passes over a document's terms that update only its locals, with the
+// globals fixed, until their expected logs settle (or the document's cap);
+// returns the number of passes
+int Capsule::refine_locals(int doc, int date, const vector<int>& terms,
+    const vector<int>& counts) {
+    int cap = min(settings->inner_iter, inner_used[doc] + 2);
+    int pass = 1;
+    locals_only = true;
+    for (; pass < cap; pass++) {
+        if (truncating())
+            select_topics(doc);
+        for (size_t j = 0; j < terms.size(); j++)
+            update_shape(doc, terms[j], counts[j]);
+        if (finish_locals(doc, date) < settings->inner_tol)
+            break;
+    }
+    locals_only = false;
+    int passes = min(pass, cap - 1);
+    inner_used[doc] = passes + 1;
+    return passes;
+}
+
+// a document's locals from the shapes of a pass, and the shapes reset for
+// the next; returns the largest change of an expected log
+double Capsule::finish_locals(int doc, int date) {
+    int first = max(0, date - settings->event_dur + 1);
+    double change = 0;
+
+    if (settings->low_memory) {
+        // begin_doc takes the new expected logs and resets the shapes
+        fvec old_logtheta = doc_logtheta;
+        double old_logzeta = doc_logzeta;
+        fvec old_logepsilon = doc_logepsilon;
+        if (settings->incl_topics)
+            b_theta.col(doc) = cell_theta_rate;
+        if (settings->incl_entity)
+            b_zeta(doc) = cell_zeta_rate;
+        begin_doc(doc, date);
+        if (settings->incl_topics)
+            change = max(change, (double) max(abs(doc_logtheta - old_logtheta)));
+        if (settings->incl_entity)
+            change = max(change, fabs(doc_logzeta - old_logzeta));
+        if (settings->incl_events) {
+            for (int d = first; d <= date; d++)
+                change = max(change, (double) fabs(doc_logepsilon(date - d) -
+                    old_logepsilon(date - d)));
+        }
+        return change;
+    }
+
+    if (settings->incl_topics) {
+        fvec old_logtheta = logtheta.col(doc);
+        b_theta.col(doc) = cell_theta_rate;
+        update_theta(doc);
+        change = max(change, (double) max(abs(logtheta.col(doc) - old_logtheta)));
+        a_theta.col(doc).fill(settings->a_theta);
+    }
+
+    if (settings->incl_entity) {
+        double old_logzeta = logzeta(doc);
+        b_zeta(doc) = cell_zeta_rate;
+        update_zeta(doc);
+        change = max(change, fabs(logzeta(doc) - old_logzeta));
+        a_zeta(doc) = settings->a_zeta;
+    }
+
+    if (settings->incl_events) {
+        // omega_event, free between tokens, holds the old expected logs
+        for (int d = first; d <= date; d++)
+            omega_event(date - d) = logepsilon(d, doc);
+        update_epsilon(doc, date);
+        for (int d = first; d <= date; d++) {
+            change = max(change, (double) fabs(logepsilon(d, doc) - omega_event(date - d)));
+            a_epsilon(d, doc) = settings->a_epsilon;
+        }
+    }
+    return change;
+}
+
+// after the reset of the globals' shapes: the frozen documents' last
+// contributions go back in, or, every skip_refresh iterations, are dropped
+// along with the frozen states so that all documents are recomputed against
+// the current globals
+void Capsule::add_frozen(int iteration) {
+    if ((iteration - 1) % settings->skip_refresh == 0) {
+        if (iteration > 1)
+            printf("\trecomputing all documents\n");
+        fill(doc_state.begin(), doc_state.end(), (unsigned char) DOC_ACTIVE);
+        a_beta_frozen.zeros();
+        eta_frozen.zeros();
+        pi_frozen.zeros();
+        return;
+    }
+
+    if (settings->incl_topics)
+        a_beta += a_beta_frozen;
+    if (settings->incl_entity)
+        eta.add(eta_frozen);
+    if (settings->incl_events)
+        pi.add(pi_frozen);
+}
+
+// the rates every document of a cell gets, which depend only on the cell's
+// entity and date and on the globals, fixed during the pass
+void Capsule::begin_cell(int entity, int date) {
+    cell_entity = entity;
+    cell_date = date;
+    cell_docs = 0;
+
+    if (settings->incl_topics) {
+        cell_theta_rate = phi_col(entity) + beta_total;
+        cell_theta_sum.zeros();
+    }
+
+    if (settings->incl_entity) {
+        cell_zeta_rate = xi(entity) + eta.total(entity);
+        cell_zeta_sum = 0;
+    }
+
+    if (settings->incl_events) {
+        for (int d = max(0, date - settings->event_dur + 1); d <= date; d++)
+            cell_epsilon_rate(date - d) = decay(date, d) * pi.total(d) + psi(d);
+        cell_epsilon_sum.zeros();
+    }
+}
+
+// the cell's documents' contributions to phi, xi and psi, in one go
+void Capsule::end_cell() {
+    if (cell_docs == 0)
+        return;
+    int entity = cell_entity;
+    int date = cell_date;
+
+    if (settings->incl_topics) {
+        a_phi.col(entity) += cell_docs * settings->a_theta * scale;
+        b_phi.col(entity) += cell_theta_sum * scale;
+    }
+
+    if (settings->incl_entity) {
+        a_xi(entity) += cell_docs * settings->a_zeta * ent_scale[entity];
+        b_xi(entity) += cell_zeta_sum * ent_scale[entity];
+    }
+
+    if (settings->incl_events) {
+        for (int d = max(0, date - settings->event_dur + 1); d <= date; d++) {
+            a_psi(d) += cell_docs * settings->a_epsilon * evt_scale[d];
+            b_psi(d) += cell_epsilon_sum(date - d) * evt_scale[d];
         }
     }
+    cell_docs = 0;
+}
+
+// the document's top_topics most likely topics by expected log theta, which
+// stays fixed while its tokens are visited
+void Capsule::select_topics(int doc) {
+    doc_top.resize(settings->k);
+    for (int k = 0; k < settings->k; k++)
+        doc_top[k] = k;
+    auto likelier = [this, doc](int a, int b) { return logtheta(a, doc) > logtheta(b, doc); };
+    nth_element(doc_top.begin(), doc_top.begin() + settings->top_topics - 1, doc_top.end(),
+        likelier);
+
+    doc_rest = 0;
+    for (int k = settings->top_topics; k < settings->k; k++)
+        doc_rest += exp(logtheta(doc_top[k], doc));
+    doc_top.resize(settings->top_topics);
+}
+
+// a token's responsibilities on the document's top topics, in omega_top,
+// when the other topics could take at most top_tolerance of the topic
+// mass: each takes exp(logtheta + logbeta) <= exp(logtheta) * max beta
+bool Capsule::truncated_topics(int doc, int term, double& topic_sum) {
+    topic_sum = 0;
+    for (size_t i = 0; i < doc_top.size(); i++) {
+        omega_top(i) = exp(logtheta(doc_top[i], doc) + logbeta(doc_top[i], term));
+        topic_sum += omega_top(i);
+    }
+    double bound = doc_rest * term_max_beta(term);
+    if (bound > settings->top_tolerance * (topic_sum + bound)) {
+        tokens_exact++;
+        return false;
+    }
+    tokens_truncated++;
+    return true;
 }
 
 void Capsule::update_phi(int entity) {
@@ -740,6 +2086,15 @@ void Capsule::update_phi(int entity) {
         b_phi_old.col(entity) = b_phi.col(entity);
     }
 
+    // low memory: phi lives in the _old shapes and rates
+    if (settings->low_memory) {
+        if (!settings->svi) {
+            a_phi_old.col(entity) = a_phi.col(entity);
+            b_phi_old.col(entity) = b_phi.col(entity);
+        }
+        return;
+    }
+
     for (int k = 0; k < settings->k; k++) {
         phi(k, entity) = a_phi(k, entity) / b_phi(k, entity);
         logphi(k, entity) = gsl_sf_psi(a_phi(k, entity)) - log(b_phi(k, entity));
@@ -775,6 +2130,9 @@ void Capsule::update_xi(int entity) {
 }
 
 void Capsule::update_theta(int doc) {
+    if (settings->low_memory)
+        return;
+
     for (int k = 0; k < settings->k; k++) {
         theta(k, doc) = a_theta(k, doc) / b_theta(k, doc);
         logtheta(k, doc) = gsl_sf_psi(a_theta(k, doc)) - log(b_theta(k, doc));
@@ -782,17 +2140,20 @@ void Capsule::update_theta(int doc) {
 }
 
 void Capsule::update_zeta(int doc) {
+    if (settings->low_memory)
+        return;
+
     zeta(doc) = a_zeta(doc) / b_zeta(doc);
     logzeta(doc) = gsl_sf_psi(a_zeta(doc)) - log(b_zeta(doc));
 }
 
 void Capsule::update_epsilon(int doc, int date) {
+    if (settings->low_memory)
+        return;
+
     for (int d = max(0, date - settings->event_dur + 1); d <= date; d++) {
         epsilon(d, doc) = a_epsilon(d, doc) / b_epsilon(d, doc);
         logepsilon(d, doc) = gsl_sf_psi(a_epsilon(d, doc)) - log(b_epsilon(d, doc));
-
-        a_psi(d) += settings->a_epsilon * evt_scale[d];
-        b_psi(d) += epsilon(d, doc) * evt_scale[d];
     }
 }
 
@@ -804,6 +2165,18 @@ void Capsule::update_beta(int iteration) {
         a_beta_old = a_beta * 1.0;
     }
 
+    // low memory: keep the normalized shapes and their row sums; means and
+    // expected logs are computed from them when needed
+    if (settings->low_memory) {
+        if (!settings->svi)
+            a_beta_old = a_beta * 1.0;
+        for (int k = 0; k < settings->k; k++) {
+            beta_sum(k) = accu(a_beta_old.row(k));
+            beta_psi_sum(k) = gsl_sf_psi(beta_sum(k));
+        }
+        return;
+    }
+
     for (int k = 0; k < settings->k; k++) {
         for (int v = 0; v < data->term_count(); v++) {
             beta(k, v) = a_beta(k, v);
@@ -813,42 +2186,105 @@ void Capsule::update_beta(int iteration) {
         logbeta.row(k) -= gsl_sf_psi(accu(beta.row(k)));
         beta.row(k) /= accu(beta.row(k));
     }
+    beta_total = sum(beta, 1);
+}
+
+// the given rows of m, which leaves its arena block (for the heap) when the
+// number of rows changes
+static void keep_rows(fmat& m, const uvec& rows) {
+    if (m.n_elem == 0)
+        return;
+    fmat kept = m.rows(rows);
+    m = kept;
+}
+
+static void keep_rows(fvec& v, const uvec& rows) {
+    if (v.n_elem == 0)
+        return;
+    fvec kept = v.elem(rows);
+    v = kept;
+}
+
+// a topic's usage is its mass in a_beta beyond the prior, i.e. the number of
+// tokens it explains; topics using less than prune_mass of the total for
+// prune_patience passes are dropped from every topic parameter, and K with
+// them, so the later passes only pay for the active topics
+void Capsule::prune_topics(int iteration) {
+    vec usage(settings->k);
+    for (int k = 0; k < settings->k; k++)
+        usage(k) = accu(a_beta.row(k)) - settings->a_beta * data->term_count();
+    double total = accu(usage);
+
+    vector<uword> keep;
+    for (int k = 0; k < settings->k; k++) {
+        if (usage(k) < settings->prune_mass * total)
+            topic_idle[k]++;
+        else
+            topic_idle[k] = 0;
+        if (topic_idle[k] < settings->prune_patience)
+            keep.push_back(k);
+    }
+    if ((int) keep.size() == settings->k || keep.empty())
+        return;
+
+    FILE* file = fopen((settings->outdir+"/topic_log.dat").c_str(), "a");
+    vector<int> ids, idle;
+    for (int k = 0, i = 0; k < settings->k; k++) {
+        if (i < (int) keep.size() && (int) keep[i] == k) {
+            ids.push_back(topic_id[k]);
+            idle.push_back(topic_idle[k]);
+            i++;
+        } else {
+            fprintf(file, "%d\t%d\t%f\n", iteration, topic_id[k], usage(k));
+        }
+    }
+    fclose(file);
+    printf("\tpruned %d idle topics; K = %d\n", settings->k - (int) keep.size(),
+        (int) keep.size());
+
+    uvec rows(keep.size());
+    for (size_t i = 0; i < keep.size(); i++)
+        rows(i) = keep[i];
+    fmat* matrices[] = {&beta, &logbeta, &a_beta, &a_beta_old, &phi, &logphi, &a_phi,
+        &b_phi, &a_phi_old, &b_phi_old, &theta, &logtheta, &a_theta, &b_theta,
+        &a_beta_frozen};
+    for (size_t i = 0; i < sizeof(matrices) / sizeof(matrices[0]); i++)
+        keep_rows(*matrices[i], rows);
+    keep_rows(beta_total, rows);
+    keep_rows(beta_sum, rows);
+    keep_rows(beta_psi_sum, rows);
+
+    settings->k = keep.size();
+    fvec* scratch[] = {&tile_logbeta, &doc_logtheta, &omega_topics, &cell_theta_rate,
+        &cell_theta_sum};
+    for (size_t i = 0; i < sizeof(scratch) / sizeof(scratch[0]); i++)
+        *scratch[i] = fvec(settings->k);
+    topic_id.swap(ids);
+    topic_idle.swap(idle);
+
+    // the saved parameters now have the smaller K
+    settings->save_model(settings->outdir + "/model.txt");
 }
 
 void Capsule::update_eta(int iteration) {
     if (settings->svi) {
         double rho = pow(iteration + settings->delay,
             -1 * settings->forget);
-        a_eta = (1 - rho) * a_eta_old + rho * a_eta;
-        a_eta_old = a_eta + 0.0;
+        eta.blend(rho);
     }
 
-    for (int n = 0; n < data->entity_count(); n++) {
-        for (int v = 0; v < data->term_count(); v++) {
-            eta(n, v) = a_eta(n, v);
-            logeta(n, v) = gsl_sf_psi(a_eta(n, v));
-        }
-
-        logeta.row(n) -= gsl_sf_psi(accu(eta.row(n)));
-        eta.row(n) /= accu(eta.row(n));
-    }
+    for (int n = 0; n < data->entity_count(); n++)
+        eta.normalize(n);
 }
 
 void Capsule::update_pi(int date) {
     if (settings->svi) {
         double rho = pow(iter_count_date[date] + settings->delay,
             -1 * settings->forget);
-        a_pi.row(date) = (1 - rho) * a_pi_old.row(date) + rho * a_pi.row(date);
-        a_pi_old.row(date) = a_pi.row(date);
+        pi.blend(date, rho);
     }
 
-    for (int v = 0; v < data->term_count(); v++) {
-        pi(date, v)  = a_pi(date, v);
-        logpi(date, v) = gsl_sf_psi(a_pi(date, v));
-    }
-
-    logpi.row(date) -= gsl_sf_psi(accu(pi.row(date)));
-    pi.row(date) /= accu(pi.row(date));
+    pi.normalize(date);
 }
 
 
@@ -862,6 +2298,8 @@ double Capsule::get_ave_log_likelihood() {//TODO: rename (it's not ave)
     int doc, term, count;
     for (int i = 0; i < data->num_validation(); i++) {
         doc = data->get_validation_doc(i);
+        if (!owns(doc))
+            continue;
         term = data->get_validation_term(i);
         count = data->get_validation_count(i);
 
@@ -872,6 +2310,8 @@ double Capsule::get_ave_log_likelihood() {//TODO: rename (it's not ave)
         //likelihood += ll;
         //printf("\t%f\t[%d]\t=> + %f\n", prediction, count, ll);
     }
+    if (cluster)
+        cluster->sum(&likelihood, 1);
 
     printf("likelihood %f\n", likelihood);
 
@@ -975,40 +2415,40 @@ double Capsule::elbo_extra() {
 
     // subtract q
     if (settings->incl_events) {
-        rvtotal -= p_dir(pi, a_pi);
+        rvtotal -= pi.p_dir();
         //rvtotal -= p_gamma(epsilon, a_epsilon, b_epsilon);
         rvtotal -= p_gamma(psi, a_psi, b_psi);
     }
 
     if (settings->incl_entity) {
-        rvtotal -= p_dir(eta, a_eta);
-        rvtotal -= p_gamma(zeta, a_zeta, b_zeta);
+        rvtotal -= eta.p_dir();
+        rvtotal -= p_gamma(zeta_mean(), a_zeta, b_zeta);
         rvtotal -= p_gamma(xi, a_xi, b_xi);
     }
 
     if (settings->incl_topics) {
-        rvtotal -= p_dir(beta, a_beta);
-        rvtotal -= p_gamma(theta, a_theta, b_theta);
-        rvtotal -= p_gamma(phi, a_phi, b_phi);
+        rvtotal -= p_dir(beta_mean(), a_beta);
+        rvtotal -= p_gamma(theta_mean(), a_theta, b_theta);
+        rvtotal -= p_gamma(phi_mean(), a_phi, b_phi);
     }
 
     // add p
     if (settings->incl_events) {
-        rvtotal += p_dir(pi, settings->a_pi);
+        rvtotal += pi.p_dir(settings->a_pi);
         //rvtotal += p_gamma(epsilon, settings->a_epsilon, psi);
         rvtotal += p_gamma(psi, settings->a_psi, settings->b_psi);
     }
 
     if (settings->incl_entity) {
-        rvtotal += p_dir(eta, settings->a_eta);
-        rvtotal += p_gammaM(zeta, settings->a_zeta, xi);
+        rvtotal += eta.p_dir(settings->a_eta);
+        rvtotal += p_gammaM(zeta_mean(), settings->a_zeta, xi);
         rvtotal += p_gamma(xi, settings->a_xi, settings->b_xi);
     }
 
     if (settings->incl_topics) {
-        rvtotal += p_dir(beta, settings->a_beta);
-        rvtotal += p_gamma(theta, settings->a_theta, phi);
-        rvtotal += p_gamma(phi, settings->a_phi, settings->b_phi);
+        rvtotal += p_dir(beta_mean(), settings->a_beta);
+        rvtotal += p_gamma(theta_mean(), settings->a_theta, phi_mean());
+        rvtotal += p_gamma(phi_mean(), settings->a_phi, settings->b_phi);
     }
     printf("end ELBO\n");
 
@@ -1033,6 +2473,31 @@ void Capsule::log_convergence(int iteration, double ave_ll, double delta_ll) {
     fclose(file);
 }
 
+// cache misses of the E-step pass, per doc-term count visited (-1: the
+// counter is not available)
+void Capsule::log_cache(int iteration, long tokens, long long misses, long long l1d) {
+    double per_token = tokens > 0 && misses >= 0 ? (double) misses / tokens : -1;
+    double l1d_per_token = tokens > 0 && l1d >= 0 ? (double) l1d / tokens : -1;
+    printf("\t%ld tokens, %.3f cache misses and %.3f L1d read misses per token\n",
+        tokens, per_token, l1d_per_token);
+
+    FILE* file = fopen((settings->outdir+"/cache_log.dat").c_str(), "a");
+    fprintf(file, "%d\t%ld\t%lld\t%f\t%lld\t%f\n", iteration, tokens, misses, per_token,
+        l1d, l1d_per_token);
+    fclose(file);
+}
+
+// tokens of the E-step pass that kept to their document's top topics
+void Capsule::log_truncation(int iteration) {
+    long tokens = tokens_truncated + tokens_exact;
+    double share = tokens > 0 ? (double) tokens_truncated / tokens : 0;
+    printf("\t%.1f%% of tokens on the top %d topics\n", 100 * share, settings->top_topics);
+
+    FILE* file = fopen((settings->outdir+"/truncation_log.dat").c_str(), "a");
+    fprintf(file, "%d\t%ld\t%ld\t%f\n", iteration, tokens_truncated, tokens_exact, share);
+    fclose(file);
+}
+
 void Capsule::log_time(int iteration, double duration) {
     FILE* file = fopen((settings->outdir+"/time_log.dat").c_str(), "a");
     fprintf(file, "%d\t%.f\n", iteration, duration);
@@ -1046,25 +2511,8 @@ void Capsule::log_user(FILE* file, int user, int heldout, double rmse, double ma
 }
 
 double Capsule::f(int doc_date, int event_date) {
-    if (event_date > doc_date)
-        return 0;
-    if (settings->event_decay == "step") {
-        // dur is the number of active time windows
-        if (event_date <= (doc_date - settings->event_dur))
-            return 0;
-        return 1;
-    }
-    if (settings->event_decay == "linear") {
-        if (event_date <= (doc_date - settings->event_dur))
-            return 0;
-        return (1.0-(0.0+doc_date-event_date)/settings->event_dur);
-    }
-    if (settings->event_decay == "exponential") {
-        if (doc_date >= event_date + settings->event_dur)
-            return 0;
-        return exp(- (doc_date - event_date) / (settings->event_dur/5.0));
-    }
-    return 0; // we should never get here
+    // recall: decay(lag) is zero for future events and beyond event_dur
+    return settings->decay(doc_date - event_date);
 }
 
 double Capsule::get_event_strength(int date) {
@@ -1,12 +1,21 @@
+#ifndef CAPSULE_H
+#define CAPSULE_H
+
 #include <iostream>
 #define ARMA_64BIT_WORD
 #include <armadillo>
-#include <gsl/gsl_rng.h>
 #include <gsl/gsl_sf.h>
 #include <list>
+#include <memory>
 
 #include "utils.h"
 #include "data.h"
+#include "writer.h"
+#include "dirichlet.h"
+#include "cluster.h"
+#include "arena.h"
+#include "perf.h"
+#include "philox.h"
 
 using namespace std;
 using namespace arma;
@@ -46,6 +55,40 @@ struct model_settings {
     int    min_iter;
     double likelihood_delta;
     bool   overwrite;
+    bool   save_text;
+    int    save_top;
+    bool   save_shapes;
+    double epsilon_min;
+
+    bool   low_memory;
+
+    string warm_start;
+    int    refresh_freq;
+
+    bool   shard_dates;
+    bool   shard_entities;
+
+    string arena;
+
+    string doc_order;
+    bool   cache_stats;
+
+    bool   remap_terms;
+    int    min_count;
+    double max_df;
+    int    hash_terms;
+
+    int    top_topics;
+    double top_tolerance;
+
+    int    prune_patience;
+    double prune_mass;
+
+    int    inner_iter;
+    double inner_tol;
+
+    double skip_tol;
+    int    skip_refresh;
 
     bool   svi;
     bool   final_pass;
@@ -63,7 +106,7 @@ struct model_settings {
              bool topics, bool entity, bool event, int dur, string decay,
              long rand, int savef, int evalf, int convf,
              int iter_max, int iter_min, double delta, bool overw,
-             bool finalpass,
+             bool text, int top, double eps_min, bool lowmem, bool finalpass,
              int sample, double svi_delay, double svi_forget,
              int num_factors) {
         verbose = print;
@@ -101,6 +144,30 @@ struct model_settings {
         min_iter = iter_min;
         likelihood_delta = delta;
         overwrite = overw;
+        save_text = text;
+        save_top = top;
+        save_shapes = false;
+        epsilon_min = eps_min;
+        low_memory = lowmem;
+        warm_start = "";
+        refresh_freq = 0;
+        shard_dates = false;
+        shard_entities = false;
+        arena = "transparent";
+        doc_order = "id";
+        cache_stats = false;
+        remap_terms = false;
+        min_count = 1;
+        max_df = 0;
+        hash_terms = 0;
+        top_topics = 0;
+        top_tolerance = 0.01;
+        prune_patience = 0;
+        prune_mass = 0.001;
+        inner_iter = 1;
+        inner_tol = 0.001;
+        skip_tol = 0;
+        skip_refresh = 10;
 
         final_pass = finalpass;
         sample_size = sample;
@@ -114,10 +181,162 @@ struct model_settings {
         svi = setting;
     }
 
+    void set_low_memory(bool setting) {
+        low_memory = setting;
+    }
+
     void set_sample_size(int setting) {
         sample_size = setting;
     }
 
+    // continue from the fit saved in dir (see Capsule::warm_start), with a
+    // full pass over all documents every refresh iterations (0: never)
+    void set_warm_start(string dir, int refresh) {
+        warm_start = dir;
+        refresh_freq = refresh;
+    }
+
+    // multi-process runs: split the documents by contiguous date ranges or
+    // by entity rather than round-robin (see Capsule::partition)
+    void set_shard_dates(bool setting) {
+        shard_dates = setting;
+    }
+
+    void set_shard_entities(bool setting) {
+        shard_entities = setting;
+    }
+
+    // backing of the parameter arena (see Arena::reserve)
+    void set_arena(string setting) {
+        arena = setting;
+    }
+
+    // order in which documents are visited (see Data::order_documents), and
+    // whether to count the E-step's cache misses
+    void set_doc_order(string order, bool stats) {
+        doc_order = order;
+        cache_stats = stats;
+    }
+
+    // term numbering and pruning (see Data::set_vocabulary)
+    void set_vocabulary(bool remap, int count, double df) {
+        remap_terms = remap;
+        min_count = count;
+        max_df = df;
+    }
+
+    // buckets input term ids are hashed into (see hash_term); 0 for none
+    void set_hashing(int buckets) {
+        hash_terms = buckets;
+    }
+
+    // approximate E-step: each token's topic responsibilities on its
+    // document's m most likely topics only, unless the others could take
+    // more than a share tolerance of them; 0 for exact
+    void set_top_topics(int m, double tolerance) {
+        top_topics = m;
+        top_tolerance = tolerance;
+    }
+
+    // drop topics whose share of the topic mass stays below mass for
+    // patience passes in a row; 0 to keep all K
+    void set_topic_pruning(int patience, double mass) {
+        prune_patience = patience;
+        prune_mass = mass;
+    }
+
+    // up to passes passes over each document per iteration, all but the
+    // last updating only its locals, until their expected logs change by
+    // less than tolerance
+    void set_inner(int passes, double tolerance) {
+        inner_iter = passes;
+        inner_tol = tolerance;
+    }
+
+    // with save_top: also save the full shapes (a_beta, a_eta, a_pi), which
+    // warm starts and fold-in need, rather than only their row sums
+    void set_save_shapes(bool shapes) {
+        save_shapes = shapes;
+    }
+
+    // batch: documents whose expected logs change by less than tolerance
+    // keep their locals and their last contributions to the globals, and
+    // every refresh iterations all documents are recomputed
+    void set_skipping(double tolerance, int refresh) {
+        skip_tol = tolerance;
+        skip_refresh = refresh;
+    }
+
+    // weight of an event on a document dated `lag` dates after it
+    double decay(int lag) {
+        if (lag < 0 || lag >= event_dur)
+            return 0;
+        if (event_decay == "step")
+            return 1;
+        if (event_decay == "linear")
+            return 1.0 - (0.0 + lag) / event_dur;
+        if (event_decay == "exponential")
+            return exp(- lag / (event_dur / 5.0));
+        return 0; // we should never get here
+    }
+
+    // the settings a fitted model needs to be used again (see FoldIn), as
+    // "key value" lines
+    void save_model(string filename) {
+        FILE* file = fopen(filename.c_str(), "w");
+        fprintf(file, "k %d\n", k);
+        fprintf(file, "incl_topics %d\n", incl_topics);
+        fprintf(file, "incl_entity %d\n", incl_entity);
+        fprintf(file, "incl_events %d\n", incl_events);
+        fprintf(file, "event_dur %d\n", event_dur);
+        fprintf(file, "event_decay %s\n", event_decay.c_str());
+        fprintf(file, "hash_terms %d\n", hash_terms);
+        fprintf(file, "a_phi %.17g\n", a_phi);
+        fprintf(file, "b_phi %.17g\n", b_phi);
+        fprintf(file, "a_psi %.17g\n", a_psi);
+        fprintf(file, "b_psi %.17g\n", b_psi);
+        fprintf(file, "a_xi %.17g\n", a_xi);
+        fprintf(file, "b_xi %.17g\n", b_xi);
+        fprintf(file, "a_theta %.17g\n", a_theta);
+        fprintf(file, "a_epsilon %.17g\n", a_epsilon);
+        fprintf(file, "a_zeta %.17g\n", a_zeta);
+        fprintf(file, "a_pi %.17g\n", a_pi);
+        fprintf(file, "a_beta %.17g\n", a_beta);
+        fprintf(file, "a_eta %.17g\n", a_eta);
+        fclose(file);
+    }
+
+    bool load_model(string filename) {
+        FILE* file = fopen(filename.c_str(), "r");
+        if (!file)
+            return false;
+        char key[64], value[256];
+        while (fscanf(file, "%63s %255s", key, value) == 2) {
+            string name = key;
+            if (name == "k")                k = atoi(value);
+            else if (name == "incl_topics") incl_topics = atoi(value);
+            else if (name == "incl_entity") incl_entity = atoi(value);
+            else if (name == "incl_events") incl_events = atoi(value);
+            else if (name == "event_dur")   event_dur = atoi(value);
+            else if (name == "event_decay") event_decay = value;
+            else if (name == "hash_terms")  hash_terms = atoi(value);
+            else if (name == "a_phi")       a_phi = atof(value);
+            else if (name == "b_phi")       b_phi = atof(value);
+            else if (name == "a_psi")       a_psi = atof(value);
+            else if (name == "b_psi")       b_psi = atof(value);
+            else if (name == "a_xi")        a_xi = atof(value);
+            else if (name == "b_xi")        b_xi = atof(value);
+            else if (name == "a_theta")     a_theta = atof(value);
+            else if (name == "a_epsilon")   a_epsilon = atof(value);
+            else if (name == "a_zeta")      a_zeta = atof(value);
+            else if (name == "a_pi")        a_pi = atof(value);
+            else if (name == "a_beta")      a_beta = atof(value);
+            else if (name == "a_eta")       a_eta = atof(value);
+        }
+        fclose(file);
+        return true;
+    }
+
     void save(string filename, string msg) {
         FILE* file = fopen(filename.c_str(), "w");
 
@@ -166,7 +385,45 @@ struct model_settings {
         fprintf(file, "\tminimum number of iterations:             %d\n", min_iter);
         fprintf(file, "\tchange in log likelihood for convergence: %f\n", likelihood_delta);
         fprintf(file, "\tfinal pass after convergence:             %s\n", final_pass ? "yes" : "no");
+        fprintf(file, "\tlow memory (recompute means and logs):    %s\n", low_memory ? "yes" : "no");
         fprintf(file, "\tonly keep latest save (overwrite old):    %s\n", overwrite ? "yes" : "no");
+        fprintf(file, "\tparameter output format:                  %s\n", save_text ? "text" : "binary");
+        if (save_top > 0) {
+            fprintf(file, "\ttop terms saved per row:                  %d\n", save_top);
+            fprintf(file, "\tfull shapes saved with top terms:         %s\n", save_shapes ? "yes" : "no");
+        }
+        if (epsilon_min > 0)
+            fprintf(file, "\tminimum saved epsilon:                    %e\n", epsilon_min);
+        if (warm_start != "") {
+            fprintf(file, "\twarm start from:                          %s\n", warm_start.c_str());
+            fprintf(file, "\tfull refresh frequency:                   %d\n", refresh_freq);
+        }
+        if (shard_dates)
+            fprintf(file, "\tprocesses split the dates:                yes\n");
+        if (shard_entities)
+            fprintf(file, "\tprocesses split the entities:             yes\n");
+        fprintf(file, "\tparameter arena:                          %s\n", arena.c_str());
+        fprintf(file, "\tdocument order:                           %s\n", doc_order.c_str());
+        if (remap_terms)
+            fprintf(file, "\tterms numbered by count:                  yes\n");
+        if (min_count > 1)
+            fprintf(file, "\tminimum term count:                       %d\n", min_count);
+        if (max_df > 0)
+            fprintf(file, "\tmaximum term document frequency:          %f\n", max_df);
+        if (hash_terms > 0)
+            fprintf(file, "\tterm hash buckets:                        %d\n", hash_terms);
+        if (top_topics > 0)
+            fprintf(file, "\ttop topics per token (tolerance):         %d (%f)\n", top_topics,
+                top_tolerance);
+        if (prune_patience > 0)
+            fprintf(file, "\tprune topics below mass (patience):       %f (%d)\n", prune_mass,
+                prune_patience);
+        if (inner_iter > 1)
+            fprintf(file, "\tpasses per document (tolerance):          %d (%f)\n", inner_iter,
+                inner_tol);
+        if (skip_tol > 0)
+            fprintf(file, "\tskip settled documents below (refresh):   %f (%d)\n", skip_tol,
+                skip_refresh);
 
         if (svi) {
             fprintf(file, "\nStochastic variational inference parameters\n");
@@ -181,11 +438,42 @@ struct model_settings {
     }
 };
 
+// copies of the saved parameters, handed off to the background writer
+struct param_snapshot {
+    fmat phi;
+    fmat beta;
+    fmat a_beta;
+    fmat theta;
+    fvec xi;
+    sparse_rows eta;
+    sparse_rows a_eta;
+    fvec zeta;
+    fvec psi;
+    sparse_rows pi;
+    sparse_rows a_pi;
+    vector<event_record> epsilon;
+
+    // top-N export (save_top > 0) in place of the dense means above; unless
+    // the shapes are saved too, only their row sums (a_beta over terms)
+    fvec a_beta_sum;
+    fvec a_eta_sum;
+    fvec a_pi_sum;
+    fvec beta_residual;
+    fvec eta_residual;
+    fvec pi_residual;
+    vector<top_entry> beta_top;
+    vector<top_entry> eta_top;
+    vector<top_entry> pi_top;
+};
+
 class Capsule {
     private:
         model_settings* settings;
         Data* data;
 
+        // backs the dense blocks below; declared first so it outlives them
+        Arena arena;
+
         // model parameters
         fmat phi;     // entity concerns (topics/general)
         fvec psi;     // event strengths
@@ -194,8 +482,8 @@ class Capsule {
         sp_fmat epsilon; // doc events
         fvec zeta;    // doc entity relevance
         fmat beta;    // topics
-        fmat pi;      // event descriptions
-        fmat eta;     // entity descriptions
+        SparseDirichlet pi;  // event descriptions
+        SparseDirichlet eta; // entity descriptions
         fmat logphi;  // log variants of above
         fvec logpsi;
         fvec logxi;
@@ -203,8 +491,6 @@ class Capsule {
         sp_fmat logepsilon;
         fvec logzeta;
         fmat logbeta;
-        fmat logpi;
-        fmat logeta;
 
         // helper parameters
         fmat decay;
@@ -222,8 +508,6 @@ class Capsule {
         fvec a_zeta;
         fvec b_zeta;
         fmat a_beta;
-        fmat a_pi;
-        fmat a_eta;
         fmat a_phi_old;
         fmat b_phi_old;
         fvec a_psi_old;
@@ -231,19 +515,129 @@ class Capsule {
         fvec a_xi_old;
         fvec b_xi_old;
         fmat a_beta_old;
-        fmat a_pi_old;
-        fmat a_eta_old;
         sp_fmat event_cells;
 
-        // random number generator
-        gsl_rng* rand_gen;
+        // topic row sums: of beta, and (low memory) of the normalized shapes
+        fvec beta_total;
+        fvec beta_sum;
+        fvec beta_psi_sum;
+
+        // low memory: expected logs of the current document's locals, and of
+        // the current term's topics
+        fvec doc_logtheta;
+        double doc_logzeta;
+        fvec doc_logepsilon;
+        fvec tile_logbeta;
+
+        // observed pi cells of the current token's event window
+        vector<long> pi_cells;
+
+        // the current token's responsibilities: by topic, and by event lag
+        fvec omega_topics;
+        fvec omega_event;
+
+        // the (entity, date) cell being visited (-1: none); its documents
+        // share their rates, and their contributions to the shapes and rates
+        // of phi, xi and psi are summed here and added once (see end_cell)
+        int cell_entity;
+        int cell_date;
+        int cell_docs;
+        fvec cell_theta_rate;
+        double cell_zeta_rate;
+        fvec cell_epsilon_rate;     // by lag
+        fvec cell_theta_sum;
+        double cell_zeta_sum;
+        fvec cell_epsilon_sum;      // by lag
+        void begin_cell(int entity, int date);
+        void end_cell();
+
+        // truncated topic responsibilities (--top_topics): the current
+        // document's most likely topics, the theta mass of the others, and
+        // each term's largest beta, which together bound what the others
+        // could take; and how many tokens kept to the top topics
+        vector<int> doc_top;
+        double doc_rest;
+        fvec term_max_beta;
+        fvec omega_top;
+        long tokens_truncated;
+        long tokens_exact;
+        bool truncating() { return settings->top_topics > 0 && settings->top_topics <
+            settings->k && settings->incl_topics && !settings->low_memory; }
+        void select_topics(int doc);
+        bool truncated_topics(int doc, int term, double& topic_sum);
+
+        // hardware counters around the E-step, with --cache_stats
+        PerfCounter cache_misses;
+        PerfCounter l1d_misses;
+
+        // warm start: only the documents on or after focus_date, the events
+        // on those dates, and the entities new since the previous fit are
+        // refit, except on refresh iterations, which refit everything (as
+        // does every iteration without a warm start)
+        bool refit_globals;
+        int focus_date;
+        int first_new_entity;
+        vector<int> focus_docs;
+
+        // multi-process runs: this process's share of the documents, and the
+        // transport to the others
+        Cluster* cluster;
+        vector<int> doc_owner;
+        bool owns(int doc) {
+            return !cluster || doc_owner[doc] == cluster->get_rank();
+        }
+
+        // date shards: a rank owns the documents of a range of dates and
+        // keeps only the pi rows they reach; the halo rows, which documents
+        // of two ranges reach, are kept by all
+        vector<int> date_owner;
+        vector<char> date_kept;
+        vector<int> halo_dates;
+
+        // entity shards: a rank keeps only its own entities' eta rows
+        vector<int> entity_owner;
+        vector<char> entity_kept;
+
+        void partition();
+        void partition_entities();
+        void reduce_statistics();
+        void exchange_halos();
+        void gather_locals(param_snapshot* snap);
+        void gather_rows(const SparseDirichlet& dist, const vector<int>& row_owner,
+            sparse_rows& means, sparse_rows& shapes);
+
+        // random numbers, keyed by the seed (see Philox)
+        Philox rng;
 
         // last saved string
         string last_save;
 
+        void build_entity_descriptions();
+        void build_event_descriptions();
         void initialize_parameters();
         void reset_helper_params();
+        void begin_doc(int doc, int date);
+
+        // means, whether stored or (low memory) recomputed from shapes/rates
+        fvec theta_col(int doc);
+        fvec phi_col(int entity);
+        fvec beta_col(int term);
+        double zeta_at(int doc);
+        double epsilon_at(int date, int doc);
+        fmat theta_mean();
+        fmat phi_mean();
+        fmat beta_mean();
+        fvec zeta_mean();
         void save_parameters(string label);
+        bool write_parameters(param_snapshot* snap, string label);
+        // between internal and input term ids (see Data::set_vocabulary)
+        void restore_terms(param_snapshot* snap);
+        void map_terms(sparse_rows& m, bool to_external);
+        void remove_parameters(string label);
+        string param_file(string name, string label);
+        void select_top(const fmat& m, int n, fvec& residual, vector<top_entry>& top);
+        void select_top(const sparse_rows& m, int n, fvec& residual, vector<top_entry>& top);
+        bool write_top(string filename, const fvec& residual, const vector<top_entry>& top);
 
         // parameter updates
         void update_shape(int doc, int term, int count);
@@ -257,6 +651,35 @@ class Capsule {
         void update_pi(int date);
         void update_eta(int iteration);
 
+        // topic pruning: the original index of each remaining topic, and
+        // for how many passes in a row it has been nearly unused
+        vector<int> topic_id;
+        vector<int> topic_idle;
+        void prune_topics(int iteration);
+
+        // inner passes (--inner_iter): while locals_only, update_shape adds
+        // to the document's locals but not to the globals; each document's
+        // cap is two more passes than it took the last time
+        bool locals_only;
+        vector<unsigned char> inner_used;
+        long inner_passes;
+        int refine_locals(int doc, int date, const vector<int>& terms,
+            const vector<int>& counts);
+        double finish_locals(int doc, int date);
+
+        // skipping settled documents (--skip_tol): each document's state,
+        // and the sums of the frozen documents' contributions to the
+        // globals, added back after every reset; while freezing,
+        // update_shape adds to them as well
+        enum { DOC_ACTIVE, DOC_FREEZING, DOC_FROZEN };
+        vector<unsigned char> doc_state;
+        fmat a_beta_frozen;
+        fvec eta_frozen;
+        fvec pi_frozen;
+        bool freezing;
+        bool skipping() { return settings->skip_tol > 0; }
+        void add_frozen(int iteration);
+
         double get_ave_log_likelihood();
         double p_gamma(fmat x, fmat a, fmat b);
         double p_gamma(fmat x, double a, fmat b);
@@ -271,6 +694,8 @@ class Capsule {
         double elbo_extra();
         void log_convergence(int iteration, double ave_ll, double delta_ll);
         void log_time(int iteration, double duration);
+        void log_cache(int iteration, long tokens, long long misses, long long l1d);
+        void log_truncation(int iteration);
         void log_params(int iteration, double tau_change, double theta_change);
         void log_user(FILE* file, int user, int heldout, double rmse,
             double mae, double rank, int first, double crr, double ncrr,
@@ -289,9 +714,13 @@ class Capsule {
         void evaluate(string label);
         void evaluate(string label, bool write_rankings);
 
+        // writes saved parameters off the training thread
+        ParamWriter writer;
+
 
     public:
-        Capsule(model_settings* model_set, Data* dataset);
+        Capsule(model_settings* model_set, Data* dataset, Cluster* processes = NULL);
+        bool warm_start(string dir);
         void learn();
         double point_likelihood(double pred, int truth);
         double predict(int user, int item);
@@ -300,3 +729,5 @@ class Capsule {
         double get_event_strength(int date);
 
 };
+
+#endif
@@ -0,0 +1,307 @@
+#include "cluster.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+// what a worker sends first
+struct cluster_hello {
+    int32_t rank;
+    int32_t size;
+};
+
+// precedes a block of sum(float) changes: count (index, change) pairs, or n
+// changes if dense
+struct cluster_block {
+    uint64_t n;
+    uint64_t count;
+    uint32_t dense;
+    uint32_t reserved;
+};
+
+Cluster::Cluster() {
+    rank = 0;
+    size = 1;
+}
+
+Cluster::~Cluster() {
+    for (size_t i = 0; i < peers.size(); i++) {
+        if (peers[i] >= 0)
+            close(peers[i]);
+    }
+}
+
+void Cluster::send_all(int fd, const void* buf, size_t bytes) {
+    const char* p = (const char*) buf;
+    while (bytes > 0) {
+        ssize_t sent = send(fd, p, bytes, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent <= 0) {
+            printf("rank %d: lost connection (%s).  Exiting.\n", rank, strerror(errno));
+            exit(-1);
+        }
+        p += sent;
+        bytes -= sent;
+    }
+}
+
+void Cluster::recv_all(int fd, void* buf, size_t bytes) {
+    char* p = (char*) buf;
+    while (bytes > 0) {
+        ssize_t got = recv(fd, p, bytes, 0);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0) {
+            printf("rank %d: lost connection (%s).  Exiting.\n", rank,
+                got < 0 ? strerror(errno) : "closed by peer");
+            exit(-1);
+        }
+        p += got;
+        bytes -= got;
+    }
+}
+
+bool Cluster::serve(int port, int n_ranks) {
+    rank = 0;
+    size = n_ranks;
+    peers.assign(size, -1);
+
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    int on = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(listen_fd, (struct sockaddr*) &addr, sizeof(addr)) < 0 ||
+        listen(listen_fd, size) < 0) {
+        printf("unable to listen on port %d: %s\n", port, strerror(errno));
+        close(listen_fd);
+        return false;
+    }
+
+    printf("waiting for %d workers on port %d\n", size - 1, port);
+    for (int connected = 1; connected < size; ) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR)
+                continue;
+            printf("accept failed: %s\n", strerror(errno));
+            close(listen_fd);
+            return false;
+        }
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+        cluster_hello hello;
+        recv_all(fd, &hello, sizeof(hello));
+        if (hello.size != size || hello.rank <= 0 || hello.rank >= size || peers[hello.rank] >= 0) {
+            printf("rejected a worker claiming rank %d of %d\n", hello.rank, hello.size);
+            close(fd);
+            continue;
+        }
+        peers[hello.rank] = fd;
+        connected++;
+        printf("\tworker %d connected\n", hello.rank);
+    }
+    close(listen_fd);
+    return true;
+}
+
+bool Cluster::join(string host, int port, int my_rank, int n_ranks) {
+    rank = my_rank;
+    size = n_ranks;
+    peers.assign(1, -1);
+
+    char port_str[16];
+    sprintf(port_str, "%d", port);
+    struct addrinfo hints, *addrs;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host.c_str(), port_str, &hints, &addrs) != 0) {
+        printf("unable to resolve %s\n", host.c_str());
+        return false;
+    }
+
+    // the aggregator may still be starting up
+    int fd = -1;
+    for (int attempt = 0; attempt < CLUSTER_CONNECT_TIMEOUT && fd < 0; attempt++) {
+        for (struct addrinfo* a = addrs; a != NULL && fd < 0; a = a->ai_next) {
+            fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+            if (fd >= 0 && connect(fd, a->ai_addr, a->ai_addrlen) < 0) {
+                close(fd);
+                fd = -1;
+            }
+        }
+        if (fd < 0)
+            sleep(1);
+    }
+    freeaddrinfo(addrs);
+    if (fd < 0) {
+        printf("unable to reach the aggregator at %s:%d\n", host.c_str(), port);
+        return false;
+    }
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    peers[0] = fd;
+
+    cluster_hello hello;
+    hello.rank = rank;
+    hello.size = size;
+    send_all(fd, &hello, sizeof(hello));
+    return true;
+}
+
+void Cluster::sum(float* values, size_t n, float base) {
+    if (size == 1)
+        return;
+
+    if (rank > 0) {
+        cluster_block block;
+        block.n = n;
+        block.count = 0;
+        for (size_t i = 0; i < n; i++) {
+            if (values[i] != base)
+                block.count++;
+        }
+        // an (index, change) pair costs three floats
+        block.dense = block.count * 3 >= n;
+        block.reserved = 0;
+        send_all(peers[0], &block, sizeof(block));
+
+        vector<float> changes(block.dense ? n : block.count);
+        vector<uint64_t> index(block.dense ? 0 : block.count);
+        for (size_t i = 0, j = 0; i < n; i++) {
+            if (block.dense) {
+                changes[i] = values[i] - base;
+            } else if (values[i] != base) {
+                index[j] = i;
+                changes[j++] = values[i] - base;
+            }
+        }
+        if (!block.dense)
+            send_all(peers[0], index.data(), index.size() * sizeof(uint64_t));
+        send_all(peers[0], changes.data(), changes.size() * sizeof(float));
+
+        recv_all(peers[0], values, n * sizeof(float));
+        return;
+    }
+
+    // aggregator: add the workers' changes in rank order, so every run adds
+    // them up the same way, then send out the totals
+    vector<float> changes;
+    vector<uint64_t> index;
+    for (int r = 1; r < size; r++) {
+        cluster_block block;
+        recv_all(peers[r], &block, sizeof(block));
+        if (block.n != n) {
+            printf("rank %d sent %lu values, expected %lu.  Exiting.\n", r,
+                (unsigned long) block.n, (unsigned long) n);
+            exit(-1);
+        }
+        if (block.dense) {
+            changes.resize(n);
+            recv_all(peers[r], changes.data(), n * sizeof(float));
+            for (size_t i = 0; i < n; i++)
+                values[i] += changes[i];
+        } else {
+            index.resize(block.count);
+            changes.resize(block.count);
+            recv_all(peers[r], index.data(), block.count * sizeof(uint64_t));
+            recv_all(peers[r], changes.data(), block.count * sizeof(float));
+            for (size_t j = 0; j < block.count; j++)
+                values[index[j]] += changes[j];
+        }
+    }
+    for (int r = 1; r < size; r++)
+        send_all(peers[r], values, n * sizeof(float));
+}
+
+void Cluster::sum(double* values, size_t n) {
+    if (size == 1)
+        return;
+
+    if (rank > 0) {
+        send_all(peers[0], values, n * sizeof(double));
+        recv_all(peers[0], values, n * sizeof(double));
+        return;
+    }
+
+    vector<double> part(n);
+    for (int r = 1; r < size; r++) {
+        recv_all(peers[r], part.data(), n * sizeof(double));
+        for (size_t i = 0; i < n; i++)
+            values[i] += part[i];
+    }
+    for (int r = 1; r < size; r++)
+        send_all(peers[r], values, n * sizeof(double));
+}
+
+void Cluster::gather(float* values, size_t rows, const vector<int>& owner) {
+    if (size == 1)
+        return;
+
+    vector<float> part;
+    if (rank > 0) {
+        for (size_t c = 0; c < owner.size(); c++) {
+            if (owner[c] == rank)
+                part.insert(part.end(), values + c * rows, values + (c + 1) * rows);
+        }
+        send_all(peers[0], part.data(), part.size() * sizeof(float));
+        return;
+    }
+
+    vector<size_t> owned(size, 0);
+    for (size_t c = 0; c < owner.size(); c++)
+        owned[owner[c]]++;
+    for (int r = 1; r < size; r++) {
+        part.resize(owned[r] * rows);
+        recv_all(peers[r], part.data(), part.size() * sizeof(float));
+        for (size_t c = 0, i = 0; c < owner.size(); c++) {
+            if (owner[c] == r)
+                memcpy(values + c * rows, &part[rows * i++], rows * sizeof(float));
+        }
+    }
+}
+
+void Cluster::collect(const vector<char>& mine, vector<vector<char> >& received) {
+    received.assign(size, vector<char>());
+    if (size == 1)
+        return;
+
+    uint64_t bytes;
+    if (rank > 0) {
+        bytes = mine.size();
+        send_all(peers[0], &bytes, sizeof(bytes));
+        send_all(peers[0], mine.data(), bytes);
+        return;
+    }
+
+    for (int r = 1; r < size; r++) {
+        recv_all(peers[r], &bytes, sizeof(bytes));
+        received[r].resize(bytes);
+        recv_all(peers[r], received[r].data(), bytes);
+    }
+}
+
+long Cluster::broadcast(long value) {
+    if (size == 1)
+        return value;
+
+    int64_t v = value;
+    if (rank > 0) {
+        recv_all(peers[0], &v, sizeof(v));
+    } else {
+        for (int r = 1; r < size; r++)
+            send_all(peers[r], &v, sizeof(v));
+    }
+    return v;
+}
@@ -0,0 +1,58 @@
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+using namespace std;
+
+// seconds a worker keeps retrying to reach the aggregator
+#define CLUSTER_CONNECT_TIMEOUT 60
+
+// Transport for a data-parallel batch run over several processes, on one
+// machine or several: rank 0 (the aggregator) listens on a TCP port and the
+// other ranks (the workers) connect to it.  Every rank holds the full
+// parameters and runs the E-step over its own documents; the calls below are
+// collective, so every rank must make them in the same order.
+class Cluster {
+    private:
+        int rank;
+        int size;
+        vector<int> peers;  // aggregator: workers' sockets by rank;
+                            // worker: the aggregator's, at 0
+
+        void send_all(int fd, const void* buf, size_t bytes);
+        void recv_all(int fd, void* buf, size_t bytes);
+
+    public:
+        Cluster();
+        ~Cluster();
+
+        // rank 0: wait for the other n_ranks - 1 ranks to connect
+        bool serve(int port, int n_ranks);
+        // ranks 1..n_ranks-1: connect to the aggregator
+        bool join(string host, int port, int my_rank, int n_ranks);
+
+        int get_rank() const { return rank; }
+        int get_size() const { return size; }
+
+        // every rank's values summed, for values every rank started at base;
+        // workers send their changes from base, sparsely when few changed,
+        // and all ranks get the totals
+        void sum(float* values, size_t n, float base);
+        void sum(double* values, size_t n);
+
+        // rows x owner.size() column-major values, where column c belongs to
+        // rank owner[c]: the aggregator receives every rank's columns
+        void gather(float* values, size_t rows, const vector<int>& owner);
+
+        // the aggregator receives each worker's bytes, by rank (its own
+        // entry stays empty); workers send theirs
+        void collect(const vector<char>& mine, vector<vector<char> >& received);
+
+        // rank 0's value, on every rank
+        long broadcast(long value);
+};
+
+#endif
@@ -1,10 +1,50 @@
 #include "data.h"
+#include "utils.h"
+
+#include <algorithm>
 
 Data::Data() {
     max_doc = 0;
+    max_train_doc = 0;
     max_term = 0;
     max_entity = 0;
     max_date = 0;
+    doc_terms = NULL;
+    doc_term_counts = NULL;
+    store = NULL;
+    n_training = 0;
+    packed = NULL;
+    remap_terms = false;
+    min_term_count = 1;
+    max_doc_frequency = 0;
+    hash_buckets = 0;
+    occupied_buckets = 0;
+    colliding_buckets = 0;
+    colliding_counts = 0;
+    colliding_share = 0;
+}
+
+Data::~Data() {
+    delete[] doc_terms;
+    delete[] doc_term_counts;
+    delete store;
+    delete packed;
+}
+
+void Data::use_store(string dir, size_t cache_mb) {
+    delete store;
+    store = new DocStore(dir, cache_mb);
+}
+
+void Data::use_packing() {
+    delete packed;
+    packed = new PackedDocs();
+}
+
+void Data::set_vocabulary(bool by_frequency, int min_count, double max_df) {
+    remap_terms = by_frequency;
+    min_term_count = min_count;
+    max_doc_frequency = max_df;
 }
 
 void Data::read_training(string counts_filename, string meta_filename) {
@@ -29,17 +69,37 @@ void Data::read_training(string counts_filename, string meta_filename) {
     }
     fclose(fileptr);
 
-    // read in training data
+    // read in training data; with a store, only count each document's terms
+    // here, and write them to the store in a second pass
+    bool mapping = remap_terms || min_term_count > 1 || max_doc_frequency > 0;
+    map<int,int> doc_frequency;
+    vector<uint32_t> lengths;
+    unsigned long long id;
     fileptr = fopen(counts_filename.c_str(), "r");
-    while ((fscanf(fileptr, "%d\t%d\t%d\n", &doc, &term, &count) != EOF)) {
+    while ((fscanf(fileptr, "%d\t%llu\t%d\n", &doc, &id, &count) != EOF)) {
         //printf("%d\t%d\t%d\n", doc,term,count);
+        term = hash_term(id, hash_buckets);
         if (count != 0) {
-            train_docs.push_back(doc);
-            train_terms.push_back(term);
-            train_counts.push_back(count);
+            if (hash_buckets > 0) {
+                vector<unsigned long long>& sample = bucket_ids[term];
+                if (sample.size() < TERM_HASH_SAMPLE &&
+                    find(sample.begin(), sample.end(), id) == sample.end())
+                    sample.push_back(id);
+            }
+            if (store) {
+                if (doc >= (int) lengths.size())
+                    lengths.resize(doc + 1, 0);
+                lengths[doc]++;
+                n_training++;
+            } else {
+                train_docs.push_back(doc);
+                train_terms.push_back(term);
+                train_counts.push_back(count);
+            }
             total_term_count += count;
             vocab_counts[term] += count;
-            train_set.insert(DocTerm(doc, term));
+            if (mapping)
+                doc_frequency[term]++;
             if (doc > max_doc)
                 max_doc = doc;
             if (term > max_term)
@@ -50,29 +110,193 @@ void Data::read_training(string counts_filename, string meta_filename) {
     }
     fclose(fileptr);
 
-    doc_terms = new vector<int>[max_train_doc+1];
-    doc_term_counts = new vector<int>[max_train_doc+1];
-    for (int i = 0; i < num_training(); i++) {
-        doc = train_docs[i];
-        term = train_terms[i];
-        count = train_counts[i];
-        doc_terms[doc].push_back(term);
-        doc_term_counts[doc].push_back(count);
+    if (hash_buckets > 0) {
+        // every bucket is a term, so the term dimension depends only on n
+        max_term = hash_buckets - 1;
+        count_collisions();
+    }
+
+    if (mapping) {
+        map_vocabulary(doc_frequency);
+        if (term_external.empty()) {
+            printf("no terms are left after pruning the vocabulary.  Exiting.\n");
+            exit(-1);
+        }
+        if (store) {
+            // the documents' lengths without the pruned terms
+            lengths.assign(max_train_doc+1, 0);
+            n_training = 0;
+            fileptr = fopen(counts_filename.c_str(), "r");
+            while ((fscanf(fileptr, "%d\t%llu\t%d\n", &doc, &id, &count) != EOF)) {
+                if (count != 0 && term_internal[hash_term(id, hash_buckets)] >= 0) {
+                    lengths[doc]++;
+                    n_training++;
+                }
+            }
+            fclose(fileptr);
+        } else {
+            size_t kept = 0;
+            for (size_t i = 0; i < train_terms.size(); i++) {
+                if (term_internal[train_terms[i]] < 0)
+                    continue;
+                train_docs[kept] = train_docs[i];
+                train_terms[kept] = term_internal[train_terms[i]];
+                train_counts[kept] = train_counts[i];
+                kept++;
+            }
+            train_docs.resize(kept);
+            train_terms.resize(kept);
+            train_counts.resize(kept);
+        }
+    }
+
+    if (store) {
+        lengths.resize(max_train_doc+1, 0);
+        if (!store->build(counts_filename, lengths, hash_buckets, term_internal)) {
+            printf("unable to build the document store.  Exiting.\n");
+            exit(-1);
+        }
+    } else {
+        doc_terms = new vector<int>[max_train_doc+1];
+        doc_term_counts = new vector<int>[max_train_doc+1];
+        for (int i = 0; i < num_training(); i++) {
+            doc = train_docs[i];
+            term = train_terms[i];
+            count = train_counts[i];
+            doc_terms[doc].push_back(term);
+            doc_term_counts[doc].push_back(count);
+            if (!packed)
+                train_set.insert(DocTerm(doc, term));
+        }
+        // with renumbered terms, each document's run over beta goes from the
+        // frequent (leading) columns to the rare ones
+        if (remap_terms) {
+            vector<pair<int, int> > entries;
+            for (doc = 0; doc <= max_train_doc; doc++) {
+                entries.clear();
+                for (size_t i = 0; i < doc_terms[doc].size(); i++)
+                    entries.push_back(make_pair(doc_terms[doc][i], doc_term_counts[doc][i]));
+                sort(entries.begin(), entries.end());
+                for (size_t i = 0; i < entries.size(); i++) {
+                    doc_terms[doc][i] = entries[i].first;
+                    doc_term_counts[doc][i] = entries[i].second;
+                }
+            }
+        }
+
+        // pack the documents one by one, releasing the lists as they go
+        if (packed) {
+            n_training = train_docs.size();
+            vector<int>().swap(train_docs);
+            vector<int>().swap(train_terms);
+            vector<int>().swap(train_counts);
+            vector<pair<int, int> > entries;
+            for (doc = 0; doc <= max_train_doc; doc++) {
+                entries.clear();
+                for (size_t i = 0; i < doc_terms[doc].size(); i++)
+                    entries.push_back(make_pair(doc_terms[doc][i], doc_term_counts[doc][i]));
+                packed->add(entries);
+                vector<int>().swap(doc_terms[doc]);
+                vector<int>().swap(doc_term_counts[doc]);
+            }
+            packed->finish();
+            delete[] doc_terms;
+            delete[] doc_term_counts;
+            doc_terms = NULL;
+            doc_term_counts = NULL;
+            printf("packed %ld doc-term counts into %.1f MB\t", n_training,
+                packed->bytes_used() / 1048576.0);
+        }
     }
 
-    for(vector<int>::iterator it = doc_terms->begin(); it != doc_terms->end(); it++) {
-        int doc = *it;
+    // training documents per entity and date
+    for (doc = 0; doc <= max_train_doc; doc++) {
+        if (term_count(doc) == 0)
+            continue;
         doc_counts_entity[authors[doc]] += 1;
         doc_counts_date[dates[doc]] += 1;
     }
 }
 
+// keeps the terms passing min_term_count and max_doc_frequency, numbered by
+// descending count when remapping (by input id otherwise); vocab_counts,
+// total_term_count and max_term then refer to the internal ids
+void Data::map_vocabulary(const map<int,int>& doc_frequency) {
+    vector<pair<int, int> > kept;     // (sort key, input id)
+    for (map<int,int>::iterator it = vocab_counts.begin(); it != vocab_counts.end(); it++) {
+        int df = doc_frequency.find(it->first)->second;
+        if (it->second < min_term_count ||
+            (max_doc_frequency > 0 && df > max_doc_frequency * train_doc_count()))
+            continue;
+        kept.push_back(make_pair(remap_terms ? -it->second : 0, it->first));
+    }
+    sort(kept.begin(), kept.end());
+
+    term_external.resize(kept.size());
+    term_internal.assign(max_term+1, -1);
+    map<int,int> counts;
+    total_term_count = 0;
+    for (size_t i = 0; i < kept.size(); i++) {
+        term_external[i] = kept[i].second;
+        term_internal[kept[i].second] = i;
+        counts[i] = vocab_counts[kept[i].second];
+        total_term_count += counts[i];
+    }
+    printf("vocabulary: %d of %d terms kept%s\n", (int) kept.size(), max_term+1,
+        remap_terms ? ", numbered by descending count" : "");
+    vocab_counts.swap(counts);
+    max_term = (int) kept.size() - 1;
+}
+
+int Data::internal_term(int term) {
+    if (term_external.empty())
+        return term;
+    if (term < 0 || term >= (int) term_internal.size())
+        return -1;
+    return term_internal[term];
+}
+
+int Data::external_term_count() {
+    return term_external.empty() ? term_count() : term_internal.size();
+}
+
+// how much the hashing of the training terms conflated: a bucket collides
+// when it holds several input ids
+void Data::count_collisions() {
+    for (map<int, vector<unsigned long long> >::iterator it = bucket_ids.begin();
+        it != bucket_ids.end(); it++) {
+        occupied_buckets++;
+        if (it->second.size() > 1) {
+            colliding_buckets++;
+            colliding_counts += vocab_counts[it->first];
+        }
+    }
+    colliding_share = total_term_count > 0 ? (double) colliding_counts / total_term_count : 0;
+}
+
+void Data::save_term_buckets(string filename) {
+    FILE* file = fopen(filename.c_str(), "w");
+    for (map<int, vector<unsigned long long> >::iterator it = bucket_ids.begin();
+        it != bucket_ids.end(); it++) {
+        fprintf(file, "%d", it->first);
+        for (size_t i = 0; i < it->second.size(); i++)
+            fprintf(file, "\t%llu", it->second[i]);
+        fprintf(file, "\n");
+    }
+    fclose(file);
+}
+
 void Data::read_validation(string filename) {
     // read in validation data
     FILE* fileptr = fopen(filename.c_str(), "r");
 
+    // terms pruned from (or never seen in) training have no column
     int doc, term, count;
-    while ((fscanf(fileptr, "%d\t%d\t%d\n", &doc, &term, &count) != EOF)) {
+    unsigned long long id;
+    while ((fscanf(fileptr, "%d\t%llu\t%d\n", &doc, &id, &count) != EOF)) {
+        term = internal_term(hash_term(id, hash_buckets));
+        if (term < 0 && terms_mapped())
+            continue;
         if (count != 0) {
             validation_docs.push_back(doc);
             validation_terms.push_back(term);
@@ -88,7 +312,11 @@ void Data::read_test(string filename) {
     FILE* fileptr = fopen(filename.c_str(), "r");
 
     int doc, term, count;
-    while ((fscanf(fileptr, "%d\t%d\t%d\n", &doc, &term, &count) != EOF)) {
+    unsigned long long id;
+    while ((fscanf(fileptr, "%d\t%llu\t%d\n", &doc, &id, &count) != EOF)) {
+        term = internal_term(hash_term(id, hash_buckets));
+        if (term < 0 && terms_mapped())
+            continue;
         test_docs.push_back(doc);
         test_terms.push_back(term);
         test_counts.push_back(count);
@@ -105,6 +333,20 @@ void Data::save_summary(string filename) {
     fprintf(file, "num entities: \t%d\n", entity_count());
     fprintf(file, "num dates:    \t%d\n", date_count());
     fprintf(file, "num doc-term counts:\t%d\t%d\t%d\n", num_training(), num_validation(), num_test());
+    if (hash_buckets > 0) {
+        // linear counting: distinct input terms from the empty buckets
+        double empty = hash_buckets - occupied_buckets;
+        fprintf(file, "term hash buckets:\t%d\n", hash_buckets);
+        fprintf(file, "occupied buckets:\t%d\n", occupied_buckets);
+        if (empty > 0)
+            fprintf(file, "distinct input terms (est.):\t%.0f\n",
+                hash_buckets * log(hash_buckets / empty));
+        else
+            fprintf(file, "distinct input terms (est.):\tmore than %d\n", hash_buckets);
+        fprintf(file, "colliding buckets:\t%d\n", colliding_buckets);
+        fprintf(file, "counts in colliding buckets:\t%ld\t(%.2f%%)\n", colliding_counts,
+            100 * colliding_share);
+    }
 }
 
 int Data::doc_count() {
@@ -139,6 +381,66 @@ int Data::date_count() {
     return max_date+1;
 }
 
+// index of (x, y) along the Hilbert curve filling an n x n grid, n a power
+// of two
+static uint64_t hilbert_index(uint64_t n, uint64_t x, uint64_t y) {
+    uint64_t d = 0;
+    for (uint64_t s = n / 2; s > 0; s /= 2) {
+        uint64_t rx = (x & s) > 0;
+        uint64_t ry = (y & s) > 0;
+        d += s * s * ((3 * rx) ^ ry);
+        // rotate the quadrant
+        if (ry == 0) {
+            if (rx == 1) {
+                x = n - 1 - x;
+                y = n - 1 - y;
+            }
+            swap(x, y);
+        }
+    }
+    return d;
+}
+
+// neighbouring documents in the visiting order share their entity's phi
+// column and eta row, and their dates' pi rows, which then stay in cache
+bool Data::order_documents(string method) {
+    order.clear();
+    order_rank.clear();
+
+    vector<pair<uint64_t, int> > keys(doc_count());
+    if (method == "id") {
+        // by id, but with each (entity, date) cell's documents together, in
+        // the place of its first one, so that batch inference computes each
+        // cell's shared rates once (the other orders group cells already)
+        map<pair<int, int>, int> first;
+        for (int doc = 0; doc < doc_count(); doc++) {
+            pair<int, int> cell = make_pair(get_entity(doc), get_date(doc));
+            first.insert(make_pair(cell, doc));
+            keys[doc] = make_pair((uint64_t) first[cell], doc);
+        }
+    } else if (method == "date_entity") {
+        for (int doc = 0; doc < doc_count(); doc++)
+            keys[doc] = make_pair((uint64_t) get_date(doc) * entity_count() + get_entity(doc), doc);
+    } else if (method == "hilbert") {
+        uint64_t n = 1;
+        while (n < (uint64_t) max(date_count(), entity_count()))
+            n *= 2;
+        for (int doc = 0; doc < doc_count(); doc++)
+            keys[doc] = make_pair(hilbert_index(n, get_date(doc), get_entity(doc)), doc);
+    } else {
+        return false;
+    }
+    sort(keys.begin(), keys.end());
+
+    order.resize(doc_count());
+    order_rank.resize(doc_count());
+    for (int i = 0; i < doc_count(); i++) {
+        order[i] = keys[i].second;
+        order_rank[keys[i].second] = i;
+    }
+    return true;
+}
+
 int Data::get_entity(int doc) {
     return authors[doc];
 }
@@ -156,19 +458,63 @@ int Data::total_terms() {
 }
 
 int Data::term_count(int doc) {
+    if (store)
+        return store->term_count(doc);
+    if (packed)
+        return packed->term_count(doc);
     return doc_terms[doc].size();
 }
 
 int Data::get_term(int doc, int i) {
+    if (store)
+        return store->fetch(doc)[i].term;
+    if (packed) {
+        vector<int> terms, counts;
+        packed->decode(doc, terms, counts);
+        return terms[i];
+    }
     return doc_terms[doc][i];
 }
 
 int Data::get_term_count(int doc, int i) {
+    if (store)
+        return store->fetch(doc)[i].count;
+    if (packed) {
+        vector<int> terms, counts;
+        packed->decode(doc, terms, counts);
+        return counts[i];
+    }
     return doc_term_counts[doc][i];
 }
 
+void Data::get_doc(int doc, vector<int>& terms, vector<int>& counts) {
+    terms.clear();
+    counts.clear();
+    if (doc > max_train_doc)
+        return;
+    if (store) {
+        const vector<doc_entry>& entries = store->fetch(doc);
+        for (size_t i = 0; i < entries.size(); i++) {
+            terms.push_back(entries[i].term);
+            counts.push_back(entries[i].count);
+        }
+    } else if (packed) {
+        packed->decode(doc, terms, counts);
+    } else {
+        terms = doc_terms[doc];
+        counts = doc_term_counts[doc];
+    }
+}
+
+void Data::prefetch(const vector<int>& docs) {
+    if (store)
+        store->prefetch(docs);
+}
+
 // training data
 int Data::num_training() {
+    if (store || packed)
+        return n_training;
     return train_counts.size();
 }
 
@@ -11,16 +11,55 @@
 #define ARMA_64BIT_WORD
 #include <armadillo>
 
+#include "docstore.h"
+#include "packeddocs.h"
+
 using namespace std;
 using namespace arma;
 
 typedef pair<int, int> DocTerm;
 
+// input ids kept per bucket of hashed terms, for reading the top terms
+#define TERM_HASH_SAMPLE 4
+
 class Data {
     private:
         vector<int>* doc_terms;
         vector<int>* doc_term_counts;
 
+        // out of core: the training documents live in the store instead of
+        // doc_terms and the training vectors below
+        DocStore* store;
+        long n_training;
+
+        // compressed: the training documents live packed in memory instead
+        PackedDocs* packed;
+
+        // order in which inference visits the documents, and each
+        // document's place in it
+        vector<int> order;
+        vector<int> order_rank;
+
+        // vocabulary mapping (empty: terms keep their input ids): the input id
+        // of each term, and the term of each input id, -1 if pruned
+        bool remap_terms;
+        int min_term_count;
+        double max_doc_frequency;
+        vector<int> term_external;
+        vector<int> term_internal;
+        void map_vocabulary(const map<int,int>& doc_frequency);
+
+        // feature hashing (0 buckets: term ids are used as given): the first
+        // few distinct input ids seen in each bucket, which also tell the
+        // colliding buckets, and collision statistics of the training terms
+        int hash_buckets;
+        map<int, vector<unsigned long long> > bucket_ids;
+        int occupied_buckets;
+        int colliding_buckets;
+        long colliding_counts;
+        double colliding_share;
+        void count_collisions();
+
         int max_doc;
         int max_train_doc;
         int max_term;
@@ -72,6 +111,27 @@ class Data {
         //sp_fmat network_spmat;
 
         Data();
+        ~Data();
+        // keep the training documents in a store in dir (before reading them)
+        void use_store(string dir, size_t cache_mb);
+        DocStore* get_store() { return store; }
+        // keep the training documents compressed in memory (before reading)
+        void use_packing();
+        PackedDocs* get_packed() { return packed; }
+        // vocabulary (before reading): renumber the terms by descending count,
+        // so the frequent ones share the leading columns of beta, and drop
+        // those seen fewer than min_count times or in more than a max_df
+        // fraction of the training documents (0: no limit).  Terms are
+        // internal ids throughout; outputs are mapped back to the input ids.
+        void set_vocabulary(bool by_frequency, int min_count, double max_df);
+        // hash input term ids into n buckets (before reading), which bounds
+        // the term dimension at n whatever the ids
+        void set_hashing(int n) { hash_buckets = n; }
+        void save_term_buckets(string filename);
+        bool terms_mapped() { return !term_external.empty(); }
+        int external_term(int term) { return term_external.empty() ? term : term_external[term]; }
+        int internal_term(int term);
+        int external_term_count();
         void read_training(string counts_filename, string meta_filename);
         void read_validation(string filename);
         //WORKING LINE
@@ -93,11 +153,25 @@ class Data {
         int get_term(int doc, int i);
         int get_term_count(int doc, int i);
 
+        // a training document's terms and counts, in one lookup; with a
+        // store, prefetch reads ahead the documents of a minibatch
+        void get_doc(int doc, vector<int>& terms, vector<int>& counts);
+        void prefetch(const vector<int>& docs);
+
+        // visiting order (after reading): "id" (with each (entity, date)
+        // cell's documents together), "date_entity" (by date, then entity),
+        // or "hilbert" (along a Hilbert curve over dates x entities);
+        // document ids, and so all the outputs, are unchanged
+        bool order_documents(string method);
+        int visit(int i) { return order.empty() ? i : order[i]; }
+        int visit_rank(int doc) { return order.empty() ? doc : order_rank[doc]; }
+
         // metadata associated with each document
         int get_entity(int doc);
         int get_date(int doc);
 
-        // training data
+        // training data (get_train_* are not available with a store or
+        // packed documents)
         int num_training();
         int get_train_doc(int i);
         int get_train_term(int i);
@@ -0,0 +1,229 @@
+#include "dirichlet.h"
+#include <algorithm>
+
+SparseDirichlet::SparseDirichlet() {
+    n_rows = 0;
+    n_cols = 0;
+    prior = 0;
+    base = 0;
+    low_memory = false;
+}
+
+void SparseDirichlet::build(int rows, int cols, double prior_shape,
+                            vector<vector<int> >& observed, bool low_mem, Arena* arena) {
+    low_memory = low_mem;
+    n_rows = rows;
+    n_cols = cols;
+    prior = prior_shape;
+    base = prior_shape;
+
+    row_ptr = Col<uword>(rows + 1);
+    row_ptr.zeros();
+    for (int r = 0; r < rows; r++) {
+        sort(observed[r].begin(), observed[r].end());
+        observed[r].erase(unique(observed[r].begin(), observed[r].end()),
+            observed[r].end());
+        row_ptr[r+1] = row_ptr[r] + observed[r].size();
+    }
+
+    col_idx = Col<int>(row_ptr[rows]);
+    for (int r = 0; r < rows; r++) {
+        copy(observed[r].begin(), observed[r].end(), col_idx.memptr() + row_ptr[r]);
+        vector<int>().swap(observed[r]);
+    }
+
+    // the per-cell blocks, in the parameter arena if there is one
+    Arena heap;
+    if (!arena)
+        arena = &heap;
+    shape = arena->column(nnz());
+    shape.fill(prior);
+    // keep track of old shapes for SVI
+    shape_old = arena->column(nnz());
+    shape_old.fill(prior);
+    if (low_memory) {
+        row_sum = fvec(rows);
+        row_psi_sum = fvec(rows);
+    } else {
+        mean = arena->column(nnz());
+        logmean = arena->column(nnz());
+    }
+    row_mean = fvec(rows);
+    row_logmean = fvec(rows);
+    row_total = fvec(rows);
+}
+
+void SparseDirichlet::map(const MappedParams& file) {
+    // read-only: the saved shapes stand in for the normalized shapes of
+    // low-memory mode, and only the per-row sums are computed
+    low_memory = true;
+    n_rows = file.header.rows;
+    n_cols = file.header.cols;
+    // every row's default is the shared shape of the unobserved cells
+    base = n_rows > 0 ? file.defaults()[0] : 0;
+    prior = base;
+
+    // non-strict views, so that assignment moves them in rather than copying
+    row_ptr = Col<uword>(file.row_ptr(), n_rows + 1, false, false);
+    col_idx = Col<int>(file.col_idx(), file.nnz(), false, false);
+    shape_old = fvec(file.values(), file.nnz(), false, false);
+    shape = fvec();
+    row_sum = fvec(n_rows);
+    row_psi_sum = fvec(n_rows);
+    row_mean = fvec(n_rows);
+    row_logmean = fvec(n_rows);
+    row_total = fvec(n_rows);
+
+    for (int r = 0; r < n_rows; r++) {
+        double sum = (n_cols - nnz(r)) * base;
+        for (uword i = row_ptr[r]; i < row_ptr[r+1]; i++)
+            sum += shape_old(i);
+        row_sum(r) = sum;
+        row_psi_sum(r) = gsl_sf_psi(sum);
+        row_mean(r) = base / sum;
+        row_logmean(r) = gsl_sf_psi(base) - row_psi_sum(r);
+        row_total(r) = 1;
+    }
+}
+
+size_t SparseDirichlet::memory_bytes() const {
+    return estimate_bytes(n_rows, nnz(), low_memory);
+}
+
+size_t SparseDirichlet::estimate_bytes(int rows, uword nnz, bool low_mem) {
+    return (rows + 1) * sizeof(uword) + nnz * sizeof(int) +
+        (low_mem ? 2 : 4) * nnz * sizeof(float) +
+        (low_mem ? 5 : 3) * rows * sizeof(float);
+}
+
+long SparseDirichlet::find(int row, int col) const {
+    const int* first = col_idx.memptr() + row_ptr[row];
+    const int* last = col_idx.memptr() + row_ptr[row+1];
+    const int* pos = lower_bound(first, last, col);
+    if (pos != last && *pos == col)
+        return pos - col_idx.memptr();
+    return -1;
+}
+
+float SparseDirichlet::operator()(int row, int col) const {
+    long idx = find(row, col);
+    return idx < 0 ? row_mean(row) : mean_of(row, idx);
+}
+
+float SparseDirichlet::log(int row, int col) const {
+    long idx = find(row, col);
+    return idx < 0 ? row_logmean(row) : log_of(row, idx);
+}
+
+void SparseDirichlet::reset() {
+    shape.fill(prior);
+    base = prior;
+}
+
+void SparseDirichlet::reset(int row) {
+    for (uword i = row_ptr[row]; i < row_ptr[row+1]; i++)
+        shape(i) = prior;
+}
+
+void SparseDirichlet::load(const sparse_rows& saved) {
+    int rows = min((int) saved.rows, n_rows);
+    for (int r = 0; r < rows; r++) {
+        // both rows are sorted by column
+        uword j = saved.row_ptr[r];
+        for (uword i = row_ptr[r]; i < row_ptr[r+1]; i++) {
+            while (j < saved.row_ptr[r+1] && saved.col_idx[j] < col_idx(i))
+                j++;
+            if (j < saved.row_ptr[r+1] && saved.col_idx[j] == col_idx(i))
+                shape(i) = saved.values(j);
+            else
+                shape(i) = saved.defaults(r);
+            if (low_memory)
+                shape_old(i) = shape(i);
+        }
+    }
+    if (saved.rows > 0)
+        base = saved.defaults(0);
+}
+
+void SparseDirichlet::blend(int row, double rho) {
+    for (uword i = row_ptr[row]; i < row_ptr[row+1]; i++) {
+        shape(i) = (1 - rho) * shape_old(i) + rho * shape(i);
+        shape_old(i) = shape(i);
+    }
+}
+
+void SparseDirichlet::blend(double rho) {
+    shape = (1 - rho) * shape_old + rho * shape;
+    shape_old = shape;
+}
+
+void SparseDirichlet::normalize(int row) {
+    // row sum over all cells: observed ones plus the closed-form prior ones
+    double sum = (n_cols - nnz(row)) * base;
+    for (uword i = row_ptr[row]; i < row_ptr[row+1]; i++)
+        sum += shape(i);
+
+    double psi_sum = gsl_sf_psi(sum);
+    double total = 0;
+    if (low_memory) {
+        // the normalized shapes stand in for the means and logs
+        for (uword i = row_ptr[row]; i < row_ptr[row+1]; i++) {
+            shape_old(i) = shape(i);
+            total += shape(i) / sum;
+        }
+        row_sum(row) = sum;
+        row_psi_sum(row) = psi_sum;
+    } else {
+        for (uword i = row_ptr[row]; i < row_ptr[row+1]; i++) {
+            mean(i) = shape(i) / sum;
+            logmean(i) = gsl_sf_psi(shape(i)) - psi_sum;
+            total += mean(i);
+        }
+    }
+
+    row_mean(row) = base / sum;
+    row_logmean(row) = gsl_sf_psi(base) - psi_sum;
+    row_total(row) = total + (n_cols - nnz(row)) * row_mean(row);
+}
+
+void SparseDirichlet::snapshot(sparse_rows& out, bool shapes) const {
+    out.rows = n_rows;
+    out.cols = n_cols;
+    out.row_ptr.assign(row_ptr.begin(), row_ptr.end());
+    out.col_idx.assign(col_idx.begin(), col_idx.end());
+    if (shapes) {
+        out.values = shape;
+        out.defaults = fvec(n_rows);
+        out.defaults.fill(base);
+    } else {
+        out.values = fvec(nnz());
+        for (int r = 0; r < n_rows; r++) {
+            for (uword i = row_ptr[r]; i < row_ptr[r+1]; i++)
+                out.values(i) = mean_of(r, i);
+        }
+        out.defaults = row_mean;
+    }
+}
+
+double SparseDirichlet::p_dir() const {
+    double rv = 0.0;
+    double lgb = gsl_sf_lngamma(base);
+    for (int r = 0; r < n_rows; r++) {
+        for (uword i = row_ptr[r]; i < row_ptr[r+1]; i++)
+            rv += (shape(i) - 1.0) * std::log(mean_of(r, i)) - gsl_sf_lngamma(shape(i));
+        rv += (n_cols - nnz(r)) * ((base - 1.0) * std::log(row_mean(r)) - lgb);
+        rv += gsl_sf_lngamma(row_total(r));
+    }
+    return rv;
+}
+
+double SparseDirichlet::p_dir(double a) const {
+    double rv = - gsl_sf_lngamma(a) * n_rows * n_cols;
+    for (int r = 0; r < n_rows; r++) {
+        for (uword i = row_ptr[r]; i < row_ptr[r+1]; i++)
+            rv += (a - 1.0) * std::log(mean_of(r, i));
+        rv += (n_cols - nnz(r)) * (a - 1.0) * std::log(row_mean(r));
+        rv += gsl_sf_lngamma(row_total(r));
+    }
+    return rv;
+}
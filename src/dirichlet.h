@@ -0,0 +1,127 @@
+#ifndef DIRICHLET_H
+#define DIRICHLET_H
+
+#include <vector>
+#include <gsl/gsl_sf.h>
+
+#define ARMA_64BIT_WORD
+#include <armadillo>
+
+#include "writer.h"
+#include "arena.h"
+
+using namespace std;
+using namespace arma;
+
+// Rows of Dirichlet-distributed term weights (entity descriptions eta, event
+// descriptions pi) stored as a uniform prior plus the observed cells.
+//
+// Any one entity or date only uses a small part of the vocabulary, so every
+// cell that no training document can reach keeps the same shape, `base`.
+// Only reachable (row, term) cells are stored explicitly, in CSR layout, and
+// the unobserved cells of a row are handled in closed form: they all share a
+// mean of base / row_sum and an expected log of psi(base) - psi(row_sum).
+//
+// In low-memory mode the per-cell means and expected logs are not stored;
+// they are recomputed on demand from the last normalized shapes (kept in
+// shape_old) and the cached row sums.  The structure and shapes are Armadillo
+// columns so that they can also view a memory-mapped parameter file.
+class SparseDirichlet {
+    private:
+        int n_rows;
+        int n_cols;
+        double prior;
+        double base;   // shape of every unobserved cell
+        bool low_memory;
+
+        Col<uword> row_ptr;
+        Col<int> col_idx;
+
+        fvec shape;       // variational shape of observed cells
+        fvec shape_old;   // previous shape, for SVI
+        fvec mean;        // normalized means of observed cells
+        fvec logmean;     // expected logs of observed cells
+        fvec row_mean;    // mean of each row's unobserved cells
+        fvec row_logmean; // expected log of each row's unobserved cells
+        fvec row_total;   // sum of the means in each row
+        fvec row_sum;     // low memory: sum of each row's normalized shapes
+        fvec row_psi_sum; // low memory: digamma of row_sum
+
+        float mean_of(int row, uword idx) const {
+            return low_memory ? shape_old(idx) / row_sum(row) : mean(idx);
+        }
+        float log_of(int row, uword idx) const {
+            return low_memory ? gsl_sf_psi(shape_old(idx)) - row_psi_sum(row) : logmean(idx);
+        }
+
+    public:
+        SparseDirichlet();
+
+        // observed[r] lists the columns that can receive mass in row r
+        void build(int rows, int cols, double prior_shape,
+                   vector<vector<int> >& observed, bool low_mem, Arena* arena = NULL);
+
+        // read-only view of saved shapes (a mapped a_eta / a_pi file), in
+        // low-memory mode; only the lookups and p_dir may be used
+        void map(const MappedParams& file);
+
+        int rows() const { return n_rows; }
+        int cols() const { return n_cols; }
+        uword nnz() const { return col_idx.n_elem; }
+        uword nnz(int row) const { return row_ptr[row+1] - row_ptr[row]; }
+        size_t memory_bytes() const;
+        static size_t estimate_bytes(int rows, uword nnz, bool low_mem);
+
+        // index of an observed cell, or -1 if (row, col) is a prior cell
+        long find(int row, int col) const;
+
+        float operator()(int row, int col) const;
+        float log(int row, int col) const;
+        // idx from find; -1 (a prior cell) gets the row's unobserved-cell log
+        float log_at(int row, long idx) const {
+            return idx < 0 ? row_logmean(row) : log_of(row, idx);
+        }
+        float total(int row) const { return row_total(row); }
+
+        void add(long idx, double val) { shape(idx) += val; }
+        // one value per observed cell, in cell order
+        void add(const fvec& vals) { shape += vals; }
+
+        // the shapes of the observed cells (of a row), to add up across
+        // processes
+        float* shape_data() { return shape.memptr(); }
+        float* shape_data(int row) { return shape.memptr() + row_ptr[row]; }
+
+        // initialization: observed cells get the given shapes, prior cells base
+        void set_shape(long idx, double val) {
+            shape(idx) = val;
+            if (low_memory)
+                shape_old(idx) = val;
+        }
+        void set_base(double val) { base = val; }
+
+        // restart accumulation of sufficient statistics from the prior
+        void reset();
+        void reset(int row);
+
+        // warm start: take the shapes of a saved fit (an a_eta / a_pi dump)
+        // for the rows it has; its cells missing here are dropped, and cells
+        // it lacks get its unobserved-cell shape
+        void load(const sparse_rows& saved);
+
+        // SVI: blend the accumulated shapes with the previous ones
+        void blend(int row, double rho);
+        void blend(double rho);
+
+        // recompute the means and expected logs of a row from its shapes
+        void normalize(int row);
+
+        // copies for saving: means (or shapes, for the a_ files)
+        void snapshot(sparse_rows& out, bool shapes) const;
+
+        // log Dirichlet density terms (see Capsule::p_dir)
+        double p_dir() const;
+        double p_dir(double a) const;
+};
+
+#endif
@@ -0,0 +1,179 @@
+#include "docstore.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+DocStore::DocStore(string directory, size_t cache_mb) {
+    dir = directory;
+    cache_limit = cache_mb << 20;
+    cache_bytes = 0;
+    hits = 0;
+    misses = 0;
+}
+
+DocStore::~DocStore() {
+    close();
+}
+
+void DocStore::close() {
+    for (size_t i = 0; i < shards.size(); i++)
+        ::close(shards[i]);
+    shards.clear();
+}
+
+static bool by_term(const doc_entry& a, const doc_entry& b) {
+    return a.term < b.term;
+}
+
+bool DocStore::build(string counts_filename, const vector<uint32_t>& doc_lengths,
+    int hash_buckets, const vector<int>& term_map) {
+    close();
+    length = doc_lengths;
+    offset.assign(length.size(), 0);
+
+    // lay the documents out in order, starting a new shard where the next
+    // document would cross a shard boundary
+    uint64_t end = 0;
+    for (size_t doc = 0; doc < length.size(); doc++) {
+        uint64_t bytes = (uint64_t) length[doc] * sizeof(doc_entry);
+        if (bytes > DOCSTORE_SHARD_BYTES) {
+            printf("document %d is larger than a document store shard\n", (int) doc);
+            return false;
+        }
+        if (end % DOCSTORE_SHARD_BYTES + bytes > DOCSTORE_SHARD_BYTES)
+            end = (end / DOCSTORE_SHARD_BYTES + 1) * DOCSTORE_SHARD_BYTES;
+        offset[doc] = end;
+        end += bytes;
+    }
+    int n_shards = end == 0 ? 0 : (end - 1) / DOCSTORE_SHARD_BYTES + 1;
+
+    // the shards are written through writable mappings, so the scattered
+    // writes of an unsorted counts file are plain stores
+    vector<char*> maps(n_shards, NULL);
+    vector<size_t> sizes(n_shards);
+    bool ok = true;
+    for (int s = 0; s < n_shards; s++) {
+        char name[32];
+        sprintf(name, "/docs-%03d.bin", s);
+        int fd = open((dir + name).c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            printf("unable to create %s%s\n", dir.c_str(), name);
+            ok = false;
+            break;
+        }
+        shards.push_back(fd);
+        sizes[s] = min((uint64_t) DOCSTORE_SHARD_BYTES, end - (uint64_t) s * DOCSTORE_SHARD_BYTES);
+        void* map = MAP_FAILED;
+        if (ftruncate(fd, sizes[s]) == 0)
+            map = mmap(NULL, sizes[s], PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+            printf("unable to map %s%s: %s\n", dir.c_str(), name, strerror(errno));
+            ok = false;
+            break;
+        }
+        maps[s] = (char*) map;
+    }
+
+    if (ok) {
+        vector<uint32_t> filled(length.size(), 0);
+        int doc, term, count;
+        unsigned long long id;
+        FILE* fileptr = fopen(counts_filename.c_str(), "r");
+        while ((fscanf(fileptr, "%d\t%llu\t%d\n", &doc, &id, &count) != EOF)) {
+            term = hash_term(id, hash_buckets);
+            if (count == 0 || doc < 0 || doc >= doc_count() || filled[doc] >= length[doc])
+                continue;
+            if (!term_map.empty()) {
+                term = term < (int) term_map.size() ? term_map[term] : -1;
+                if (term < 0)
+                    continue;
+            }
+            doc_entry* entries = (doc_entry*) (maps[shard_of(doc)] + shard_offset(doc));
+            entries[filled[doc]].term = term;
+            entries[filled[doc]].count = count;
+            filled[doc]++;
+        }
+        fclose(fileptr);
+
+        if (!term_map.empty()) {
+            for (int d = 0; d < doc_count(); d++) {
+                if (filled[d] < 2)
+                    continue;
+                doc_entry* entries = (doc_entry*) (maps[shard_of(d)] + shard_offset(d));
+                sort(entries, entries + filled[d], by_term);
+            }
+        }
+    }
+
+    for (int s = 0; s < n_shards; s++) {
+        if (maps[s])
+            munmap(maps[s], sizes[s]);
+    }
+    if (!ok) {
+        close();
+        return false;
+    }
+
+    // minibatches read documents in random order
+    for (size_t s = 0; s < shards.size(); s++)
+        posix_fadvise(shards[s], 0, 0, POSIX_FADV_RANDOM);
+    return true;
+}
+
+const vector<doc_entry>& DocStore::fetch(int doc) {
+    unordered_map<int, cached_doc>::iterator it = cache.find(doc);
+    if (it != cache.end()) {
+        hits++;
+        lru.splice(lru.begin(), lru, it->second.pos);
+        return it->second.entries;
+    }
+    misses++;
+
+    cached_doc& entry = cache[doc];
+    entry.entries.resize(term_count(doc));
+    size_t bytes = entry.entries.size() * sizeof(doc_entry);
+    size_t done = 0;
+    while (done < bytes) {
+        ssize_t got = pread(shards[shard_of(doc)], (char*) entry.entries.data() + done,
+            bytes - done, shard_offset(doc) + done);
+        if (got <= 0) {
+            printf("unable to read document %d from the document store: %s\n", doc,
+                got < 0 ? strerror(errno) : "unexpected end of shard");
+            exit(-1);
+        }
+        done += got;
+    }
+    lru.push_front(doc);
+    entry.pos = lru.begin();
+    cache_bytes += bytes;
+
+    // evict the least recently used documents, but never the one just read
+    while (cache_bytes > cache_limit && lru.size() > 1) {
+        unordered_map<int, cached_doc>::iterator old = cache.find(lru.back());
+        cache_bytes -= old->second.entries.size() * sizeof(doc_entry);
+        cache.erase(old);
+        lru.pop_back();
+    }
+    return entry.entries;
+}
+
+void DocStore::prefetch(const vector<int>& docs) {
+    for (size_t i = 0; i < docs.size(); i++) {
+        int doc = docs[i];
+        if (term_count(doc) == 0 || cache.count(doc))
+            continue;
+        posix_fadvise(shards[shard_of(doc)], shard_offset(doc),
+            (size_t) length[doc] * sizeof(doc_entry), POSIX_FADV_WILLNEED);
+    }
+}
+
+size_t DocStore::index_bytes() const {
+    return offset.size() * (sizeof(uint64_t) + sizeof(uint32_t));
+}
@@ -0,0 +1,74 @@
+#ifndef DOCSTORE_H
+#define DOCSTORE_H
+
+#include <string>
+#include <vector>
+#include <list>
+#include <unordered_map>
+#include <stdint.h>
+
+using namespace std;
+
+// bytes per shard of the document store
+#define DOCSTORE_SHARD_BYTES (1UL << 30)
+
+// one doc-term count in the store
+struct doc_entry {
+    int32_t term;
+    int32_t count;
+};
+
+// Out-of-core training documents: the doc-term counts, grouped by document,
+// in binary shard files (docs-000.bin, ...), with an in-memory index of each
+// document's offset and length.  A document never straddles two shards.
+//
+// Documents are read with pread into a bounded LRU cache; prefetch asks the
+// kernel to read ahead the documents of an upcoming minibatch.  Not safe for
+// concurrent use.
+class DocStore {
+    private:
+        string dir;
+        vector<int> shards;         // file descriptors
+        vector<uint64_t> offset;    // byte offset of each document
+        vector<uint32_t> length;    // number of entries of each document
+
+        struct cached_doc {
+            vector<doc_entry> entries;
+            list<int>::iterator pos;
+        };
+        size_t cache_limit;
+        size_t cache_bytes;
+        list<int> lru;              // most recently used first
+        unordered_map<int, cached_doc> cache;
+        long hits;
+        long misses;
+
+        int shard_of(int doc) const { return offset[doc] / DOCSTORE_SHARD_BYTES; }
+        size_t shard_offset(int doc) const { return offset[doc] % DOCSTORE_SHARD_BYTES; }
+        void close();
+
+    public:
+        DocStore(string directory, size_t cache_mb);
+        ~DocStore();
+
+        // write the store from a (doc, term, count) file, given the number of
+        // nonzero counts of each document; input term ids are hashed into
+        // hash_buckets (see hash_term), if any, and with a term map (input id
+        // => term, -1 to drop) mapped and sorted in each document
+        bool build(string counts_filename, const vector<uint32_t>& doc_lengths,
+            int hash_buckets = 0, const vector<int>& term_map = vector<int>());
+
+        int doc_count() const { return length.size(); }
+        int term_count(int doc) const { return doc < doc_count() ? length[doc] : 0; }
+
+        // a document's entries; valid until the next fetch
+        const vector<doc_entry>& fetch(int doc);
+        void prefetch(const vector<int>& docs);
+
+        size_t index_bytes() const;
+        size_t cache_capacity() const { return cache_limit; }
+        long cache_hits() const { return hits; }
+        long cache_misses() const { return misses; }
+};
+
+#endif
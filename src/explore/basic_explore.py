@@ -3,6 +3,7 @@ from datetime import date, timedelta
 import sqlite3
 from collections import defaultdict
 import numpy as np
+import capsule_bin
 
 doc_db = sys.argv[1]
 data_dir = sys.argv[2]
@@ -23,6 +24,16 @@ cur = con.cursor()
 vocab = [line.strip() for line in \
     open(os.path.join(data_dir, 'vocab.dat'))]
 
+# a --save_top fit has only the top terms of beta, eta, and pi (text or
+# binary); the names of each row's N_terms heaviest terms, or None
+def top_rows(name):
+    for ext in ['dat', 'bin']:
+        filename = os.path.join(fit_dir, "%s_top-%s.%s" % (name, iter_id, ext))
+        if os.path.exists(filename):
+            return [[vocab[term] for term, weight in top[:N_terms]] \
+                for residual, top in capsule_bin.load_top(filename)]
+    return None
+
 ## Entities
 # entity names
 entity_names = {}
@@ -35,12 +46,17 @@ for line in open(os.path.join(data_dir, "entities.tsv")):
 
 # entity topics
 fout = open(os.path.join(fit_dir, "topics_entity_%s.dat" % iter_id), 'w+')
-for line in open(os.path.join(fit_dir, "eta-%s.dat" % iter_id)):
-    entity, terms = line.strip().split('\t', 1)
+eta_top = top_rows("eta")
+if eta_top is not None:
+    for entity, topterms in enumerate(eta_top):
+        fout.write("%s\t%s\n" % (entity_names[entity], ' / '.join(topterms)))
+else:
+    for line in open(os.path.join(fit_dir, "eta-%s.dat" % iter_id)):
+        entity, terms = line.strip().split('\t', 1)
 
-    terms = dict(zip(vocab, [float(t) for t in terms.split('\t')]))
-    topterms = sorted(terms, key=lambda t: -terms[t])[:N_terms]
-    fout.write("%s\t%s\n" % (entity_names[int(entity)], ' / '.join(topterms)))
+        terms = dict(zip(vocab, [float(t) for t in terms.split('\t')]))
+        topterms = sorted(terms, key=lambda t: -terms[t])[:N_terms]
+        fout.write("%s\t%s\n" % (entity_names[int(entity)], ' / '.join(topterms)))
 fout.close()
 
 ## Events
@@ -64,25 +80,35 @@ def get_date(time):
 
 # event topics
 fout = open(os.path.join(fit_dir, "topics_events_%s.dat" % iter_id), 'w+')
-for line in open(os.path.join(fit_dir, "pi-%s.dat" % iter_id)):
-    time, terms = line.strip().split('\t', 1)
-    time = int(time)
+pi_top = top_rows("pi")
+if pi_top is not None:
+    for time, topterms in enumerate(pi_top):
+        fout.write("%s\t%s\n" % (get_date(time), ' / '.join(topterms)))
+else:
+    for line in open(os.path.join(fit_dir, "pi-%s.dat" % iter_id)):
+        time, terms = line.strip().split('\t', 1)
+        time = int(time)
 
-    dt = get_date(time)
+        dt = get_date(time)
 
-    terms = dict(zip(vocab, [float(t) for t in terms.split('\t')]))
-    topterms = sorted(terms, key=lambda t: -terms[t])[:N_terms]
-    fout.write("%s\t%s\n" % (dt, ' / '.join(topterms)))
+        terms = dict(zip(vocab, [float(t) for t in terms.split('\t')]))
+        topterms = sorted(terms, key=lambda t: -terms[t])[:N_terms]
+        fout.write("%s\t%s\n" % (dt, ' / '.join(topterms)))
 fout.close()
 
 # general topics
-beta = np.loadtxt(os.path.join(fit_dir, "beta-%s.dat" % iter_id))[:,1:].T
 fout = open(os.path.join(fit_dir, "topics_general_%s.dat" % iter_id), 'w+')
-for k in range(len(beta)):
-    terms = dict(zip(vocab, beta[k]))
-    topterms = sorted(terms, key=lambda t: -terms[t])[:N_terms]
-    top3 = ' / '.join(topterms[:3])
-    fout.write("general #%d\t%s\n" % (k, ' / '.join(topterms)))
+beta_top = top_rows("beta")
+if beta_top is not None:
+    for k, topterms in enumerate(beta_top):
+        fout.write("general #%d\t%s\n" % (k, ' / '.join(topterms)))
+else:
+    beta = np.loadtxt(os.path.join(fit_dir, "beta-%s.dat" % iter_id))[:,1:].T
+    for k in range(len(beta)):
+        terms = dict(zip(vocab, beta[k]))
+        topterms = sorted(terms, key=lambda t: -terms[t])[:N_terms]
+        top3 = ' / '.join(topterms[:3])
+        fout.write("general #%d\t%s\n" % (k, ' / '.join(topterms)))
 fout.close()
 
 
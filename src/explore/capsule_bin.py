@@ -0,0 +1,108 @@
+# Reader for Capsule's binary parameter files (*.bin).
+#
+# Each file starts with a 32-byte header:
+#   char[4] magic ("CAPS"), uint32 version, uint32 type, uint32 reserved,
+#   uint64 rows, uint64 cols
+# followed by little-endian float32 data.  Dense matrices (type 0) are stored
+# column-major, exactly as Capsule holds them in memory; event files (type 1)
+# hold (int32 doc, int32 date, float val, float decayed) records; top-N files
+# (type 2, from --save_top) hold one (float residual, cols x (int32 term,
+# float weight)) record per row.  Entity and event descriptions (eta, pi) are
+# sparse (type 3): uint64 nnz, uint64 row_ptr[rows+1], int32 col[nnz],
+# float val[nnz], float default[rows], where every cell not listed in a row
+# holds that row's default value.
+#
+# usage:
+#   import capsule_bin
+#   beta = capsule_bin.load('fit/beta-final.bin')   # K x V
+#   eps = capsule_bin.load('fit/epsilon-final.bin') # record array
+#   top = capsule_bin.load_top('fit/beta_top-final.dat') # .dat or .bin
+
+import struct
+import numpy as np
+
+HEADER = struct.Struct('<4sIIIQQ')
+DENSE = 0
+EVENTS = 1
+TOP = 2
+SPARSE = 3
+
+def read_header(f):
+    magic, version, kind, _, rows, cols = HEADER.unpack(f.read(HEADER.size))
+    if magic != b'CAPS':
+        raise ValueError('not a Capsule binary parameter file')
+    return version, kind, rows, cols
+
+def load(filename, mmap=True):
+    with open(filename, 'rb') as f:
+        version, kind, rows, cols = read_header(f)
+
+    if kind == EVENTS:
+        dtype = np.dtype([('doc', '<i4'), ('date', '<i4'),
+                          ('val', '<f4'), ('decayed', '<f4')])
+        return np.memmap(filename, dtype=dtype, mode='r',
+                         offset=HEADER.size, shape=(rows,))
+
+    if kind == TOP:
+        entry = np.dtype([('term', '<i4'), ('weight', '<f4')])
+        dtype = np.dtype([('residual', '<f4'), ('top', entry, (cols,))])
+        return np.memmap(filename, dtype=dtype, mode='r',
+                         offset=HEADER.size, shape=(rows,))
+
+    if kind == SPARSE:
+        return load_sparse(filename, rows, cols)
+
+    if mmap:
+        return np.memmap(filename, dtype='<f4', mode='r', offset=HEADER.size,
+                         shape=(rows, cols), order='F')
+    data = np.fromfile(filename, dtype='<f4', offset=HEADER.size)
+    return data.reshape((rows, cols), order='F')
+
+class SparseRows(object):
+    def __init__(self, rows, cols, row_ptr, col, val, default):
+        self.shape = (rows, cols)
+        self.row_ptr = row_ptr
+        self.col = col
+        self.val = val
+        self.default = default
+
+    def row(self, r):
+        dense = np.empty(self.shape[1], dtype='<f4')
+        dense.fill(self.default[r])
+        lo, hi = self.row_ptr[r], self.row_ptr[r+1]
+        dense[self.col[lo:hi]] = self.val[lo:hi]
+        return dense
+
+    def dense(self):
+        return np.vstack([self.row(r) for r in range(self.shape[0])])
+
+def load_sparse(filename, rows, cols):
+    with open(filename, 'rb') as f:
+        f.seek(HEADER.size)
+        nnz = struct.unpack('<Q', f.read(8))[0]
+        row_ptr = np.fromfile(f, dtype='<u8', count=rows + 1)
+        col = np.fromfile(f, dtype='<i4', count=nnz)
+        val = np.fromfile(f, dtype='<f4', count=nnz)
+        default = np.fromfile(f, dtype='<f4', count=rows)
+    return SparseRows(rows, cols, row_ptr, col, val, default)
+
+def load_top(filename):
+    """Rows of a top-N file (--save_top), binary or text, as a list of
+    (residual, [(term, weight), ...]) with the heaviest term first."""
+    rows = []
+    if filename.endswith('.bin'):
+        for rec in load(filename):
+            top = [(int(e['term']), float(e['weight'])) for e in rec['top']
+                   if e['term'] >= 0]
+            rows.append((float(rec['residual']), top))
+        return rows
+
+    # text: row  residual  term:weight ...
+    for line in open(filename):
+        fields = line.strip().split('\t')
+        top = []
+        for entry in fields[2:]:
+            term, weight = entry.split(':')
+            top.append((int(term), float(weight)))
+        rows.append((float(fields[1]), top))
+    return rows
@@ -1,12 +1,17 @@
 import sys
+import capsule_bin
 
 vocab = [line.strip() for line in open(sys.argv[1]).readlines()]
-events = open(sys.argv[2]).readlines()
 event = int(sys.argv[3])
 
-terms = [float(v) for v in events[event].strip().split('\t')[2:]]
-
-event_terms = sorted(zip(terms, vocab), reverse=True)
+if '_top' in sys.argv[2]:
+    # a --save_top fit: pi_top-*.dat or .bin
+    residual, top = capsule_bin.load_top(sys.argv[2])[event]
+    event_terms = [(weight, vocab[term]) for term, weight in top]
+else:
+    events = open(sys.argv[2]).readlines()
+    terms = [float(v) for v in events[event].strip().split('\t')[2:]]
+    event_terms = sorted(zip(terms, vocab), reverse=True)
 
 for t in event_terms[:100]:
     print t
@@ -1,13 +1,17 @@
 import sys
+import capsule_bin
 
 vocab = [line.strip() for line in open(sys.argv[1]).readlines()]
-topics = open(sys.argv[2]).readlines()
 topic = int(sys.argv[3])
 
-
-topic = [float(v) for v in [topics[i].strip().split('\t')[topic+2] for i in range(len(vocab))]]
-
-topic_terms = sorted(zip(topic, vocab), reverse=True)
+if '_top' in sys.argv[2]:
+    # a --save_top fit: beta_top-*.dat or .bin, one row per topic
+    residual, top = capsule_bin.load_top(sys.argv[2])[topic]
+    topic_terms = [(weight, vocab[term]) for term, weight in top]
+else:
+    topics = open(sys.argv[2]).readlines()
+    topic = [float(v) for v in [topics[i].strip().split('\t')[topic+2] for i in range(len(vocab))]]
+    topic_terms = sorted(zip(topic, vocab), reverse=True)
 
 for t in topic_terms[:20]:
     print t
@@ -0,0 +1,307 @@
+#include "foldin.h"
+#include <algorithm>
+
+FoldIn::FoldIn(model_settings* model_set) {
+    settings = model_set;
+    n_terms = 0;
+    n_entities = 0;
+    n_dates = 0;
+}
+
+bool FoldIn::load(string fitdir, string label) {
+    string suffix = "-" + label + ".bin";
+
+    if (settings->incl_topics) {
+        // expected logs of beta come from its shapes, as in update_beta
+        if (!beta_file.open(fitdir + "/a_beta" + suffix, CAPSULE_BIN_DENSE) ||
+            !read_binary(fitdir + "/phi" + suffix, phi))
+            return false;
+        if ((int) beta_file.header.rows != settings->k) {
+            printf("a_beta has %d topics, but the model settings say K = %d\n",
+                (int) beta_file.header.rows, settings->k);
+            return false;
+        }
+        // a non-strict view, so that assignment moves it in rather than copying
+        a_beta = fmat(beta_file.dense(), beta_file.header.rows, beta_file.header.cols,
+            false, false);
+        n_terms = a_beta.n_cols;
+        n_entities = phi.n_cols;
+
+        beta_sum = fvec(settings->k);
+        beta_psi_sum = fvec(settings->k);
+        beta_total = fvec(settings->k);
+        for (int k = 0; k < settings->k; k++) {
+            beta_sum(k) = accu(a_beta.row(k));
+            beta_psi_sum(k) = gsl_sf_psi(beta_sum(k));
+            beta_total(k) = 1;
+        }
+    }
+
+    if (settings->incl_entity) {
+        if (!read_binary(fitdir + "/xi" + suffix, xi) ||
+            !eta_file.open(fitdir + "/a_eta" + suffix, CAPSULE_BIN_SPARSE))
+            return false;
+        eta.map(eta_file);
+        n_entities = xi.n_elem;
+        n_terms = max(n_terms, eta.cols());
+    }
+
+    if (settings->incl_events) {
+        if (!read_binary(fitdir + "/psi" + suffix, psi) ||
+            !pi_file.open(fitdir + "/a_pi" + suffix, CAPSULE_BIN_SPARSE))
+            return false;
+        pi.map(pi_file);
+        n_dates = psi.n_elem;
+        n_terms = max(n_terms, pi.cols());
+
+        decay = fvec(settings->event_dur);
+        logdecay = fvec(settings->event_dur);
+        for (int lag = 0; lag < settings->event_dur; lag++) {
+            decay(lag) = settings->decay(lag);
+            logdecay(lag) = log(decay(lag));
+        }
+    }
+
+    return true;
+}
+
+void FoldIn::build_table(const vector<const foldin_doc*>& docs, term_table& table) const {
+    table.terms.clear();
+    if (!settings->incl_topics)
+        return;
+    for (size_t i = 0; i < docs.size(); i++) {
+        for (size_t j = 0; j < docs[i]->terms.size(); j++) {
+            if (docs[i]->terms[j] >= 0 && docs[i]->terms[j] < n_terms)
+                table.terms.push_back(docs[i]->terms[j]);
+        }
+    }
+    sort(table.terms.begin(), table.terms.end());
+    table.terms.erase(unique(table.terms.begin(), table.terms.end()), table.terms.end());
+
+    int n = table.terms.size();
+    table.logbeta = fmat(settings->k, n);
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < n; i++) {
+        for (int k = 0; k < settings->k; k++)
+            table.logbeta(k, i) = gsl_sf_psi(a_beta(k, table.terms[i])) - beta_psi_sum(k);
+    }
+}
+
+void FoldIn::infer(const foldin_doc& doc, foldin_result& result,
+                   int max_iter, double converge) const {
+    vector<const foldin_doc*> docs(1, &doc);
+    term_table table;
+    build_table(docs, table);
+    infer(doc, table, result, max_iter, converge, NULL);
+}
+
+void FoldIn::infer(const foldin_doc& doc, const term_table& table,
+                   foldin_result& result, int max_iter, double converge,
+                   const event_rows* extra) const {
+    int K = settings->k;
+    int dur = settings->event_dur;
+
+    // the document's words the model knows, and their columns in the table
+    vector<int> terms, counts, cols, index;
+    for (size_t i = 0; i < doc.terms.size(); i++) {
+        if (doc.terms[i] >= 0 && doc.terms[i] < n_terms) {
+            terms.push_back(doc.terms[i]);
+            counts.push_back(doc.counts[i]);
+            index.push_back(i);
+            cols.push_back(lower_bound(table.terms.begin(), table.terms.end(),
+                doc.terms[i]) - table.terms.begin());
+        }
+    }
+    int words = terms.size();
+
+    bool topics = settings->incl_topics;
+    bool known_entity = doc.entity >= 0 && doc.entity < n_entities;
+    bool entity = settings->incl_entity && known_entity;
+    // event dates in the document's window that the model was fitted on,
+    // or that the extra rows cover
+    int first = max(0, doc.date - dur + 1);
+    int last = settings->incl_events ? min(doc.date, n_dates - 1) : first - 1;
+    if (settings->incl_events && extra)
+        last = min(doc.date, extra->first + extra->count() - 1);
+
+    // rates are fixed by the globals; the per-word expected logs of eta and
+    // pi are looked up once
+    fvec a_theta(K), b_theta(K), theta(K), logtheta(K);
+    if (topics) {
+        for (int k = 0; k < K; k++) {
+            b_theta(k) = (known_entity ? phi(k, doc.entity) :
+                settings->a_phi / settings->b_phi) + beta_total(k);
+            theta(k) = settings->a_theta / b_theta(k);
+            logtheta(k) = gsl_sf_psi(settings->a_theta) - log(b_theta(k));
+        }
+    }
+
+    double a_zeta = 0, b_zeta = 1, zeta = 0, logzeta = 0;
+    fvec eta_log(words);
+    if (entity) {
+        b_zeta = xi(doc.entity) + eta.total(doc.entity);
+        zeta = settings->a_zeta / b_zeta;
+        logzeta = gsl_sf_psi(settings->a_zeta) - log(b_zeta);
+        for (int w = 0; w < words; w++)
+            eta_log(w) = eta.log(doc.entity, terms[w]);
+    }
+
+    fvec a_eps(dur), b_eps(dur), epsilon(dur), logeps(dur);
+    fmat pi_log(dur, words);
+    epsilon.zeros();
+    for (int d = first; d <= last; d++) {
+        int lag = doc.date - d;
+        int row = d < n_dates ? -1 : d - extra->first;
+        if (row < 0) {
+            b_eps(lag) = decay(lag) * pi.total(d) + psi(d);
+            for (int w = 0; w < words; w++)
+                pi_log(lag, w) = pi.log(d, terms[w]) + logdecay(lag);
+        } else {
+            b_eps(lag) = decay(lag) * extra->total[row] + extra->psi[row];
+            for (int w = 0; w < words; w++)
+                pi_log(lag, w) = extra->log_at(row, terms[w]) + logdecay(lag);
+        }
+        epsilon(lag) = settings->a_epsilon / b_eps(lag);
+        logeps(lag) = gsl_sf_psi(settings->a_epsilon) - log(b_eps(lag));
+    }
+
+    fmat event_counts;
+    if (extra) {
+        event_counts = fmat(dur, doc.terms.size());
+        event_counts.zeros();
+    }
+
+    fvec omega_topics(K), omega_event(dur);
+    int iter = 0;
+    while (iter < max_iter) {
+        iter++;
+
+        a_theta.fill(settings->a_theta);
+        a_zeta = settings->a_zeta;
+        a_eps.fill(settings->a_epsilon);
+
+        for (int w = 0; w < words; w++) {
+            double omega_sum = 0;
+            double omega_entity = 0;
+
+            if (topics) {
+                for (int k = 0; k < K; k++) {
+                    omega_topics(k) = exp(logtheta(k) + table.logbeta(k, cols[w]));
+                    omega_sum += omega_topics(k);
+                }
+            }
+
+            if (entity) {
+                omega_entity = exp(logzeta + eta_log(w));
+                omega_sum += omega_entity;
+            }
+
+            for (int d = first; d <= last; d++) {
+                int lag = doc.date - d;
+                omega_event(lag) = exp(logeps(lag) + pi_log(lag, w));
+                omega_sum += omega_event(lag);
+            }
+
+            if (omega_sum == 0)
+                continue;
+
+            double scale = counts[w] / omega_sum;
+            if (topics) {
+                for (int k = 0; k < K; k++)
+                    a_theta(k) += omega_topics(k) * scale;
+            }
+            if (entity)
+                a_zeta += omega_entity * scale;
+            for (int d = first; d <= last; d++)
+                a_eps(doc.date - d) += omega_event(doc.date - d) * scale;
+            if (extra) {
+                for (int d = first; d <= last; d++)
+                    event_counts(doc.date - d, index[w]) = omega_event(doc.date - d) * scale;
+            }
+        }
+
+        // converged once the local means stop changing
+        double change = 0, size = 0, mean;
+        if (topics) {
+            for (int k = 0; k < K; k++) {
+                mean = a_theta(k) / b_theta(k);
+                change += fabs(mean - theta(k));
+                size += mean;
+                theta(k) = mean;
+                logtheta(k) = gsl_sf_psi(a_theta(k)) - log(b_theta(k));
+            }
+        }
+        if (entity) {
+            mean = a_zeta / b_zeta;
+            change += fabs(mean - zeta);
+            size += mean;
+            zeta = mean;
+            logzeta = gsl_sf_psi(a_zeta) - log(b_zeta);
+        }
+        for (int d = first; d <= last; d++) {
+            int lag = doc.date - d;
+            mean = a_eps(lag) / b_eps(lag);
+            change += fabs(mean - epsilon(lag));
+            size += mean;
+            epsilon(lag) = mean;
+            logeps(lag) = gsl_sf_psi(a_eps(lag)) - log(b_eps(lag));
+        }
+
+        if (size == 0 || change / size < converge)
+            break;
+    }
+
+    result.theta = topics ? theta : fvec();
+    result.zeta = zeta;
+    result.epsilon = epsilon;
+    result.iterations = iter;
+    result.event_counts = event_counts;
+
+    // as in explore/eventness.py: decayed event weight over all local weight
+    double events = 0;
+    for (int d = first; d <= last; d++)
+        events += epsilon(doc.date - d) * decay(doc.date - d);
+    double total = events + zeta + (topics ? accu(theta) : 0);
+    result.event_score = total > 0 ? events / total : 0;
+}
+
+void FoldIn::infer(const vector<foldin_doc>& docs, vector<foldin_result>& results,
+                   int max_iter, double converge, const event_rows* extra) const {
+    vector<const foldin_doc*> batch(docs.size());
+    for (size_t i = 0; i < docs.size(); i++)
+        batch[i] = &docs[i];
+    infer(batch, results, max_iter, converge, extra);
+}
+
+void FoldIn::infer(const vector<const foldin_doc*>& docs, vector<foldin_result>& results,
+                   int max_iter, double converge, const event_rows* extra) const {
+    term_table table;
+    build_table(docs, table);
+    results.resize(docs.size());
+
+    #pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < (int) docs.size(); i++)
+        infer(*docs[i], table, results[i], max_iter, converge, extra);
+}
+
+double FoldIn::predict(const foldin_doc& doc, const foldin_result& result, int term) const {
+    if (term < 0 || term >= n_terms)
+        return 0;
+
+    double prediction = 0;
+
+    if (settings->incl_topics) {
+        for (int k = 0; k < settings->k; k++)
+            prediction += result.theta(k) * a_beta(k, term) / beta_sum(k);
+    }
+
+    if (settings->incl_entity && doc.entity >= 0 && doc.entity < n_entities)
+        prediction += result.zeta * eta(doc.entity, term);
+
+    if (settings->incl_events) {
+        for (int d = max(0, doc.date - settings->event_dur + 1); d <= min(doc.date, n_dates - 1); d++)
+            prediction += decay(doc.date - d) * result.epsilon(doc.date - d) * pi(d, term);
+    }
+
+    return prediction;
+}
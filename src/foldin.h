@@ -0,0 +1,117 @@
+#ifndef FOLDIN_H
+#define FOLDIN_H
+
+#include <string>
+#include <vector>
+#include <map>
+
+#include "capsule.h"
+
+using namespace std;
+
+// a new document: its metadata and term counts
+struct foldin_doc {
+    int id;
+    int entity;
+    int date;
+    vector<int> terms;
+    vector<int> counts;
+};
+
+// local parameters of a folded-in document
+struct foldin_result {
+    fvec theta;
+    float zeta;
+    fvec epsilon;       // epsilon(lag) for the event on date - lag
+    float event_score;  // share of the document's decayed weight on events
+    int iterations;
+    fmat event_counts;  // with event_rows: expected count of each of the
+                        // document's terms (cols) from the event on date - lag
+};
+
+// event parameters of dates after the fitted model's, estimated outside it
+// (see EventStream): row r is the date first + r, and must follow the
+// model's dates or the previous row
+struct event_rows {
+    int first;
+    vector<map<int, float> > log;   // expected logs of pi's stored cells
+    vector<float> default_log;      // ... and of every other cell in the row
+    vector<float> total;
+    vector<float> psi;
+
+    int count() const { return log.size(); }
+    float log_at(int row, int term) const {
+        map<int, float>::const_iterator it = log[row].find(term);
+        return it == log[row].end() ? default_log[row] : it->second;
+    }
+};
+
+// Fold-in inference: the local parameters (theta, zeta, epsilon) of new
+// documents, with the global parameters of a fitted model held fixed.
+//
+// The globals come from a model's binary dump; the large ones (the shapes of
+// beta, eta, and pi) stay memory-mapped and their expected logs are computed
+// on demand, as in --low_memory.  Each document then runs the same local
+// updates as Capsule::learn until its local means stop changing.  Documents
+// are independent, so a batch runs in parallel, sharing one table of beta's
+// expected logs for the batch's terms.
+//
+// Terms outside the model's vocabulary are dropped; a document whose entity
+// is unknown uses the prior for phi and has no entity factor, and only event
+// dates the model was fitted on contribute event factors.
+class FoldIn {
+    private:
+        model_settings* settings;
+
+        int n_terms;
+        int n_entities;
+        int n_dates;
+
+        MappedParams beta_file;
+        MappedParams eta_file;
+        MappedParams pi_file;
+
+        fmat a_beta;        // view of beta_file
+        fvec beta_sum;
+        fvec beta_psi_sum;
+        fvec beta_total;
+        fmat phi;
+        fvec xi;
+        fvec psi;
+        SparseDirichlet eta;
+        SparseDirichlet pi;
+        fvec decay;
+        fvec logdecay;
+
+        // expected logs of beta for a set of terms
+        struct term_table {
+            vector<int> terms;  // sorted
+            fmat logbeta;       // K x terms
+        };
+        void build_table(const vector<const foldin_doc*>& docs, term_table& table) const;
+        void infer(const foldin_doc& doc, const term_table& table,
+                   foldin_result& result, int max_iter, double converge,
+                   const event_rows* extra) const;
+
+    public:
+        FoldIn(model_settings* model_set);
+
+        // load the globals saved as <name>-<label>.bin in fitdir
+        bool load(string fitdir, string label);
+
+        int term_count() const { return n_terms; }
+        int entity_count() const { return n_entities; }
+        int date_count() const { return n_dates; }
+
+        void infer(const foldin_doc& doc, foldin_result& result,
+                   int max_iter, double converge) const;
+        void infer(const vector<foldin_doc>& docs, vector<foldin_result>& results,
+                   int max_iter, double converge, const event_rows* extra = NULL) const;
+        void infer(const vector<const foldin_doc*>& docs, vector<foldin_result>& results,
+                   int max_iter, double converge, const event_rows* extra = NULL) const;
+
+        // expected count of a term in a folded-in document (as Capsule::predict)
+        double predict(const foldin_doc& doc, const foldin_result& result, int term) const;
+};
+
+#endif
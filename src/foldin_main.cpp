@@ -0,0 +1,221 @@
+#include <getopt.h>
+#include <omp.h>
+#include "foldin.h"
+
+#include <stdio.h>
+
+void print_usage_and_exit() {
+    // print usage information
+    printf("*********************** Capsule Fold-in Inference *************************\n");
+    printf("Local parameters (theta, zeta, epsilon) of new documents under a fitted\n");
+    printf("Capsule model, whose global parameters are held fixed.\n");
+
+    printf("\nusage:\n");
+    printf(" capsule-foldin [options]\n");
+    printf("  --help            print help information\n");
+
+    printf("\n");
+    printf("  --model {dir}     fitted model directory (with model.txt and binary\n");
+    printf("                    parameter files), required\n");
+    printf("  --label {label}   which saved parameters to use; default 'final'\n");
+    printf("  --docs {file}     new doc-term counts (doc, term, count), required\n");
+    printf("  --meta {file}     new doc metadata (doc, entity, date), required\n");
+    printf("  --out {dir}       save directory, required\n");
+
+    printf("\n");
+    printf("  --max_iter {max}  the max number of local iterations per document,\n");
+    printf("                    default 100\n");
+    printf("  --converge {c}    the relative change in the local means required for\n");
+    printf("                    convergence, default 1e-4\n");
+    printf("  --threads {n}     number of threads; default all available\n");
+
+    printf("********************************************************************************\n");
+
+    exit(0);
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) print_usage_and_exit();
+
+    string model = "";
+    string label = "final";
+    string docs_file = "";
+    string meta_file = "";
+    string out = "";
+    int max_iter = 100;
+    double converge = 1e-4;
+    int threads = 0;
+
+    int opt;
+    const char* const short_options = "hM:l:d:m:o:i:c:t:";
+    const struct option long_options[] = {
+        {"help",            no_argument,       NULL, 'h'},
+        {"model",           required_argument, NULL, 'M'},
+        {"label",           required_argument, NULL, 'l'},
+        {"docs",            required_argument, NULL, 'd'},
+        {"meta",            required_argument, NULL, 'm'},
+        {"out",             required_argument, NULL, 'o'},
+        {"max_iter",        required_argument, NULL, 'i'},
+        {"converge",        required_argument, NULL, 'c'},
+        {"threads",         required_argument, NULL, 't'},
+        {NULL, 0, NULL, 0}};
+
+    while (true) {
+        opt = getopt_long(argc, argv, short_options, long_options, NULL);
+        switch (opt) {
+            case 'h':
+                print_usage_and_exit();
+                break;
+            case 'M':
+                model = optarg;
+                break;
+            case 'l':
+                label = optarg;
+                break;
+            case 'd':
+                docs_file = optarg;
+                break;
+            case 'm':
+                meta_file = optarg;
+                break;
+            case 'o':
+                out = optarg;
+                break;
+            case 'i':
+                max_iter = atoi(optarg);
+                break;
+            case 'c':
+                converge = atof(optarg);
+                break;
+            case 't':
+                threads = atoi(optarg);
+                break;
+            case -1:
+                break;
+            case '?':
+                print_usage_and_exit();
+                break;
+            default:
+                break;
+        }
+        if (opt == -1)
+            break;
+    }
+
+    if (model == "" || docs_file == "" || meta_file == "" || out == "") {
+        printf("--model, --docs, --meta, and --out are required.  Exiting.\n");
+        exit(-1);
+    }
+    if (!file_exists(docs_file) || !file_exists(meta_file)) {
+        printf("document file %s or metadata file %s doesn't exist!  Exiting.\n",
+            docs_file.c_str(), meta_file.c_str());
+        exit(-1);
+    }
+    if (!dir_exists(out))
+        make_directory(out);
+    if (threads > 0)
+        omp_set_num_threads(threads);
+
+    printf("********************************************************************************\n");
+    printf("loading model from %s (%s)\n", model.c_str(), label.c_str());
+    model_settings settings;
+    if (!settings.load_model(model + "/model.txt")) {
+        printf("model settings file %s/model.txt doesn't exist!  Exiting.\n", model.c_str());
+        exit(-1);
+    }
+    FoldIn foldin(&settings);
+    if (!foldin.load(model, label)) {
+        printf("unable to load the binary parameters (fits saved with --save_text,\n");
+        printf("or with --save_top but not --save_shapes, cannot be used for fold-in).  Exiting.\n");
+        exit(-1);
+    }
+    printf("\tK = %d, %d terms, %d entities, %d dates\n", settings.k,
+        foldin.term_count(), foldin.entity_count(), foldin.date_count());
+
+    // read in the new documents, in order of their ids
+    printf("reading new documents\n");
+    map<int, foldin_doc> by_id;
+    int doc, term, count, entity, date;
+    FILE* fileptr = fopen(meta_file.c_str(), "r");
+    while (fscanf(fileptr, "%d\t%d\t%d\n", &doc, &entity, &date) == 3) {
+        foldin_doc& d = by_id[doc];
+        d.id = doc;
+        d.entity = entity;
+        d.date = date;
+    }
+    fclose(fileptr);
+
+    // term ids as in the training data, hashed as they were for the fit
+    int skipped = 0;
+    unsigned long long id;
+    fileptr = fopen(docs_file.c_str(), "r");
+    while (fscanf(fileptr, "%d\t%llu\t%d\n", &doc, &id, &count) == 3) {
+        term = hash_term(id, settings.hash_terms);
+        map<int, foldin_doc>::iterator it = by_id.find(doc);
+        if (it == by_id.end() || count == 0) {
+            skipped++;
+            continue;
+        }
+        it->second.terms.push_back(term);
+        it->second.counts.push_back(count);
+    }
+    fclose(fileptr);
+    if (skipped > 0)
+        printf("\tskipped %d counts (zero, or no metadata for the doc)\n", skipped);
+
+    vector<foldin_doc> docs;
+    for (map<int, foldin_doc>::iterator it = by_id.begin(); it != by_id.end(); it++)
+        docs.push_back(it->second);
+    map<int, foldin_doc>().swap(by_id);
+    printf("\t%d documents\n", (int) docs.size());
+
+    printf("folding in\n");
+    vector<foldin_result> results;
+    double start = omp_get_wtime();
+    foldin.infer(docs, results, max_iter, converge);
+    double elapsed = omp_get_wtime() - start;
+    printf("\t%.2fs (%.0f docs/s, %d threads)\n", elapsed,
+        elapsed > 0 ? docs.size() / elapsed : 0.0, omp_get_max_threads());
+
+    printf("saving to %s\n", out.c_str());
+    FILE* file;
+    if (settings.incl_topics) {
+        file = fopen((out + "/theta.dat").c_str(), "w");
+        for (size_t i = 0; i < docs.size(); i++) {
+            fprintf(file, "%d", docs[i].id);
+            for (int k = 0; k < settings.k; k++)
+                fprintf(file, "\t%e", results[i].theta(k));
+            fprintf(file, "\n");
+        }
+        fclose(file);
+    }
+
+    if (settings.incl_entity) {
+        file = fopen((out + "/zeta.dat").c_str(), "w");
+        for (size_t i = 0; i < docs.size(); i++)
+            fprintf(file, "%d\t%e\n", docs[i].id, results[i].zeta);
+        fclose(file);
+    }
+
+    if (settings.incl_events) {
+        // same columns as epsilon-*.dat: doc, event date, value, decayed value
+        file = fopen((out + "/epsilon.dat").c_str(), "w");
+        for (size_t i = 0; i < docs.size(); i++) {
+            for (int lag = 0; lag < settings.event_dur; lag++) {
+                if (results[i].epsilon(lag) == 0)
+                    continue;
+                fprintf(file, "%d\t%d\t%e\t%e\n", docs[i].id, docs[i].date - lag,
+                    results[i].epsilon(lag), results[i].epsilon(lag) * settings.decay(lag));
+            }
+        }
+        fclose(file);
+    }
+
+    file = fopen((out + "/event_scores.dat").c_str(), "w");
+    for (size_t i = 0; i < docs.size(); i++)
+        fprintf(file, "%d\t%d\t%d\t%e\t%d\n", docs[i].id, docs[i].entity, docs[i].date,
+            results[i].event_score, results[i].iterations);
+    fclose(file);
+
+    return 0;
+}
@@ -1,11 +1,23 @@
 #include <getopt.h>
 #include "capsule.h"
+#include "planner.h"
+#include "numa.h"
 
 
 #include <stdio.h>
+#include <ctype.h>
 
 //gsl_rng * RANDOM_NUMBER = NULL;
 
+// the single-character option codes are all taken; later options are long only
+enum {
+    OPT_INNER_ITER = 256,
+    OPT_INNER_TOL,
+    OPT_SKIP_TOL,
+    OPT_SKIP_REFRESH,
+    OPT_SAVE_SHAPES
+};
+
 void print_usage_and_exit() {
     // print usage information
     printf("********************** Capsule Event Detection Model **********************\n");
@@ -64,6 +76,68 @@ void print_usage_and_exit() {
     printf("                    default 1e-6\n");
     printf("  --final_pass      do a final pass on all data\n");
     printf("  --overwrite       overwrite old results (only keep latest)\n");
+    printf("  --save_text       save parameters as text (.dat) instead of binary (.bin)\n");
+    printf("  --save_top {n}    save only the top n terms (and residual mass) of each row\n");
+    printf("                    of beta, eta, and pi; default 0 (save dense rows)\n");
+    printf("  --save_shapes     with --save_top, also save the full shapes (a_beta, a_eta,\n");
+    printf("                    a_pi) for warm starts and fold-in, not only their row sums\n");
+    printf("  --epsilon_min {t} save only epsilon values >= t; default 0 (save all)\n");
+    printf("  --low_memory      keep only variational shapes and rates; recompute means\n");
+    printf("                    and expected logs when needed (slower, less memory)\n");
+    printf("  --dry_run         print the memory and work plan, then exit without training\n");
+    printf("  --warm_start {d}  continue from the final binary fit in directory d, made\n");
+    printf("                    on an earlier version of this data; refit only what\n");
+    printf("                    the new dates touch (batch VI only)\n");
+    printf("  --refresh {r}     with --warm_start, refit everything every r iterations;\n");
+    printf("                    default 0 (never)\n");
+    printf("  --doc_store {d}   keep the training documents on disk, in a document store\n");
+    printf("                    in directory d, instead of in memory\n");
+    printf("  --doc_cache {mb}  memory for cached documents from the store, default 256\n");
+    printf("  --pack_docs       keep the training documents compressed in memory\n");
+    printf("  --doc_order {o}   order of visiting documents: 'id' (each entity-date cell's\n");
+    printf("                    together), 'date_entity', or 'hilbert' (a space-filling\n");
+    printf("                    curve over dates x entities); default id\n");
+    printf("  --cache_stats     log hardware cache misses per token of each E-step pass\n");
+    printf("  --remap_terms     number the terms by descending count internally, so the\n");
+    printf("                    frequent ones share cache lines; outputs keep the input ids\n");
+    printf("  --min_count {n}   drop terms with fewer than n training counts; default 1\n");
+    printf("  --max_df {f}      drop terms in more than a fraction f of the training\n");
+    printf("                    documents; default 0 (keep all)\n");
+    printf("  --hash_terms {n}  hash the (64-bit) input term ids into n buckets, which\n");
+    printf("                    then are the terms; default 0 (ids used as given)\n");
+    printf("  --top_topics {m}  approximate E-step: spread each token over its document's\n");
+    printf("                    m most likely topics only; default 0 (all K topics)\n");
+    printf("  --top_tolerance {t} with --top_topics, use all K topics for tokens where the\n");
+    printf("                    others could take more than a share t; default 0.01\n");
+    printf("  --prune_topics {p} drop topics below --prune_mass of the topic mass for p\n");
+    printf("                    passes in a row; default 0 (keep all K)\n");
+    printf("  --prune_mass {m}  share of the topic mass below which a topic is idle;\n");
+    printf("                    default 0.001\n");
+    printf("  --inner_iter {n}  up to n passes over each document per iteration, all but\n");
+    printf("                    the last refining only its local parameters; default 1\n");
+    printf("  --inner_tol {t}   stop a document's passes when no expected log of its\n");
+    printf("                    locals changes by t or more; default 0.001\n");
+    printf("  --skip_tol {t}    batch VI: skip documents whose expected logs changed by\n");
+    printf("                    less than t, reusing their last contributions to the\n");
+    printf("                    globals; default 0 (recompute every document)\n");
+    printf("  --skip_refresh {r} with --skip_tol, recompute every document every r\n");
+    printf("                    iterations; default 10\n");
+    printf("  --arena {mode}    backing of the parameter arena: 'transparent' or 'explicit'\n");
+    printf("                    huge pages, or 'off' (separate heap blocks); default\n");
+    printf("                    transparent\n");
+    printf("  --workers {n}     train with n processes in all (batch VI only); this one\n");
+    printf("                    is the aggregator, rank 0; default 1\n");
+    printf("  --port {p}        aggregator port, default 7341\n");
+    printf("  --aggregator {h:p} join the aggregator at host h, port p as a worker; needs\n");
+    printf("                    --workers, --rank, and its own --out\n");
+    printf("  --rank {r}        this worker's rank, 1 to n-1\n");
+    printf("  --shard_dates     split the workers' documents by contiguous ranges of dates,\n");
+    printf("                    so each keeps only its dates' event descriptions\n");
+    printf("  --shard_entities  split the workers' documents by entity, balanced by\n");
+    printf("                    document counts, so each keeps only its entities' parameters\n");
+    printf("  --numa {p}        NUMA placement: 'interleave' spreads memory over all nodes;\n");
+    printf("                    'bind' runs on and allocates from node (rank mod nodes);\n");
+    printf("                    a number binds to that node; default none\n");
     printf("\n");
 
     printf("  --sample {size}   the stochastic sample size, default 1000\n");
@@ -109,6 +183,39 @@ int main(int argc, char* argv[]) {
     int incl_events = 1;
     bool final_pass = 0;
     bool overwrite = 0;
+    bool save_text = 0;
+    int save_top = 0;
+    bool save_shapes = 0;
+    double epsilon_min = 0;
+    bool low_memory = 0;
+    bool dry_run = 0;
+    string warm_start = "";
+    int refresh_freq = 0;
+    string doc_store = "";
+    int doc_cache = 256;
+    bool pack_docs = 0;
+    int workers = 1;
+    int port = 7341;
+    string aggregator = "";
+    int rank = 0;
+    bool shard_dates = 0;
+    bool shard_entities = 0;
+    string numa = "";
+    string arena = "transparent";
+    string doc_order = "id";
+    bool cache_stats = 0;
+    bool remap_terms = 0;
+    int min_count = 1;
+    double max_df = 0;
+    int hash_terms = 0;
+    int top_topics = 0;
+    double top_tolerance = 0.01;
+    int prune_patience = 0;
+    double prune_mass = 0.001;
+    int inner_iter = 1;
+    double inner_tol = 0.001;
+    double skip_tol = 0;
+    int skip_refresh = 10;
 
     int event_dur = 7;
     string event_decay = "exponential";
@@ -129,7 +236,7 @@ int main(int argc, char* argv[]) {
     int    k = 100;
 
     // ':' after a character means it takes an argument
-    const char* const short_options = "hqo:d:M:vb1:2:3:4:5:6:7:8:9:0:i:l:r:y:s:w:j:g:x:m:c:a:e:f:pnk:";
+    const char* const short_options = "hqo:d:M:vb1:2:3:4:5:6:7:8:9:0:i:l:r:y:s:w:j:g:x:m:c:a:e:f:pnTN:E:LDW:R:S:C:G:P:A:K:HUY:Z:B:JVQ:X:t:Iu:z:O:F:k:";
     const struct option long_options[] = {
         {"help",            no_argument,       NULL, 'h'},
         {"verbose",         no_argument,       NULL, 'q'},
@@ -167,6 +274,39 @@ int main(int argc, char* argv[]) {
         {"svi_forget",      required_argument, NULL, 'f'},
         {"final_pass",      no_argument, NULL, 'p'},
         {"overwrite",       no_argument, NULL, 'n'},
+        {"save_text",       no_argument, NULL, 'T'},
+        {"save_top",        required_argument, NULL, 'N'},
+        {"epsilon_min",     required_argument, NULL, 'E'},
+        {"low_memory",      no_argument, NULL, 'L'},
+        {"dry_run",         no_argument, NULL, 'D'},
+        {"warm_start",      required_argument, NULL, 'W'},
+        {"refresh",         required_argument, NULL, 'R'},
+        {"doc_store",       required_argument, NULL, 'S'},
+        {"doc_cache",       required_argument, NULL, 'C'},
+        {"pack_docs",       no_argument, NULL, 'I'},
+        {"workers",         required_argument, NULL, 'G'},
+        {"port",            required_argument, NULL, 'P'},
+        {"aggregator",      required_argument, NULL, 'A'},
+        {"rank",            required_argument, NULL, 'K'},
+        {"shard_dates",     no_argument, NULL, 'H'},
+        {"shard_entities",  no_argument, NULL, 'U'},
+        {"numa",            required_argument, NULL, 'Y'},
+        {"arena",           required_argument, NULL, 'Z'},
+        {"doc_order",       required_argument, NULL, 'B'},
+        {"cache_stats",     no_argument, NULL, 'J'},
+        {"remap_terms",     no_argument, NULL, 'V'},
+        {"min_count",       required_argument, NULL, 'Q'},
+        {"max_df",          required_argument, NULL, 'X'},
+        {"hash_terms",      required_argument, NULL, 't'},
+        {"top_topics",      required_argument, NULL, 'u'},
+        {"top_tolerance",   required_argument, NULL, 'z'},
+        {"prune_topics",    required_argument, NULL, 'O'},
+        {"prune_mass",      required_argument, NULL, 'F'},
+        {"inner_iter",      required_argument, NULL, OPT_INNER_ITER},
+        {"inner_tol",       required_argument, NULL, OPT_INNER_TOL},
+        {"skip_tol",        required_argument, NULL, OPT_SKIP_TOL},
+        {"skip_refresh",    required_argument, NULL, OPT_SKIP_REFRESH},
+        {"save_shapes",     no_argument,       NULL, OPT_SAVE_SHAPES},
         {"K",               required_argument, NULL, 'k'},
         {NULL, 0, NULL, 0}};
 
@@ -274,6 +414,105 @@ int main(int argc, char* argv[]) {
             case 'n':
                 overwrite = true;
                 break;
+            case 'T':
+                save_text = true;
+                break;
+            case 'N':
+                save_top = atoi(optarg);
+                break;
+            case 'E':
+                epsilon_min = atof(optarg);
+                break;
+            case 'L':
+                low_memory = true;
+                break;
+            case 'D':
+                dry_run = true;
+                break;
+            case 'W':
+                warm_start = optarg;
+                break;
+            case 'R':
+                refresh_freq = atoi(optarg);
+                break;
+            case 'S':
+                doc_store = optarg;
+                break;
+            case 'C':
+                doc_cache = atoi(optarg);
+                break;
+            case 'I':
+                pack_docs = true;
+                break;
+            case 'G':
+                workers = atoi(optarg);
+                break;
+            case 'P':
+                port = atoi(optarg);
+                break;
+            case 'A':
+                aggregator = optarg;
+                break;
+            case 'K':
+                rank = atoi(optarg);
+                break;
+            case 'H':
+                shard_dates = true;
+                break;
+            case 'U':
+                shard_entities = true;
+                break;
+            case 'Y':
+                numa = optarg;
+                break;
+            case 'Z':
+                arena = optarg;
+                break;
+            case 'B':
+                doc_order = optarg;
+                break;
+            case 'J':
+                cache_stats = true;
+                break;
+            case 'V':
+                remap_terms = true;
+                break;
+            case 'Q':
+                min_count = atoi(optarg);
+                break;
+            case 'X':
+                max_df = atof(optarg);
+                break;
+            case 't':
+                hash_terms = atoi(optarg);
+                break;
+            case 'u':
+                top_topics = atoi(optarg);
+                break;
+            case 'z':
+                top_tolerance = atof(optarg);
+                break;
+            case 'O':
+                prune_patience = atoi(optarg);
+                break;
+            case 'F':
+                prune_mass = atof(optarg);
+                break;
+            case OPT_INNER_ITER:
+                inner_iter = atoi(optarg);
+                break;
+            case OPT_INNER_TOL:
+                inner_tol = atof(optarg);
+                break;
+            case OPT_SKIP_TOL:
+                skip_tol = atof(optarg);
+                break;
+            case OPT_SKIP_REFRESH:
+                skip_refresh = atoi(optarg);
+                break;
+            case OPT_SAVE_SHAPES:
+                save_shapes = true;
+                break;
             case 'k':
                 k = atoi(optarg);
                 break;
@@ -297,6 +536,31 @@ int main(int argc, char* argv[]) {
         exit(-1);
     }
 
+    if (warm_start != "") {
+        if (!file_exists(warm_start + "/model.txt")) {
+            printf("warm start directory %s has no model.txt!  Exiting.\n", warm_start.c_str());
+            exit(-1);
+        }
+        if (warm_start == out) {
+            printf("warm start directory must differ from the output directory.  Exiting.\n");
+            exit(-1);
+        }
+    }
+
+    if (workers < 1 || (aggregator != "" && (rank < 1 || rank >= workers))) {
+        printf("a worker's --rank must be between 1 and --workers - 1.  Exiting.\n");
+        exit(-1);
+    }
+    if (aggregator != "") {
+        size_t colon = aggregator.rfind(':');
+        if (colon == string::npos) {
+            printf("--aggregator must be host:port.  Exiting.\n");
+            exit(-1);
+        }
+        port = atoi(aggregator.substr(colon + 1).c_str());
+        aggregator = aggregator.substr(0, colon);
+    }
+
     if (dir_exists(out)) {
         string rmout = "rm -rf " + out;
         system(rmout.c_str());
@@ -304,6 +568,31 @@ int main(int argc, char* argv[]) {
     make_directory(out);
     printf("output directory: %s\n", out.c_str());
 
+    // place this process before the data and parameters are first touched
+    if (numa != "") {
+        NumaLayout layout;
+        bool placed = false;
+        if (layout.node_count() == 0)
+            printf("no NUMA layout found; ignoring --numa\n");
+        else if (numa == "interleave")
+            placed = layout.interleave();
+        else if (numa == "bind")
+            placed = layout.bind(rank % layout.node_count());
+        else if (isdigit(numa[0]))
+            placed = layout.bind(atoi(numa.c_str()));
+        else
+            printf("unknown --numa placement %s\n", numa.c_str());
+        if (layout.node_count() > 0 && !placed) {
+            printf("Exiting.\n");
+            exit(-1);
+        }
+        if (layout.node_count() > 1)
+            layout.measure(NUMA_PROBE_MB);
+        layout.print(stdout);
+        if (layout.node_count() > 0)
+            layout.save(out + "/numa.txt");
+    }
+
     if (data == "") {
         printf("No data directory specified.  Exiting.\n");
         exit(-1);
@@ -325,6 +614,58 @@ int main(int argc, char* argv[]) {
         exit(-1);
     }
 
+    if (arena != "transparent" && arena != "explicit" && arena != "off") {
+        printf("--arena must be transparent, explicit, or off.  Exiting.\n");
+        exit(-1);
+    }
+
+    if (doc_order != "id" && doc_order != "date_entity" && doc_order != "hilbert") {
+        printf("--doc_order must be id, date_entity, or hilbert.  Exiting.\n");
+        exit(-1);
+    }
+
+    if (max_df < 0 || max_df > 1) {
+        printf("--max_df must be in [0, 1].  Exiting.\n");
+        exit(-1);
+    }
+
+    if (top_topics < 0 || top_tolerance < 0 || top_tolerance > 1) {
+        printf("--top_topics must be at least 0, and --top_tolerance in [0, 1].  Exiting.\n");
+        exit(-1);
+    }
+    if (top_topics > 0 && low_memory) {
+        printf("--top_topics has no effect with --low_memory; using all K topics\n");
+    }
+
+    if (prune_patience < 0 || prune_mass < 0 || prune_mass >= 1) {
+        printf("--prune_topics must be at least 0, and --prune_mass in [0, 1).  Exiting.\n");
+        exit(-1);
+    }
+
+    if (inner_iter < 1 || inner_iter > 255 || inner_tol < 0) {
+        printf("--inner_iter must be in [1, 255], and --inner_tol at least 0.  Exiting.\n");
+        exit(-1);
+    }
+
+    if (skip_tol < 0 || skip_refresh < 1) {
+        printf("--skip_tol must be at least 0, and --skip_refresh at least 1.  Exiting.\n");
+        exit(-1);
+    }
+    if (skip_tol > 0 && (svi || warm_start != "")) {
+        printf("--skip_tol is for batch VI from scratch, not --svi or --warm_start.  Exiting.\n");
+        exit(-1);
+    }
+
+    if (pack_docs && doc_store != "") {
+        printf("--pack_docs and --doc_store are alternatives.  Exiting.\n");
+        exit(-1);
+    }
+
+    if (hash_terms < 0) {
+        printf("--hash_terms must be at least 0.  Exiting.\n");
+        exit(-1);
+    }
+
     if (!incl_topics && !incl_entity && !incl_events) {
         printf("Model must include at least one of: topics, entity, or event factors.  Exiting.\n");
         exit(-1);
@@ -335,6 +676,30 @@ int main(int argc, char* argv[]) {
         exit(-1);
     }
 
+    if (warm_start != "") {
+        if (svi) {
+            printf("Warm start only supports batch VI.  Exiting.\n");
+            exit(-1);
+        }
+        batchvi = true;
+    }
+
+    if (workers > 1) {
+        if (svi) {
+            printf("Multiple workers only support batch VI.  Exiting.\n");
+            exit(-1);
+        }
+        if (warm_start != "") {
+            printf("Multiple workers cannot warm start.  Exiting.\n");
+            exit(-1);
+        }
+        if (shard_dates && shard_entities) {
+            printf("Workers can split the dates or the entities, not both.  Exiting.\n");
+            exit(-1);
+        }
+        batchvi = true;
+    }
+
     if (batchvi && final_pass) {
         printf("Batch VI doesn't allow for a \"final pass.\" Ignoring this argument.\n");
         final_pass = false;
@@ -388,6 +753,44 @@ int main(int argc, char* argv[]) {
     printf("\tchange in log likelihood for convergence: %f\n", converge_delta);
     printf("\tfinal pass after convergence:             %s\n", final_pass ? "yes" : "no");
     printf("\tonly keep latest save (overwrite old):    %s\n", overwrite ? "yes" : "no");
+    printf("\tparameter output format:                  %s\n", save_text ? "text" : "binary");
+    if (save_top > 0) {
+        printf("\ttop terms saved per row:                  %d\n", save_top);
+        printf("\tfull shapes saved with top terms:         %s\n", save_shapes ? "yes" : "no");
+    }
+    if (epsilon_min > 0)
+        printf("\tminimum saved epsilon:                    %e\n", epsilon_min);
+    printf("\tlow memory (recompute means and logs):    %s\n", low_memory ? "yes" : "no");
+    if (warm_start != "") {
+        printf("\twarm start from:                          %s\n", warm_start.c_str());
+        printf("\tfull refresh frequency:                   %d\n", refresh_freq);
+    }
+    if (doc_store != "")
+        printf("\tdocument store (cache MB):                %s (%d)\n", doc_store.c_str(), doc_cache);
+    printf("\tpacked documents:                         %s\n", pack_docs ? "yes" : "no");
+    printf("\tparameter arena:                          %s\n", arena.c_str());
+    printf("\tdocument order:                           %s\n", doc_order.c_str());
+    printf("\tterms numbered by count:                  %s\n", remap_terms ? "yes" : "no");
+    printf("\tminimum term count:                       %d\n", min_count);
+    printf("\tmaximum term document frequency:          %f\n", max_df);
+    printf("\tterm hash buckets:                        %d\n", hash_terms);
+    if (top_topics > 0)
+        printf("\ttop topics per token (tolerance):         %d (%f)\n", top_topics, top_tolerance);
+    if (prune_patience > 0)
+        printf("\tprune topics below mass (patience):       %f (%d)\n", prune_mass, prune_patience);
+    if (inner_iter > 1)
+        printf("\tpasses per document (tolerance):          %d (%f)\n", inner_iter, inner_tol);
+    if (skip_tol > 0)
+        printf("\tskip settled documents below (refresh):   %f (%d)\n", skip_tol, skip_refresh);
+    if (workers > 1) {
+        if (aggregator == "")
+            printf("\taggregator of workers (port):             %d (%d)\n", workers, port);
+        else
+            printf("\tworker (rank of workers):                 %d of %d (%s:%d)\n", rank, workers,
+                aggregator.c_str(), port);
+        printf("\tsplit by dates:                           %s\n", shard_dates ? "yes" : "no");
+        printf("\tsplit by entities:                        %s\n", shard_entities ? "yes" : "no");
+    }
 
     if (!batchvi) {
         printf("\nStochastic variational inference parameters\n");
@@ -407,12 +810,48 @@ int main(int argc, char* argv[]) {
         (bool) incl_topics, (bool) incl_entity, (bool) incl_events,
         event_dur, event_decay,
         seed, save_freq, eval_freq, conv_freq, max_iter, min_iter, converge_delta,
-        overwrite, final_pass, sample_size, svi_delay, svi_forget, k);
+        overwrite, save_text, save_top, epsilon_min, low_memory, final_pass, sample_size, svi_delay, svi_forget, k);
+    settings.set_warm_start(warm_start, refresh_freq);
+    settings.set_shard_dates(workers > 1 && shard_dates);
+    settings.set_shard_entities(workers > 1 && shard_entities);
+    settings.set_arena(arena);
+    settings.set_doc_order(doc_order, cache_stats);
+    settings.set_vocabulary(remap_terms, min_count, max_df);
+    settings.set_hashing(hash_terms);
+    settings.set_top_topics(top_topics, top_tolerance);
+    settings.set_topic_pruning(prune_patience, prune_mass);
+    settings.set_inner(inner_iter, inner_tol);
+    settings.set_skipping(skip_tol, skip_refresh);
+    settings.set_save_shapes(save_shapes);
+
+    // a warm start must continue the same model
+    if (warm_start != "") {
+        model_settings previous = settings;
+        previous.load_model(warm_start + "/model.txt");
+        if (previous.k != k || previous.incl_topics != (bool) incl_topics ||
+            previous.incl_entity != (bool) incl_entity ||
+            previous.incl_events != (bool) incl_events ||
+            previous.event_dur != event_dur || previous.event_decay != event_decay ||
+            previous.hash_terms != hash_terms) {
+            printf("the model in %s has different K, factors, events, or term hashing.  Exiting.\n",
+                warm_start.c_str());
+            exit(-1);
+        }
+    }
 
     // read in the data
     printf("********************************************************************************\n");
     printf("reading data\n");
     Data *dataset = new Data();
+    if (doc_store != "") {
+        if (!dir_exists(doc_store))
+            make_directory(doc_store);
+        dataset->use_store(doc_store, doc_cache);
+    }
+    if (pack_docs)
+        dataset->use_packing();
+    dataset->set_vocabulary(remap_terms, min_count, max_df);
+    dataset->set_hashing(hash_terms);
     printf("\treading training data\t\t...\t");
     dataset->read_training(settings.datadir + "/train.tsv", settings.datadir + "/meta.tsv");
     printf("done\n");
@@ -429,26 +868,76 @@ int main(int argc, char* argv[]) {
     dataset->read_test(settings.datadir + "/test.tsv");
     printf("done\n");
 
+    dataset->order_documents(doc_order);
+
     printf("\tsaving data stats\t\t...\t");
     dataset->save_summary(out + "/data_stats.txt");
+    if (hash_terms > 0)
+        dataset->save_term_buckets(out + "/term_buckets.tsv");
     printf("done\n");
 
+    // plan memory and work before allocating anything large; this picks
+    // batch VI or SVI unless one was requested
+    printf("********************************************************************************\n");
+    printf("planning\n");
+    Planner planner(&settings, dataset);
+    bool feasible = planner.choose(svi || batchvi);
+    planner.print(stdout);
+    planner.save(out + "/plan.txt");
+
     // save the run settings
     printf("Saving settings\n");
-    if (!svi && !batchvi) {
-        if (dataset->num_training() > 10000000) {
-            settings.set_stochastic_inference(true);
-            printf("using SVI (based on dataset size)\n");
-        } else {
-            printf("using batch VI (based on dataset size)\n");
-        }
-    }
     printf("doc count %d\n", dataset->doc_count());
     if (!settings.svi)
         settings.set_sample_size(dataset->doc_count());
     printf("sample size %d\n", settings.sample_size);
 
+    // the planner may have picked SVI or low memory instead
+    if (settings.skip_tol > 0 && (settings.svi || settings.low_memory)) {
+        printf("skipping settled documents needs batch VI with the full parameters; "
+            "recomputing every document\n");
+        settings.set_skipping(0, skip_refresh);
+    }
+
+    // every process needs the same plan; bail out before connecting
+    if (workers > 1 && feasible && settings.low_memory) {
+        printf("multiple workers need the full parameters, not --low_memory.  Exiting.\n");
+        exit(-1);
+    }
+    if (settings.shard_dates && dataset->date_count() < workers) {
+        printf("cannot split %d dates among %d workers.  Exiting.\n", dataset->date_count(), workers);
+        exit(-1);
+    }
+
+    // connect the processes; they all start from the aggregator's seed
+    Cluster cluster;
+    if (workers > 1 && !dry_run) {
+        printf("********************************************************************************\n");
+        bool connected = aggregator == "" ? cluster.serve(port, workers) :
+            cluster.join(aggregator, port, rank, workers);
+        if (!connected)
+            exit(-1);
+        settings.seed = cluster.broadcast(settings.seed);
+        printf("rank %d of %d connected; seed %d\n", cluster.get_rank(), cluster.get_size(),
+            (int) settings.seed);
+    }
+
     settings.save(out + "/settings.txt", msg);
+    settings.save_model(out + "/model.txt");
+
+    if (!feasible) {
+        printf("not enough memory for this configuration (see %s/plan.txt).  Exiting.\n", out.c_str());
+        exit(-1);
+    }
+    if (warm_start != "" && settings.low_memory) {
+        printf("warm start needs the full parameters, not --low_memory.  Exiting.\n");
+        exit(-1);
+    }
+    if (dry_run) {
+        printf("dry run: plan saved to %s/plan.txt; not training.\n", out.c_str());
+        delete dataset;
+        return 0;
+    }
 
     // TODO: make this/evaluate below optional (--test_only, --no_test)
     printf("********************************************************************************\n");
@@ -456,7 +945,14 @@ int main(int argc, char* argv[]) {
 
     // create model instance; learn!
     printf("\ncreating model instance\n");
-    Capsule *model = new Capsule(&settings, dataset);
+    Capsule *model = new Capsule(&settings, dataset,
+        cluster.get_size() > 1 ? &cluster : NULL);
+    if (warm_start != "" && !model->warm_start(warm_start)) {
+        printf("unable to load the final binary parameters in %s (fits saved with\n", warm_start.c_str());
+        printf("--save_text, or with --save_top but not --save_shapes, cannot be\n");
+        printf("continued).  Exiting.\n");
+        exit(-1);
+    }
     printf("commencing model inference\n");
     model->learn();
 
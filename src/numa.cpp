@@ -0,0 +1,166 @@
+#include "numa.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <thread>
+
+// set_mempolicy modes, as in <numaif.h>
+#define NUMA_MPOL_DEFAULT    0
+#define NUMA_MPOL_PREFERRED  1
+#define NUMA_MPOL_INTERLEAVE 3
+
+NumaLayout::NumaLayout() {
+    placement = "default";
+
+    string online = "/sys/devices/system/node/online";
+    FILE* file = fopen(online.c_str(), "r");
+    if (!file)
+        return;
+    char line[1024] = "";
+    if (fgets(line, sizeof(line), file))
+        nodes = parse_list(line);
+    fclose(file);
+
+    for (size_t i = 0; i < nodes.size(); i++) {
+        char path[128];
+        sprintf(path, "/sys/devices/system/node/node%d/cpulist", nodes[i]);
+        file = fopen(path, "r");
+        line[0] = '\0';
+        if (file) {
+            if (!fgets(line, sizeof(line), file))
+                line[0] = '\0';
+            fclose(file);
+        }
+        cpus.push_back(parse_list(line));
+    }
+}
+
+// "0-13,28-41" => 0, 1, ..., 13, 28, ..., 41
+vector<int> NumaLayout::parse_list(string list) {
+    vector<int> ids;
+    const char* p = list.c_str();
+    while (*p >= '0' && *p <= '9') {
+        char* end;
+        int first = strtol(p, &end, 10);
+        int last = first;
+        if (*end == '-')
+            last = strtol(end + 1, &end, 10);
+        for (int id = first; id <= last; id++)
+            ids.push_back(id);
+        p = *end == ',' ? end + 1 : end;
+    }
+    return ids;
+}
+
+bool NumaLayout::set_policy(int mode, const vector<int>& policy_nodes) {
+    vector<unsigned long> mask(1, 0);
+    const int bits = 8 * sizeof(unsigned long);
+    for (size_t i = 0; i < policy_nodes.size(); i++) {
+        size_t word = policy_nodes[i] / bits;
+        if (word >= mask.size())
+            mask.resize(word + 1, 0);
+        mask[word] |= 1UL << (policy_nodes[i] % bits);
+    }
+    return syscall(SYS_set_mempolicy, mode, mask.data(), mask.size() * bits + 1) == 0;
+}
+
+bool NumaLayout::pin(int node_index) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (size_t i = 0; i < cpus[node_index].size(); i++)
+        CPU_SET(cpus[node_index][i], &set);
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+bool NumaLayout::bind(int node_index) {
+    if (node_index < 0 || node_index >= node_count()) {
+        printf("no NUMA node %d (this host has %d)\n", node_index, node_count());
+        return false;
+    }
+    // preferred rather than strict, so a full node spills over instead of
+    // failing the allocation
+    if (!pin(node_index) ||
+        !set_policy(NUMA_MPOL_PREFERRED, vector<int>(1, nodes[node_index]))) {
+        printf("unable to bind to NUMA node %d\n", nodes[node_index]);
+        return false;
+    }
+    char name[64];
+    sprintf(name, "node %d", nodes[node_index]);
+    placement = name;
+    return true;
+}
+
+bool NumaLayout::interleave() {
+    if (!set_policy(NUMA_MPOL_INTERLEAVE, nodes)) {
+        printf("unable to interleave memory over the NUMA nodes\n");
+        return false;
+    }
+    placement = "interleaved";
+    return true;
+}
+
+// GB/s of one thread summing a buffer on memory_node from a CPU of cpu_node;
+// runs in its own thread so the caller's affinity and policy are untouched
+double NumaLayout::probe(int cpu_node, int memory_node, size_t bytes) {
+    double rate = 0;
+    std::thread worker([&]() {
+        if (!pin(cpu_node))
+            return;
+        set_policy(NUMA_MPOL_PREFERRED, vector<int>(1, nodes[memory_node]));
+        size_t n = bytes / sizeof(long);
+        vector<long> buffer(n, 1);   // first touched here, on memory_node
+        set_policy(NUMA_MPOL_DEFAULT, vector<int>());
+
+        volatile long sink = 0;
+        long total = 0;
+        struct timeval start, end;
+        gettimeofday(&start, NULL);
+        for (size_t i = 0; i < n; i++)
+            total += buffer[i];
+        gettimeofday(&end, NULL);
+        sink = total;
+        (void) sink;
+        double seconds = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+        if (seconds > 0)
+            rate = bytes / seconds / 1e9;
+    });
+    worker.join();
+    return rate;
+}
+
+void NumaLayout::measure(size_t mb) {
+    bandwidth.assign(node_count(), vector<double>(node_count(), 0));
+    for (int c = 0; c < node_count(); c++) {
+        for (int m = 0; m < node_count(); m++)
+            bandwidth[c][m] = probe(c, m, mb << 20);
+    }
+}
+
+void NumaLayout::print(FILE* file) {
+    fprintf(file, "NUMA nodes: %d; this process: %s\n", node_count(), placement.c_str());
+    for (int i = 0; i < node_count(); i++)
+        fprintf(file, "\tnode %d: %lu CPUs\n", nodes[i], (unsigned long) cpus[i].size());
+    if (bandwidth.empty())
+        return;
+
+    fprintf(file, "single-thread read bandwidth (GB/s), CPUs of node (rows) from memory of node (columns):\n\t");
+    for (int m = 0; m < node_count(); m++)
+        fprintf(file, "%10d", nodes[m]);
+    fprintf(file, "\n");
+    for (int c = 0; c < node_count(); c++) {
+        fprintf(file, "\t%d", nodes[c]);
+        for (int m = 0; m < node_count(); m++)
+            fprintf(file, "%10.2f", bandwidth[c][m]);
+        fprintf(file, "\n");
+    }
+}
+
+void NumaLayout::save(string filename) {
+    FILE* file = fopen(filename.c_str(), "w");
+    print(file);
+    fclose(file);
+}
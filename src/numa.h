@@ -0,0 +1,48 @@
+#ifndef NUMA_H
+#define NUMA_H
+
+#include <string>
+#include <vector>
+#include <stdio.h>
+
+using namespace std;
+
+// MB read per (cpu node, memory node) pair when measuring bandwidth
+#define NUMA_PROBE_MB 256
+
+// NUMA layout of the host and placement of this process, without libnuma:
+// the nodes and their CPUs are read from sysfs, and the memory policy is set
+// with the raw syscall.  Policies and CPU affinity are inherited by threads
+// started afterwards, so placement should happen before the data and the
+// parameters are allocated (they are first touched by the main thread).
+class NumaLayout {
+    private:
+        vector<int> nodes;              // online node ids
+        vector<vector<int> > cpus;      // CPUs of each node
+        vector<vector<double> > bandwidth; // GB/s, [cpu node][memory node]
+        string placement;
+
+        static vector<int> parse_list(string list);
+        static bool set_policy(int mode, const vector<int>& policy_nodes);
+        bool pin(int node_index);
+        double probe(int cpu_node, int memory_node, size_t bytes);
+
+    public:
+        NumaLayout();
+
+        int node_count() const { return nodes.size(); }
+
+        // run on (and allocate from) one node: node_index into the online nodes
+        bool bind(int node_index);
+        // spread pages round-robin over all nodes, for read-mostly parameters
+        // shared by threads on every node
+        bool interleave();
+
+        // read bandwidth from every node's CPUs to every node's memory
+        void measure(size_t mb);
+
+        void print(FILE* file);
+        void save(string filename);
+};
+
+#endif
@@ -0,0 +1,97 @@
+#include "packeddocs.h"
+
+#include <algorithm>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+PackedDocs::PackedDocs() {
+    offset.push_back(0);
+}
+
+void PackedDocs::put(uint64_t value) {
+    while (value >= 0x80) {
+        bytes.push_back((uint8_t) (value | 0x80));
+        value >>= 7;
+    }
+    bytes.push_back((uint8_t) value);
+}
+
+void PackedDocs::add(vector<pair<int, int> >& entries) {
+    sort(entries.begin(), entries.end());
+    int64_t previous = 0;
+    for (size_t i = 0; i < entries.size(); i++) {
+        uint64_t gap = entries[i].first - previous;
+        int64_t count = entries[i].second;
+        previous = entries[i].first;
+        put(gap << 1 | (count != 1));
+        if (count != 1)
+            put((uint64_t) ((count << 1) ^ (count >> 63)));
+    }
+    length.push_back(entries.size());
+    offset.push_back(bytes.size());
+}
+
+void PackedDocs::finish() {
+    bytes.shrink_to_fit();
+    offset.shrink_to_fit();
+    length.shrink_to_fit();
+}
+
+// one varint at p, which is advanced past it
+static inline uint64_t get(const uint8_t*& p) {
+    uint64_t value = 0;
+    int shift = 0;
+    while (*p & 0x80) {
+        value |= (uint64_t) (*p++ & 0x7f) << shift;
+        shift += 7;
+    }
+    return value | (uint64_t) *p++ << shift;
+}
+
+void PackedDocs::decode(int doc, vector<int>& terms, vector<int>& counts) const {
+    uint32_t n = term_count(doc);
+    terms.resize(n);
+    counts.resize(n);
+    if (n == 0)
+        return;
+
+    const uint8_t* p = bytes.data() + offset[doc];
+    const uint8_t* end = bytes.data() + offset[doc+1];
+    int term = 0;
+    uint32_t i = 0;
+    while (i < n) {
+#ifdef __SSE2__
+        // no continuation bits (bit 7) and no count flags (bit 0, shifted
+        // up to bit 7) in the next sixteen bytes: sixteen gaps, all count 1
+        if (end - p >= 16) {
+            __m128i block = _mm_loadu_si128((const __m128i*) p);
+            if (_mm_movemask_epi8(_mm_or_si128(block, _mm_slli_epi16(block, 7))) == 0) {
+                for (int j = 0; j < 16; j++) {
+                    term += p[j] >> 1;
+                    terms[i + j] = term;
+                    counts[i + j] = 1;
+                }
+                p += 16;
+                i += 16;
+                continue;
+            }
+        }
+#endif
+        uint64_t value = get(p);
+        term += (int) (value >> 1);
+        terms[i] = term;
+        if (value & 1) {
+            uint64_t zigzag = get(p);
+            counts[i] = (int) ((zigzag >> 1) ^ -(int64_t) (zigzag & 1));
+        } else {
+            counts[i] = 1;
+        }
+        i++;
+    }
+}
+
+size_t PackedDocs::bytes_used() const {
+    return bytes.size() + offset.size() * sizeof(uint64_t) + length.size() * sizeof(uint32_t);
+}
@@ -0,0 +1,44 @@
+#ifndef PACKEDDOCS_H
+#define PACKEDDOCS_H
+
+#include <vector>
+#include <stdint.h>
+#include <stddef.h>
+
+using namespace std;
+
+// Compressed in-memory training documents: each document's terms in
+// ascending order, one varint per doc-term count holding the gap from the
+// previous term and a flag for a count other than 1, which then follows as
+// a (zigzag) varint of its own.  Most counts are 1 and most gaps of sorted,
+// frequency-ordered terms are small, so a count usually takes one byte
+// instead of the 20+ of the triples and per-document vectors.
+//
+// Runs of one-byte entries (gap < 64, count 1) are decoded sixteen at a time
+// where SSE2 is available.
+class PackedDocs {
+    private:
+        vector<uint8_t> bytes;
+        vector<uint64_t> offset;    // of each document, and the end
+        vector<uint32_t> length;    // number of entries of each document
+
+        void put(uint64_t value);
+
+    public:
+        PackedDocs();
+
+        // documents are added in order of id, from 0; entries are
+        // (term, count) pairs, sorted here
+        void add(vector<pair<int, int> >& entries);
+        // after the last document: releases the spare capacity
+        void finish();
+
+        int doc_count() const { return length.size(); }
+        int term_count(int doc) const { return doc < doc_count() ? length[doc] : 0; }
+
+        void decode(int doc, vector<int>& terms, vector<int>& counts) const;
+
+        size_t bytes_used() const;
+};
+
+#endif
@@ -0,0 +1,47 @@
+#include "perf.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+PerfCounter::PerfCounter() {
+    fd = -1;
+}
+
+PerfCounter::~PerfCounter() {
+    if (fd >= 0)
+        close(fd);
+}
+
+bool PerfCounter::open(uint32_t type, uint64_t config) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    // this thread, any CPU
+    fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    return fd >= 0;
+}
+
+void PerfCounter::start() {
+    if (fd < 0)
+        return;
+    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+}
+
+long long PerfCounter::stop() {
+    if (fd < 0)
+        return -1;
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    long long count;
+    if (read(fd, &count, sizeof(count)) != sizeof(count))
+        return -1;
+    return count;
+}
@@ -0,0 +1,27 @@
+#ifndef PERF_H
+#define PERF_H
+
+#include <stdint.h>
+
+// One hardware event counter of this thread (perf_event_open), for measuring
+// a stretch of code: start, then stop to read what was counted in between.
+// When the kernel or the CPU does not offer the event (containers, VMs,
+// perf_event_paranoid), open fails and the counter reads as -1.
+class PerfCounter {
+    private:
+        int fd;
+
+    public:
+        PerfCounter();
+        ~PerfCounter();
+
+        // type and config as in perf_event_attr, e.g. PERF_TYPE_HARDWARE and
+        // PERF_COUNT_HW_CACHE_MISSES
+        bool open(uint32_t type, uint64_t config);
+        bool ok() const { return fd >= 0; }
+
+        void start();
+        long long stop();
+};
+
+#endif
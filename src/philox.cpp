@@ -0,0 +1,50 @@
+#include "philox.h"
+
+#define PHILOX_M0 0xD2511F53u
+#define PHILOX_M1 0xCD9E8D57u
+#define PHILOX_W0 0x9E3779B9u
+#define PHILOX_W1 0xBB67AE85u
+#define PHILOX_ROUNDS 10
+
+Philox::Philox(uint64_t seed) {
+    key[0] = (uint32_t) seed;
+    key[1] = (uint32_t) (seed >> 32);
+}
+
+void Philox::block(uint64_t stream, uint64_t index, uint32_t out[4]) const {
+    uint32_t c0 = (uint32_t) index, c1 = (uint32_t) (index >> 32);
+    uint32_t c2 = (uint32_t) stream, c3 = (uint32_t) (stream >> 32);
+    uint32_t k0 = key[0], k1 = key[1];
+    for (int round = 0; round < PHILOX_ROUNDS; round++) {
+        uint64_t p0 = (uint64_t) PHILOX_M0 * c0;
+        uint64_t p1 = (uint64_t) PHILOX_M1 * c2;
+        uint32_t n0 = (uint32_t) (p1 >> 32) ^ c1 ^ k0;
+        uint32_t n2 = (uint32_t) (p0 >> 32) ^ c3 ^ k1;
+        c1 = (uint32_t) p1;
+        c3 = (uint32_t) p0;
+        c0 = n0;
+        c2 = n2;
+        k0 += PHILOX_W0;
+        k1 += PHILOX_W1;
+    }
+    out[0] = c0;
+    out[1] = c1;
+    out[2] = c2;
+    out[3] = c3;
+}
+
+uint64_t Philox::bits(uint64_t stream, uint64_t index) const {
+    uint32_t out[4];
+    block(stream, index, out);
+    return (uint64_t) out[0] << 32 | out[1];
+}
+
+double Philox::uniform_pos(uint64_t stream, uint64_t index) const {
+    // 53 bits, centered in their interval so neither 0 nor 1 comes up
+    return ((bits(stream, index) >> 11) + 0.5) * (1.0 / 9007199254740992.0);
+}
+
+uint64_t Philox::uniform_int(uint64_t stream, uint64_t index, uint64_t n) const {
+    // the high word of bits * n: no division, and a bias of at most n / 2^64
+    return (uint64_t) (((unsigned __int128) bits(stream, index) * n) >> 64);
+}
@@ -0,0 +1,42 @@
+#ifndef PHILOX_H
+#define PHILOX_H
+
+#include <stdint.h>
+
+// Counter-based random numbers (Philox4x32-10, Salmon et al. 2011): each
+// draw is a pure function of the key (the seed), a stream and an index, so
+// any thread can make any draw without sharing state, and a run's numbers
+// do not depend on how the draws are split among threads.
+//
+// A stream names one use of randomness: its purpose, the iteration and the
+// worker (cluster rank).  The index numbers the draws within a stream, e.g.
+// the cell of a parameter being initialized.
+enum {
+    RNG_BETA = 1,
+    RNG_ETA,
+    RNG_MINIBATCH
+};
+
+class Philox {
+    private:
+        uint32_t key[2];
+
+    public:
+        Philox(uint64_t seed = 0);
+
+        static uint64_t stream(uint32_t purpose, uint32_t iteration, uint32_t worker = 0) {
+            return (uint64_t) purpose << 56 | (uint64_t) (worker & 0xffffff) << 32 | iteration;
+        }
+
+        // the four words of one block; counter = (index, stream)
+        void block(uint64_t stream, uint64_t index, uint32_t out[4]) const;
+
+        // 64 random bits
+        uint64_t bits(uint64_t stream, uint64_t index) const;
+        // uniform on (0, 1), like gsl_rng_uniform_pos
+        double uniform_pos(uint64_t stream, uint64_t index) const;
+        // uniform on 0 .. n-1, like gsl_rng_uniform_int
+        uint64_t uniform_int(uint64_t stream, uint64_t index, uint64_t n) const;
+};
+
+#endif
@@ -0,0 +1,374 @@
+#include "planner.h"
+#include <unistd.h>
+#include <omp.h>
+
+static double mb(size_t bytes) {
+    return bytes / 1048576.0;
+}
+
+// MemAvailable from /proc/meminfo, else free physical pages; 0 if unknown
+static size_t available_memory() {
+    FILE* file = fopen("/proc/meminfo", "r");
+    if (file) {
+        char line[256];
+        unsigned long kb;
+        while (fgets(line, sizeof(line), file)) {
+            if (sscanf(line, "MemAvailable: %lu kB", &kb) == 1) {
+                fclose(file);
+                return (size_t) kb * 1024;
+            }
+        }
+        fclose(file);
+    }
+#ifdef _SC_AVPHYS_PAGES
+    long pages = sysconf(_SC_AVPHYS_PAGES);
+    long page_size = sysconf(_SC_PAGESIZE);
+    if (pages > 0 && page_size > 0)
+        return (size_t) pages * page_size;
+#endif
+    return 0;
+}
+
+Planner::Planner(model_settings* model_set, Data* dataset) {
+    settings = model_set;
+    data = dataset;
+
+    available = available_memory();
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    cores = online > 0 ? min((int) online, omp_get_max_threads()) : omp_get_max_threads();
+
+    count_cells();
+}
+
+// the same cells build_entity_descriptions, build_event_descriptions and
+// initialize_parameters will allocate, counted without building them
+void Planner::count_cells() {
+    eta_nnz = 0;
+    pi_nnz = 0;
+    pi_build = 0;
+    epsilon_nnz = 0;
+
+    vector<vector<int> > by_entity(data->entity_count());
+    vector<vector<int> > by_date(data->date_count());
+    for (int doc = 0; doc < data->train_doc_count(); doc++) {
+        by_entity[data->get_entity(doc)].push_back(doc);
+        by_date[data->get_date(doc)].push_back(doc);
+    }
+
+    // mark[term] holds the last row the term was counted in
+    vector<int> mark(data->term_count(), -1);
+    vector<int> terms, counts;
+
+    if (settings->incl_entity) {
+        for (int entity = 0; entity < data->entity_count(); entity++) {
+            for (size_t i = 0; i < by_entity[entity].size(); i++) {
+                data->get_doc(by_entity[entity][i], terms, counts);
+                for (size_t j = 0; j < terms.size(); j++) {
+                    int term = terms[j];
+                    if (mark[term] != entity) {
+                        mark[term] = entity;
+                        eta_nnz++;
+                    }
+                }
+            }
+        }
+    }
+
+    if (settings->incl_events) {
+        // distinct terms per date, as listed before the window union
+        vector<uword> date_terms(data->date_count(), 0);
+        mark.assign(data->term_count(), -1);
+        for (int date = 0; date < data->date_count(); date++) {
+            for (size_t i = 0; i < by_date[date].size(); i++) {
+                data->get_doc(by_date[date][i], terms, counts);
+                for (size_t j = 0; j < terms.size(); j++) {
+                    int term = terms[j];
+                    if (mark[term] != date) {
+                        mark[term] = date;
+                        date_terms[date]++;
+                    }
+                }
+            }
+        }
+
+        mark.assign(data->term_count(), -1);
+        for (int d = 0; d < data->date_count(); d++) {
+            for (int date = d; date < min(d + settings->event_dur, data->date_count()); date++) {
+                pi_build += date_terms[date];
+                for (size_t i = 0; i < by_date[date].size(); i++) {
+                    data->get_doc(by_date[date][i], terms, counts);
+                    for (size_t j = 0; j < terms.size(); j++) {
+                        int term = terms[j];
+                        if (mark[term] != d) {
+                            mark[term] = d;
+                            pi_nnz++;
+                        }
+                    }
+                }
+            }
+        }
+
+        for (int doc = 0; doc < data->doc_count(); doc++)
+            epsilon_nnz += min(settings->event_dur, data->get_date(doc) + 1);
+    }
+}
+
+size_t Planner::sparse_bytes(uword rows, uword cols, uword nnz) {
+    // Armadillo CSC: values, row indices, and column pointers
+    return nnz * (sizeof(float) + sizeof(uword)) + (cols + 2) * sizeof(uword);
+}
+
+vector<plan_block> Planner::data_blocks() {
+    size_t n = data->num_training();
+    size_t n_val = data->num_validation();
+    size_t n_test = data->num_test();
+
+    vector<plan_block> blocks;
+    DocStore* store = data->get_store();
+    if (store) {
+        blocks.push_back({"document store index", store->index_bytes()});
+        blocks.push_back({"document store cache", store->cache_capacity()});
+        blocks.push_back({"doc-term set (validation)", n_val * PLAN_NODE_BYTES});
+    } else if (data->get_packed()) {
+        blocks.push_back({"packed documents", data->get_packed()->bytes_used()});
+        blocks.push_back({"doc-term set (validation)", n_val * PLAN_NODE_BYTES});
+    } else {
+        blocks.push_back({"training counts", 3 * n * sizeof(int)});
+        blocks.push_back({"per-document term lists", 2 * n * sizeof(int) +
+            2 * (size_t) data->train_doc_count() * sizeof(vector<int>)});
+        blocks.push_back({"doc-term set (train + validation)", (n + n_val) * PLAN_NODE_BYTES});
+    }
+    blocks.push_back({"validation and test counts", 3 * (n_val + n_test) * sizeof(int)});
+    blocks.push_back({"metadata and vocabulary maps",
+        (2 * (size_t) data->doc_count() + data->term_count()) * PLAN_NODE_BYTES});
+    return blocks;
+}
+
+vector<plan_block> Planner::param_blocks(bool low_mem) {
+    size_t k = settings->k;
+    size_t docs = data->doc_count();
+    size_t terms = data->term_count();
+    size_t entities = data->entity_count();
+    size_t dates = data->date_count();
+
+    vector<plan_block> blocks;
+    if (settings->incl_topics) {
+        blocks.push_back({"beta (K x terms)", (low_mem ? 2 : 4) * k * terms * sizeof(float)});
+        blocks.push_back({"phi (K x entities)", (low_mem ? 4 : 6) * k * entities * sizeof(float)});
+        blocks.push_back({"theta (K x docs)", (low_mem ? 2 : 4) * k * docs * sizeof(float)});
+    }
+    if (settings->incl_events) {
+        blocks.push_back({"pi (sparse dates x terms)",
+            SparseDirichlet::estimate_bytes(dates, pi_nnz, low_mem)});
+        blocks.push_back({"psi (dates)", 6 * dates * sizeof(float)});
+        blocks.push_back({"epsilon (sparse dates x docs)",
+            (low_mem ? 3 : 5) * sparse_bytes(dates, docs, epsilon_nnz)});
+        blocks.push_back({"decay (dates x dates)", 2 * dates * dates * sizeof(float)});
+    }
+    if (settings->incl_entity) {
+        blocks.push_back({"eta (sparse entities x terms)",
+            SparseDirichlet::estimate_bytes(entities, eta_nnz, low_mem)});
+        blocks.push_back({"xi (entities)", 6 * entities * sizeof(float)});
+        blocks.push_back({"zeta (docs)", (low_mem ? 2 : 4) * docs * sizeof(float)});
+    }
+    if (settings->skip_tol > 0 && !low_mem) {
+        size_t frozen = docs;
+        if (settings->incl_topics)
+            frozen += k * terms * sizeof(float);
+        if (settings->incl_events)
+            frozen += pi_nnz * sizeof(float);
+        if (settings->incl_entity)
+            frozen += eta_nnz * sizeof(float);
+        blocks.push_back({"frozen document contributions", frozen});
+    }
+    return blocks;
+}
+
+// memory held only for a while; the largest one counts toward the peak
+vector<plan_block> Planner::transient_blocks() {
+    size_t k = settings->k;
+    size_t top = settings->save_top;
+    bool shapes = top == 0 || settings->save_shapes;
+    // a single-process save holds one copy of a sparse description at a
+    // time in top-N mode (its means, then its shapes), and both otherwise
+    size_t copies = top > 0 ? 1 : 2;
+
+    // save_parameters copies every saved parameter for the background writer
+    size_t snapshot = 0;
+    if (settings->incl_topics) {
+        snapshot += k * (data->entity_count() + data->doc_count()) * sizeof(float);
+        // the means (in top-N mode, the copy they are selected from) and
+        // their top entries, and the shapes or their row sums
+        snapshot += k * data->term_count() * sizeof(float);
+        if (top > 0)
+            snapshot += k * (sizeof(float) + top * sizeof(top_entry));
+        snapshot += shapes ? k * data->term_count() * sizeof(float) : k * sizeof(float);
+    }
+    if (settings->incl_entity) {
+        size_t entities = data->entity_count();
+        snapshot += data->doc_count() * sizeof(float);
+        snapshot += copies * (eta_nnz * (sizeof(int) + sizeof(float)) +
+            entities * (sizeof(uword) + sizeof(float)));
+        if (top > 0)
+            snapshot += entities * (sizeof(float) + top * sizeof(top_entry));
+        if (!shapes)
+            snapshot += entities * sizeof(float);
+    }
+    if (settings->incl_events) {
+        size_t dates = data->date_count();
+        snapshot += epsilon_nnz * sizeof(event_record);
+        snapshot += copies * (pi_nnz * (sizeof(int) + sizeof(float)) +
+            dates * (sizeof(uword) + sizeof(float)));
+        if (top > 0)
+            snapshot += dates * (sizeof(float) + top * sizeof(top_entry));
+        if (!shapes)
+            snapshot += dates * sizeof(float);
+    }
+
+    vector<plan_block> blocks;
+    blocks.push_back({"parameter snapshot for saving", snapshot});
+    if (settings->incl_entity)
+        blocks.push_back({"eta structure build", data->num_training() * sizeof(int) +
+            (size_t) data->entity_count() * sizeof(vector<int>)});
+    if (settings->incl_events)
+        blocks.push_back({"pi structure build", pi_build * sizeof(int) +
+            2 * (size_t) data->date_count() * sizeof(vector<int>)});
+    return blocks;
+}
+
+static size_t total(const vector<plan_block>& blocks) {
+    size_t bytes = 0;
+    for (size_t i = 0; i < blocks.size(); i++)
+        bytes += blocks[i].bytes;
+    return bytes;
+}
+
+size_t Planner::peak_bytes(bool low_mem) {
+    vector<plan_block> transient = transient_blocks();
+    size_t largest = 0;
+    for (size_t i = 0; i < transient.size(); i++)
+        largest = max(largest, transient[i].bytes);
+    return total(data_blocks()) + total(param_blocks(low_mem)) + largest;
+}
+
+double Planner::token_work(bool svi) {
+    double k = settings->incl_topics ? settings->k : 0;
+    double dur = settings->incl_events ? settings->event_dur : 0;
+    double ent = settings->incl_entity ? 1 : 0;
+
+    // update_shape touches every topic, event window date, and the entity
+    double cell = 1 + k + dur + ent;
+    double docs = svi ? min(settings->sample_size, data->train_doc_count()) : data->doc_count();
+    double cells = svi ? data->num_training() * docs / data->train_doc_count() :
+        data->num_training();
+    return cells * cell;
+}
+
+double Planner::iteration_work(bool svi) {
+    double k = settings->incl_topics ? settings->k : 0;
+    double dur = settings->incl_events ? settings->event_dur : 0;
+    double docs = svi ? min(settings->sample_size, data->train_doc_count()) : data->doc_count();
+
+    double work = token_work(svi) + docs * (3 * k + 2 * dur + 2);
+
+    // global updates: beta and eta are renormalized in full every iteration;
+    // phi, xi, psi and pi only for the entities and dates that were visited
+    double entities = svi ? min(docs, (double) data->entity_count()) : data->entity_count();
+    double dates = svi ? min(docs * max(dur, 1.0), (double) data->date_count()) : data->date_count();
+    work += k * data->term_count() + k * entities;
+    if (settings->incl_entity)
+        work += eta_nnz + 2 * entities;
+    if (settings->incl_events)
+        work += pi_nnz * dates / data->date_count() + 2 * dates;
+    return work;
+}
+
+bool Planner::choose(bool inference_fixed) {
+    decision = "";
+    if (!inference_fixed) {
+        // the threshold counts token work only, as the old rule did
+        bool use_svi = token_work(false) > PLAN_SVI_CELL_UPDATES;
+        settings->set_stochastic_inference(use_svi);
+        decision += use_svi ? "using SVI (a batch iteration exceeds the work budget)\n" :
+            "using batch VI (a batch iteration fits the work budget)\n";
+    }
+
+    if (cores < 2)
+        decision += "one core: saves will compete with inference for the CPU\n";
+
+    if (available == 0) {
+        decision += "available memory unknown; not checked\n";
+        return true;
+    }
+
+    size_t budget = available * PLAN_MEMORY_FRACTION;
+    if (peak_bytes(settings->low_memory) <= budget)
+        return true;
+
+    if (!settings->low_memory && peak_bytes(true) <= budget) {
+        settings->set_low_memory(true);
+        decision += "using low-memory mode (full parameters do not fit)\n";
+        return true;
+    }
+
+    char line[256];
+    sprintf(line, "refusing to run: needs %.1f MB at peak, %.1f MB available\n",
+        mb(peak_bytes(true)), mb(available));
+    decision += line;
+    return false;
+}
+
+void Planner::print(FILE* file) {
+    vector<plan_block> blocks;
+
+    fprintf(file, "memory plan (MB):\n");
+    fprintf(file, "\tdata\n");
+    blocks = data_blocks();
+    for (size_t i = 0; i < blocks.size(); i++)
+        fprintf(file, "\t\t%-40s %12.1f\n", blocks[i].name.c_str(), mb(blocks[i].bytes));
+
+    fprintf(file, "\tparameters                                       full   low memory\n");
+    blocks = param_blocks(false);
+    vector<plan_block> low = param_blocks(true);
+    for (size_t i = 0; i < blocks.size(); i++)
+        fprintf(file, "\t\t%-40s %12.1f %12.1f\n", blocks[i].name.c_str(),
+            mb(blocks[i].bytes), mb(low[i].bytes));
+
+    fprintf(file, "\ttransient (the largest counts toward the peak)\n");
+    blocks = transient_blocks();
+    for (size_t i = 0; i < blocks.size(); i++)
+        fprintf(file, "\t\t%-40s %12.1f\n", blocks[i].name.c_str(), mb(blocks[i].bytes));
+
+    fprintf(file, "\t%-48s %12.1f %12.1f\n", "peak", mb(peak_bytes(false)), mb(peak_bytes(true)));
+    if (available > 0)
+        fprintf(file, "\t%-48s %12.1f\n", "available", mb(available));
+    else
+        fprintf(file, "\tavailable memory unknown\n");
+
+    fprintf(file, "\nsparse cells:\n");
+    if (settings->incl_entity)
+        fprintf(file, "\teta:     %lu\n", (unsigned long) eta_nnz);
+    if (settings->incl_events) {
+        fprintf(file, "\tpi:      %lu\n", (unsigned long) pi_nnz);
+        fprintf(file, "\tepsilon: %lu\n", (unsigned long) epsilon_nnz);
+    }
+
+    double batch = iteration_work(false);
+    double svi = iteration_work(true);
+    fprintf(file, "\nwork per iteration (cell updates; time at a rough %.0fM/s, serial):\n",
+        PLAN_UPDATES_PER_SEC / 1e6);
+    fprintf(file, "\tbatch VI:           %10.3g   ~%.1fs\n", batch, batch / PLAN_UPDATES_PER_SEC);
+    fprintf(file, "\tSVI (sample %5d): %10.3g   ~%.1fs, %.1f iterations per pass\n",
+        settings->sample_size, svi, svi / PLAN_UPDATES_PER_SEC,
+        (double) data->train_doc_count() / settings->sample_size);
+    fprintf(file, "\tcores:              %d (inference is serial; saving runs alongside)\n", cores);
+
+    if (decision != "")
+        fprintf(file, "\n%s", decision.c_str());
+}
+
+void Planner::save(string filename) {
+    FILE* file = fopen(filename.c_str(), "w");
+    print(file);
+    fclose(file);
+}
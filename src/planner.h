@@ -0,0 +1,76 @@
+#ifndef PLANNER_H
+#define PLANNER_H
+
+#include <string>
+#include <vector>
+#include <stdio.h>
+
+#include "capsule.h"
+
+using namespace std;
+
+// batch VI is used unless the token work of one pass over the data (see
+// Planner::token_work) is more than this many cell updates: 10M doc-term
+// counts at the default K = 100 and event_dur = 7 (the old num_training > 10M
+// rule)
+#define PLAN_SVI_CELL_UPDATES 1.09e9
+
+// rough serial throughput of the inner loop, for the time estimates only
+#define PLAN_UPDATES_PER_SEC 2e8
+
+// share of the available memory a run may plan to use
+#define PLAN_MEMORY_FRACTION 0.9
+
+// approximate heap cost of one std::set / std::map node
+#define PLAN_NODE_BYTES 48
+
+struct plan_block {
+    string name;
+    size_t bytes;
+};
+
+// Pre-flight estimate of a run's memory and per-iteration work, from the data
+// dimensions and the model settings, made before any parameter is allocated.
+// The planner picks batch VI or SVI (unless one was requested), switches to
+// the low-memory mode when the full parameters do not fit, and refuses runs
+// that do not fit either way.
+class Planner {
+    private:
+        model_settings* settings;
+        Data* data;
+
+        // sizes of the sparse parameter blocks
+        uword eta_nnz;
+        uword pi_nnz;
+        uword pi_build;     // pi cells before duplicates are removed
+        uword epsilon_nnz;
+
+        size_t available;   // bytes of RAM available (0: unknown)
+        int cores;
+
+        string decision;
+
+        void count_cells();
+        static size_t sparse_bytes(uword rows, uword cols, uword nnz);
+
+    public:
+        Planner(model_settings* model_set, Data* dataset);
+
+        vector<plan_block> data_blocks();
+        vector<plan_block> param_blocks(bool low_mem);
+        vector<plan_block> transient_blocks();
+        size_t peak_bytes(bool low_mem);
+
+        // cell updates in one iteration: token work alone (update_shape over
+        // every doc-term count), and with the per-document and global updates
+        double token_work(bool svi);
+        double iteration_work(bool svi);
+
+        // returns false if the run should be refused
+        bool choose(bool inference_fixed);
+
+        void print(FILE* file);
+        void save(string filename);
+};
+
+#endif
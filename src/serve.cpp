@@ -0,0 +1,411 @@
+#include "serve.h"
+#include <algorithm>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <gsl/gsl_rng.h>
+
+static bool write_all(int fd, const string& data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        sent += n;
+    }
+    return true;
+}
+
+// reads one newline-terminated line, buffering whatever follows it
+static bool read_line(int fd, string& buffer, string& line) {
+    char chunk[4096];
+    while (true) {
+        size_t end = buffer.find('\n');
+        if (end != string::npos) {
+            line = buffer.substr(0, end);
+            buffer.erase(0, end + 1);
+            return true;
+        }
+        ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        buffer.append(chunk, n);
+    }
+}
+
+static double percentile_of(vector<double> values, double p) {
+    if (values.empty())
+        return 0;
+    size_t rank = min(values.size() - 1, (size_t) (p * values.size()));
+    nth_element(values.begin(), values.begin() + rank, values.end());
+    return values[rank];
+}
+
+static void appendf(string& out, const char* format, ...) {
+    char text[128];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+    out += text;
+}
+
+ScoreServer::ScoreServer(FoldIn* fitted, model_settings* model_set, string path,
+                         int batch, int wait_us, int iterations, double delta) {
+    model = fitted;
+    settings = model_set;
+    socket_path = path;
+    listen_fd = -1;
+    max_batch = max(1, batch);
+    max_wait_us = max(0, wait_us);
+    max_iter = iterations;
+    converge = delta;
+    stopping = false;
+    served = 0;
+}
+
+ScoreServer::~ScoreServer() {
+    stop();
+}
+
+bool ScoreServer::start() {
+    struct sockaddr_un addr;
+    if (socket_path.size() >= sizeof(addr.sun_path)) {
+        printf("socket path %s is too long\n", socket_path.c_str());
+        return false;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path.c_str());
+
+    unlink(socket_path.c_str());
+    listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr*) &addr, sizeof(addr)) != 0 ||
+        listen(listen_fd, 64) != 0) {
+        printf("unable to listen on %s: %s\n", socket_path.c_str(), strerror(errno));
+        if (listen_fd >= 0)
+            close(listen_fd);
+        listen_fd = -1;
+        return false;
+    }
+
+    batcher = thread(&ScoreServer::batch_loop, this);
+    acceptor = thread(&ScoreServer::accept_loop, this);
+    return true;
+}
+
+void ScoreServer::stop() {
+    {
+        unique_lock<mutex> guard(lock);
+        if (stopping || listen_fd < 0)
+            return;
+        stopping = true;
+        // wake up connection threads blocked on their sockets
+        for (size_t i = 0; i < connection_fds.size(); i++)
+            shutdown(connection_fds[i], SHUT_RDWR);
+    }
+    queued.notify_all();
+    answered.notify_all();
+
+    shutdown(listen_fd, SHUT_RDWR);
+    acceptor.join();
+    close(listen_fd);
+    unlink(socket_path.c_str());
+
+    // the connection threads are detached; wait for the last to finish
+    {
+        unique_lock<mutex> guard(lock);
+        closed.wait(guard, [this] { return connection_fds.empty(); });
+    }
+    batcher.join();
+}
+
+void ScoreServer::accept_loop() {
+    while (true) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+
+        unique_lock<mutex> guard(lock);
+        if (stopping) {
+            close(fd);
+            return;
+        }
+        // detached, so a long-running daemon does not keep a finished
+        // thread per client; stop waits for connection_fds to empty
+        connection_fds.push_back(fd);
+        thread(&ScoreServer::serve_connection, this, fd).detach();
+    }
+}
+
+void ScoreServer::serve_connection(int fd) {
+    string buffer, line;
+    while (read_line(fd, buffer, line)) {
+        if (line == "stats") {
+            string reply;
+            appendf(reply, "stats\t%ld\tp50 %.3f\tp99 %.3f\n", request_count(),
+                percentile(0.5), percentile(0.99));
+            if (!write_all(fd, reply))
+                break;
+            continue;
+        }
+
+        score_request request;
+        string error;
+        if (!parse(line.c_str(), request.doc, error)) {
+            if (!write_all(fd, "error " + error + "\n"))
+                break;
+            continue;
+        }
+        request.arrived = serve_clock::now();
+        request.done = false;
+
+        {
+            unique_lock<mutex> guard(lock);
+            if (stopping)
+                break;
+            queue.push_back(&request);
+            queued.notify_all();
+            answered.wait(guard, [this, &request] { return request.done || stopping; });
+            if (!request.done) {
+                // shutting down: withdraw the request, or wait for the batcher
+                // to finish with it if it already holds it
+                deque<score_request*>::iterator it = find(queue.begin(), queue.end(), &request);
+                if (it != queue.end())
+                    queue.erase(it);
+                else
+                    answered.wait(guard, [&request] { return request.done; });
+                break;
+            }
+        }
+
+        if (!write_all(fd, request.response))
+            break;
+    }
+
+    unique_lock<mutex> guard(lock);
+    connection_fds.erase(find(connection_fds.begin(), connection_fds.end(), fd));
+    close(fd);
+    closed.notify_all();
+}
+
+void ScoreServer::batch_loop() {
+    while (true) {
+        vector<score_request*> batch;
+        {
+            unique_lock<mutex> guard(lock);
+            queued.wait(guard, [this] { return stopping || !queue.empty(); });
+            if (stopping && queue.empty())
+                return;
+
+            // give the batch a moment to fill
+            serve_clock::time_point deadline = queue.front()->arrived +
+                chrono::microseconds(max_wait_us);
+            queued.wait_until(guard, deadline,
+                [this] { return stopping || (int) queue.size() >= max_batch; });
+
+            while (!queue.empty() && (int) batch.size() < max_batch) {
+                batch.push_back(queue.front());
+                queue.pop_front();
+            }
+        }
+
+        vector<const foldin_doc*> docs(batch.size());
+        for (size_t i = 0; i < batch.size(); i++)
+            docs[i] = &batch[i]->doc;
+        vector<foldin_result> results;
+        model->infer(docs, results, max_iter, converge);
+        for (size_t i = 0; i < batch.size(); i++)
+            batch[i]->response = format(batch[i]->doc, results[i]);
+
+        {
+            unique_lock<mutex> guard(lock);
+            serve_clock::time_point now = serve_clock::now();
+            for (size_t i = 0; i < batch.size(); i++) {
+                double ms = chrono::duration<double, milli>(now - batch[i]->arrived).count();
+                if (latencies.size() < SERVE_LATENCY_WINDOW)
+                    latencies.push_back(ms);
+                else
+                    latencies[served % SERVE_LATENCY_WINDOW] = ms;
+                served++;
+                batch[i]->done = true;
+            }
+        }
+        answered.notify_all();
+    }
+}
+
+bool ScoreServer::parse(const char* line, foldin_doc& doc, string& error) {
+    char* end;
+    doc.id = 0;
+    doc.entity = strtol(line, &end, 10);
+    if (end == line) {
+        error = "expected: entity date term:count ...";
+        return false;
+    }
+    line = end;
+    doc.date = strtol(line, &end, 10);
+    if (end == line || doc.date < 0) {
+        error = "expected: entity date term:count ...";
+        return false;
+    }
+    line = end;
+
+    while (true) {
+        while (*line == ' ' || *line == '\t' || *line == '\r')
+            line++;
+        if (*line == '\0')
+            break;
+        int term = hash_term(strtoull(line, &end, 10), settings->hash_terms);
+        if (end == line || *end != ':') {
+            error = "expected term:count pairs";
+            return false;
+        }
+        line = end + 1;
+        int count = strtol(line, &end, 10);
+        if (end == line) {
+            error = "expected term:count pairs";
+            return false;
+        }
+        line = end;
+        if (count > 0) {
+            doc.terms.push_back(term);
+            doc.counts.push_back(count);
+        }
+    }
+    return true;
+}
+
+string ScoreServer::format(const foldin_doc& doc, const foldin_result& result) {
+    string out;
+    appendf(out, "ok\t%d\t%g", result.iterations, result.event_score);
+
+    if (settings->incl_topics) {
+        out += "\ttheta";
+        for (int k = 0; k < settings->k; k++)
+            appendf(out, " %g", result.theta(k));
+    }
+    if (settings->incl_entity)
+        appendf(out, "\tzeta %g", result.zeta);
+    if (settings->incl_events) {
+        out += "\tepsilon";
+        for (int lag = 0; lag < settings->event_dur && lag <= doc.date; lag++) {
+            if (result.epsilon(lag) == 0)
+                continue;
+            appendf(out, " %d:%g", doc.date - lag, result.epsilon(lag));
+        }
+    }
+
+    out += "\tpredict";
+    for (size_t i = 0; i < doc.terms.size(); i++) {
+        appendf(out, " %d:%g", doc.terms[i], model->predict(doc, result, doc.terms[i]));
+    }
+    out += "\n";
+    return out;
+}
+
+long ScoreServer::request_count() {
+    unique_lock<mutex> guard(lock);
+    return served;
+}
+
+double ScoreServer::percentile(double p) {
+    vector<double> recent;
+    {
+        unique_lock<mutex> guard(lock);
+        recent = latencies;
+    }
+    return percentile_of(recent, p);
+}
+
+static int connect_to(string path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0) {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+bool load_test(string path, int requests, int clients, int terms,
+               int n_terms, int n_entities, int n_dates, long seed,
+               double p50_target, double p99_target) {
+    clients = max(1, clients);
+    vector<vector<double> > latency(clients);
+    vector<int> errors(clients, 0);
+    vector<thread> workers;
+
+    serve_clock::time_point start = serve_clock::now();
+    for (int c = 0; c < clients; c++) {
+        workers.push_back(thread([&, c]() {
+            int fd = connect_to(path);
+            if (fd < 0) {
+                errors[c] = requests / clients;
+                return;
+            }
+            gsl_rng* rand_gen = gsl_rng_alloc(gsl_rng_taus);
+            gsl_rng_set(rand_gen, seed + c);
+
+            string buffer, line;
+            for (int i = c; i < requests; i += clients) {
+                // a random document over the model's vocabulary, entities, and dates
+                string request;
+                appendf(request, "%lu %lu", gsl_rng_uniform_int(rand_gen, max(1, n_entities)),
+                    gsl_rng_uniform_int(rand_gen, max(1, n_dates)));
+                for (int j = 0; j < terms; j++) {
+                    appendf(request, " %lu:%lu", gsl_rng_uniform_int(rand_gen, max(1, n_terms)),
+                        1 + gsl_rng_uniform_int(rand_gen, 3));
+                }
+                request += "\n";
+
+                serve_clock::time_point sent = serve_clock::now();
+                if (!write_all(fd, request) || !read_line(fd, buffer, line)) {
+                    errors[c]++;
+                    break;
+                }
+                latency[c].push_back(chrono::duration<double, milli>(serve_clock::now() - sent).count());
+                if (line.compare(0, 2, "ok") != 0)
+                    errors[c]++;
+            }
+
+            gsl_rng_free(rand_gen);
+            close(fd);
+        }));
+    }
+    for (int c = 0; c < clients; c++)
+        workers[c].join();
+    double seconds = chrono::duration<double>(serve_clock::now() - start).count();
+
+    vector<double> all;
+    int failed = 0;
+    for (int c = 0; c < clients; c++) {
+        all.insert(all.end(), latency[c].begin(), latency[c].end());
+        failed += errors[c];
+    }
+    double p50 = percentile_of(all, 0.5);
+    double p99 = percentile_of(all, 0.99);
+
+    printf("load test: %d requests from %d clients, %d terms each\n", requests, clients, terms);
+    printf("\tcompleted:  %d (%d errors)\n", (int) all.size(), failed);
+    printf("\tthroughput: %.0f requests/s\n", seconds > 0 ? all.size() / seconds : 0.0);
+    printf("\tp50:        %.3f ms (target %.3f ms)\n", p50, p50_target);
+    printf("\tp99:        %.3f ms (target %.3f ms)\n", p99, p99_target);
+
+    bool met = failed == 0 && p50 <= p50_target && p99 <= p99_target;
+    printf("\ttargets %s\n", met ? "met" : "missed");
+    return met;
+}
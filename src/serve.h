@@ -0,0 +1,95 @@
+#ifndef SERVE_H
+#define SERVE_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+#include "foldin.h"
+
+using namespace std;
+
+// latencies kept for the p50/p99 report
+#define SERVE_LATENCY_WINDOW 10000
+
+typedef chrono::steady_clock serve_clock;
+
+// one scoring request, waiting in the batch queue
+struct score_request {
+    foldin_doc doc;
+    serve_clock::time_point arrived;
+    string response;
+    bool done;
+};
+
+// A local scoring daemon: documents arrive over a Unix-domain socket and are
+// folded in against a fitted model.
+//
+// Protocol: one request per line, "entity date term:count term:count ...",
+// answered by one tab-separated line
+//   ok  iterations  event_score  theta v ...  zeta v  epsilon date:v ...
+//   predict term:v ...
+// or "error <message>".  The line "stats" returns the request count and the
+// p50/p99 latency (ms) of recent requests.
+//
+// Each connection has its own thread; requests from all connections are
+// queued and a single batcher folds them in together, up to max_batch at a
+// time, waiting at most max_wait_us after the first one arrives for a batch
+// to fill.  Batching shares the table of beta's expected logs, and the batch
+// itself runs in parallel.
+class ScoreServer {
+    private:
+        FoldIn* model;
+        model_settings* settings;
+
+        string socket_path;
+        int listen_fd;
+        int max_batch;
+        int max_wait_us;
+        int max_iter;
+        double converge;
+
+        mutex lock;
+        condition_variable queued;
+        condition_variable answered;
+        condition_variable closed;
+        deque<score_request*> queue;
+        bool stopping;
+
+        thread acceptor;
+        thread batcher;
+        vector<int> connection_fds;   // one per live connection thread
+
+        vector<double> latencies;   // ms, a ring of the most recent
+        long served;
+
+        void accept_loop();
+        void serve_connection(int fd);
+        void batch_loop();
+        bool parse(const char* line, foldin_doc& doc, string& error);
+        string format(const foldin_doc& doc, const foldin_result& result);
+
+    public:
+        ScoreServer(FoldIn* fitted, model_settings* model_set, string path,
+                    int batch, int wait_us, int iterations, double delta);
+        ~ScoreServer();
+
+        bool start();
+        void stop();
+
+        long request_count();
+        double percentile(double p);
+};
+
+// Load generator: `clients` connections send `requests` random documents of
+// `terms` terms in total; prints throughput and p50/p99 latency and returns
+// whether both are within their targets (ms).
+bool load_test(string path, int requests, int clients, int terms,
+               int n_terms, int n_entities, int n_dates, long seed,
+               double p50_target, double p99_target);
+
+#endif
@@ -0,0 +1,198 @@
+#include <getopt.h>
+#include <signal.h>
+#include <omp.h>
+#include "serve.h"
+
+#include <stdio.h>
+
+void print_usage_and_exit() {
+    // print usage information
+    printf("************************* Capsule Scoring Server **************************\n");
+    printf("Folds documents sent over a Unix-domain socket into a fitted Capsule\n");
+    printf("model and returns their local parameters and per-term predictions.\n");
+
+    printf("\nusage:\n");
+    printf(" capsule-serve [options]\n");
+    printf("  --help            print help information\n");
+
+    printf("\n");
+    printf("  --model {dir}     fitted model directory (with model.txt and binary\n");
+    printf("                    parameter files), required\n");
+    printf("  --label {label}   which saved parameters to use; default 'final'\n");
+    printf("  --socket {path}   Unix-domain socket to listen on, required\n");
+
+    printf("\n");
+    printf("  --batch {n}       max documents folded in together, default 32\n");
+    printf("  --wait {us}       max wait for a batch to fill, in microseconds;\n");
+    printf("                    default 500\n");
+    printf("  --max_iter {max}  the max number of local iterations per document,\n");
+    printf("                    default 50\n");
+    printf("  --converge {c}    the relative change in the local means required for\n");
+    printf("                    convergence, default 1e-4\n");
+    printf("  --threads {n}     number of threads per batch; default all available\n");
+
+    printf("\n");
+    printf("  --load {n}        run the built-in load generator with n requests\n");
+    printf("                    against this server, report, and exit\n");
+    printf("  --clients {c}     concurrent load generator connections, default 8\n");
+    printf("  --load_terms {t}  terms per generated document, default 50\n");
+    printf("  --p50 {ms}        p50 latency target, default 5\n");
+    printf("  --p99 {ms}        p99 latency target, default 50\n");
+    printf("  --seed {seed}     load generator random seed, default 1\n");
+
+    printf("********************************************************************************\n");
+
+    exit(0);
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) print_usage_and_exit();
+
+    string model = "";
+    string label = "final";
+    string socket_path = "";
+    int batch = 32;
+    int wait_us = 500;
+    int max_iter = 50;
+    double converge = 1e-4;
+    int threads = 0;
+
+    int load = 0;
+    int clients = 8;
+    int load_terms = 50;
+    double p50 = 5;
+    double p99 = 50;
+    long seed = 1;
+
+    int opt;
+    const char* const short_options = "hM:l:S:b:w:i:c:t:L:C:T:5:9:s:";
+    const struct option long_options[] = {
+        {"help",            no_argument,       NULL, 'h'},
+        {"model",           required_argument, NULL, 'M'},
+        {"label",           required_argument, NULL, 'l'},
+        {"socket",          required_argument, NULL, 'S'},
+        {"batch",           required_argument, NULL, 'b'},
+        {"wait",            required_argument, NULL, 'w'},
+        {"max_iter",        required_argument, NULL, 'i'},
+        {"converge",        required_argument, NULL, 'c'},
+        {"threads",         required_argument, NULL, 't'},
+        {"load",            required_argument, NULL, 'L'},
+        {"clients",         required_argument, NULL, 'C'},
+        {"load_terms",      required_argument, NULL, 'T'},
+        {"p50",             required_argument, NULL, '5'},
+        {"p99",             required_argument, NULL, '9'},
+        {"seed",            required_argument, NULL, 's'},
+        {NULL, 0, NULL, 0}};
+
+    while (true) {
+        opt = getopt_long(argc, argv, short_options, long_options, NULL);
+        switch (opt) {
+            case 'h':
+                print_usage_and_exit();
+                break;
+            case 'M':
+                model = optarg;
+                break;
+            case 'l':
+                label = optarg;
+                break;
+            case 'S':
+                socket_path = optarg;
+                break;
+            case 'b':
+                batch = atoi(optarg);
+                break;
+            case 'w':
+                wait_us = atoi(optarg);
+                break;
+            case 'i':
+                max_iter = atoi(optarg);
+                break;
+            case 'c':
+                converge = atof(optarg);
+                break;
+            case 't':
+                threads = atoi(optarg);
+                break;
+            case 'L':
+                load = atoi(optarg);
+                break;
+            case 'C':
+                clients = atoi(optarg);
+                break;
+            case 'T':
+                load_terms = atoi(optarg);
+                break;
+            case '5':
+                p50 = atof(optarg);
+                break;
+            case '9':
+                p99 = atof(optarg);
+                break;
+            case 's':
+                seed = atol(optarg);
+                break;
+            case -1:
+                break;
+            case '?':
+                print_usage_and_exit();
+                break;
+            default:
+                break;
+        }
+        if (opt == -1)
+            break;
+    }
+
+    if (model == "" || socket_path == "") {
+        printf("--model and --socket are required.  Exiting.\n");
+        exit(-1);
+    }
+    if (threads > 0)
+        omp_set_num_threads(threads);
+
+    printf("********************************************************************************\n");
+    printf("loading model from %s (%s)\n", model.c_str(), label.c_str());
+    model_settings settings;
+    if (!settings.load_model(model + "/model.txt")) {
+        printf("model settings file %s/model.txt doesn't exist!  Exiting.\n", model.c_str());
+        exit(-1);
+    }
+    FoldIn foldin(&settings);
+    if (!foldin.load(model, label)) {
+        printf("unable to load the binary parameters (fits saved with --save_text,\n");
+        printf("or with --save_top but not --save_shapes, cannot be served).  Exiting.\n");
+        exit(-1);
+    }
+    printf("\tK = %d, %d terms, %d entities, %d dates\n", settings.k,
+        foldin.term_count(), foldin.entity_count(), foldin.date_count());
+
+    // handle SIGINT/SIGTERM in this thread only: block them before any other
+    // thread starts, then wait for one below
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    ScoreServer server(&foldin, &settings, socket_path, batch, wait_us, max_iter, converge);
+    if (!server.start())
+        exit(-1);
+    printf("listening on %s (batches of up to %d, %d us wait, %d threads)\n",
+        socket_path.c_str(), batch, wait_us, omp_get_max_threads());
+
+    if (load > 0) {
+        bool met = load_test(socket_path, load, clients, load_terms, foldin.term_count(),
+            foldin.entity_count(), foldin.date_count(), seed, p50, p99);
+        server.stop();
+        return met ? 0 : 1;
+    }
+
+    int received;
+    sigwait(&signals, &received);
+    printf("\nshutting down after %ld requests (p50 %.3f ms, p99 %.3f ms)\n",
+        server.request_count(), server.percentile(0.5), server.percentile(0.99));
+    server.stop();
+
+    return 0;
+}
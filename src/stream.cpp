@@ -0,0 +1,216 @@
+#include "stream.h"
+
+EventStream::EventStream(FoldIn* fitted, model_settings* model_set, string out,
+                         int iterations, double delta, int rounds) {
+    model = fitted;
+    settings = model_set;
+    outdir = out;
+    max_iter = iterations;
+    converge = delta;
+    refit_rounds = rounds;
+
+    open_date = -1;
+    n_docs = 0;
+    n_dates = 0;
+
+    strength_file = NULL;
+    psi_file = NULL;
+    pi_file = NULL;
+    epsilon_file = NULL;
+    scores_file = NULL;
+}
+
+EventStream::~EventStream() {
+    FILE* files[] = {strength_file, psi_file, pi_file, epsilon_file, scores_file};
+    for (int i = 0; i < 5; i++) {
+        if (files[i])
+            fclose(files[i]);
+    }
+}
+
+bool EventStream::open() {
+    strength_file = fopen((outdir + "/strength.dat").c_str(), "w");
+    psi_file = fopen((outdir + "/psi.dat").c_str(), "w");
+    pi_file = fopen((outdir + "/pi.dat").c_str(), "w");
+    epsilon_file = fopen((outdir + "/epsilon.dat").c_str(), "w");
+    scores_file = fopen((outdir + "/event_scores.dat").c_str(), "w");
+    if (!strength_file || !psi_file || !pi_file || !epsilon_file || !scores_file) {
+        printf("unable to open the output files in %s\n", outdir.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool EventStream::add(int doc, int entity, int date, int term, int count) {
+    if (date < model->date_count() || date < open_date)
+        return false;
+
+    if (date > open_date) {
+        if (!pending.empty())
+            close_date();
+        open_date = date;
+    }
+
+    map<int, int>::iterator it = pending_index.find(doc);
+    if (it == pending_index.end()) {
+        foldin_doc d;
+        d.id = doc;
+        d.entity = entity;
+        d.date = date;
+        it = pending_index.insert(make_pair(doc, (int) pending.size())).first;
+        pending.push_back(d);
+    }
+    pending[it->second].terms.push_back(term);
+    pending[it->second].counts.push_back(count);
+    return true;
+}
+
+void EventStream::finish() {
+    if (!pending.empty())
+        close_date();
+    while (!window.empty()) {
+        spill(window.front());
+        window.pop_front();
+    }
+    fflush(psi_file);
+    fflush(pi_file);
+}
+
+// psi of a window date, with the statistics of the open date added in
+double EventStream::strength(const stream_date& date, double a_psi, double b_psi) const {
+    return (settings->a_psi + date.a_psi + a_psi) /
+        (settings->b_psi + date.b_psi + b_psi);
+}
+
+// event parameters of the window, from the closed dates' statistics plus the
+// open date's; every cell no document has reached keeps the prior shape
+void EventStream::build_rows(const vector<map<int, double> >& counts,
+                             const vector<double>& a_psi, const vector<double>& b_psi,
+                             event_rows& rows) const {
+    int n = window.size();
+    rows.first = window.front().date;
+    rows.log.assign(n, map<int, float>());
+    rows.default_log.assign(n, 0);
+    rows.total.assign(n, 1);    // the means of a Dirichlet row sum to one
+    rows.psi.assign(n, 0);
+
+    for (int r = 0; r < n; r++) {
+        map<int, double> shape = window[r].pi_counts;
+        for (map<int, double>::const_iterator it = counts[r].begin(); it != counts[r].end(); it++)
+            shape[it->first] += it->second;
+
+        double sum = model->term_count() * settings->a_pi;
+        for (map<int, double>::iterator it = shape.begin(); it != shape.end(); it++)
+            sum += it->second;
+        double psi_sum = gsl_sf_psi(sum);
+
+        for (map<int, double>::iterator it = shape.begin(); it != shape.end(); it++)
+            rows.log[r][it->first] = gsl_sf_psi(settings->a_pi + it->second) - psi_sum;
+        rows.default_log[r] = gsl_sf_psi(settings->a_pi) - psi_sum;
+        rows.psi[r] = strength(window[r], a_psi[r], b_psi[r]);
+    }
+}
+
+void EventStream::close_date() {
+    int date = open_date;
+    int dur = settings->event_dur;
+
+    // slide the window to the dates this date's documents can reach; the
+    // dates left behind are final
+    int start = max(model->date_count(), date - dur + 1);
+    while (!window.empty() && window.front().date < start) {
+        spill(window.front());
+        window.pop_front();
+    }
+    for (int d = window.empty() ? start : window.back().date + 1; d <= date; d++) {
+        stream_date row;
+        row.date = d;
+        row.docs = 0;
+        row.a_psi = 0;
+        row.b_psi = 0;
+        window.push_back(row);
+    }
+
+    // alternate folding in the date's documents with refitting the window's
+    // events from them, until the new date's strength settles
+    int n = window.size();
+    int first = window.front().date;
+    vector<map<int, double> > counts(n);
+    vector<double> a_psi(n), b_psi(n);
+    event_rows rows;
+    vector<foldin_result> results;
+    double previous = 0, current = 0;
+    for (int round = 0; round < refit_rounds; round++) {
+        build_rows(counts, a_psi, b_psi, rows);
+        model->infer(pending, results, max_iter, converge, &rows);
+
+        for (int r = 0; r < n; r++) {
+            counts[r].clear();
+            a_psi[r] = 0;
+            b_psi[r] = 0;
+        }
+        for (size_t i = 0; i < pending.size(); i++) {
+            for (int lag = 0; lag < dur && date - lag >= first; lag++) {
+                int r = date - lag - first;
+                a_psi[r] += settings->a_epsilon;
+                b_psi[r] += results[i].epsilon(lag);
+                for (size_t w = 0; w < pending[i].terms.size(); w++) {
+                    if (results[i].event_counts(lag, w) > 0)
+                        counts[r][pending[i].terms[w]] += results[i].event_counts(lag, w);
+                }
+            }
+        }
+
+        current = strength(window.back(), a_psi[n - 1], b_psi[n - 1]);
+        if (round > 0 && fabs(current - previous) < converge * previous)
+            break;
+        previous = current;
+    }
+
+    for (int r = 0; r < n; r++) {
+        window[r].a_psi += a_psi[r];
+        window[r].b_psi += b_psi[r];
+        for (map<int, double>::iterator it = counts[r].begin(); it != counts[r].end(); it++)
+            window[r].pi_counts[it->first] += it->second;
+    }
+    window.back().docs += pending.size();
+
+    // the alert, as soon as the date closes
+    fprintf(strength_file, "%d\t%e\t%d\n", date, current, (int) pending.size());
+    fflush(strength_file);
+    printf("%d\t%e\t%d\n", date, current, (int) pending.size());
+    fflush(stdout);
+
+    // local parameters are final once their date closes
+    for (size_t i = 0; i < pending.size(); i++) {
+        for (int lag = 0; lag < dur; lag++) {
+            if (results[i].epsilon(lag) == 0)
+                continue;
+            fprintf(epsilon_file, "%d\t%d\t%e\t%e\n", pending[i].id, date - lag,
+                results[i].epsilon(lag), results[i].epsilon(lag) * settings->decay(lag));
+        }
+        fprintf(scores_file, "%d\t%d\t%d\t%e\t%d\n", pending[i].id, pending[i].entity,
+            date, results[i].event_score, results[i].iterations);
+    }
+    fflush(epsilon_file);
+    fflush(scores_file);
+
+    n_docs += pending.size();
+    n_dates++;
+    pending.clear();
+    pending_index.clear();
+}
+
+// final psi and pi of a date no new document can reach: "date psi docs" and
+// "date default term:mean ...", where default is the mean of every other cell
+void EventStream::spill(const stream_date& date) {
+    fprintf(psi_file, "%d\t%e\t%d\n", date.date, strength(date, 0, 0), date.docs);
+
+    double sum = model->term_count() * settings->a_pi;
+    for (map<int, double>::const_iterator it = date.pi_counts.begin(); it != date.pi_counts.end(); it++)
+        sum += it->second;
+    fprintf(pi_file, "%d\t%e", date.date, settings->a_pi / sum);
+    for (map<int, double>::const_iterator it = date.pi_counts.begin(); it != date.pi_counts.end(); it++)
+        fprintf(pi_file, "\t%d:%e", it->first, (settings->a_pi + it->second) / sum);
+    fprintf(pi_file, "\n");
+}
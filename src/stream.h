@@ -0,0 +1,83 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+
+#include "foldin.h"
+
+using namespace std;
+
+// one date in the stream's window, with the statistics its event parameters
+// have gathered from the documents of closed dates
+struct stream_date {
+    int date;
+    int docs;
+    map<int, double> pi_counts;   // expected term counts from this event
+    double a_psi;                 // sums of a_epsilon and of epsilon
+    double b_psi;
+};
+
+// Streaming event monitor: documents arrive grouped by date, after the dates
+// of a fitted model, and each date's event strength psi is reported as soon
+// as the date closes (when the first document of a later date arrives).
+//
+// Topics and entities are held fixed at the fitted values.  A closing date's
+// documents are folded in against the fitted events and the stream's own
+// events of the last event_dur dates, whose pi and psi are refit from those
+// documents plus the statistics of earlier closed dates, a few rounds at a
+// time.  A date that falls out of the window can no longer be reached by
+// new documents, so its final pi and psi are spilled to disk and dropped:
+// memory stays bounded by the window, however long the stream runs.
+class EventStream {
+    private:
+        FoldIn* model;
+        model_settings* settings;
+
+        string outdir;
+        int max_iter;
+        double converge;
+        int refit_rounds;
+
+        deque<stream_date> window;
+        vector<foldin_doc> pending;     // documents of the open date
+        map<int, int> pending_index;    // doc id -> position in pending
+        int open_date;
+
+        long n_docs;
+        int n_dates;
+
+        FILE* strength_file;
+        FILE* psi_file;
+        FILE* pi_file;
+        FILE* epsilon_file;
+        FILE* scores_file;
+
+        void build_rows(const vector<map<int, double> >& counts,
+                        const vector<double>& a_psi, const vector<double>& b_psi,
+                        event_rows& rows) const;
+        double strength(const stream_date& date, double a_psi, double b_psi) const;
+        void close_date();
+        void spill(const stream_date& date);
+
+    public:
+        EventStream(FoldIn* fitted, model_settings* model_set, string out,
+                    int iterations, double delta, int rounds);
+        ~EventStream();
+
+        bool open();
+
+        // one doc-term count; false if its date is before the open date or
+        // one the model was fitted on
+        bool add(int doc, int entity, int date, int term, int count);
+
+        // close the open date and spill the window
+        void finish();
+
+        long doc_count() const { return n_docs; }
+        int date_count() const { return n_dates; }
+};
+
+#endif
@@ -0,0 +1,165 @@
+#include <getopt.h>
+#include <omp.h>
+#include "stream.h"
+
+#include <stdio.h>
+
+void print_usage_and_exit() {
+    // print usage information
+    printf("************************ Capsule Event Stream Monitor ***********************\n");
+    printf("Reads documents grouped by date after a fitted Capsule model's dates and\n");
+    printf("reports each date's event strength (psi) as soon as the date closes.\n");
+
+    printf("\nusage:\n");
+    printf(" capsule-stream [options]\n");
+    printf("  --help            print help information\n");
+
+    printf("\n");
+    printf("  --model {dir}     fitted model directory (with model.txt and binary\n");
+    printf("                    parameter files), required\n");
+    printf("  --label {label}   which saved parameters to use; default 'final'\n");
+    printf("  --input {file}    file or named pipe of (doc, entity, date, term, count)\n");
+    printf("                    lines with non-decreasing dates; default stdin\n");
+    printf("  --out {dir}       save directory, required\n");
+
+    printf("\n");
+    printf("  --max_iter {max}  the max number of local iterations per document,\n");
+    printf("                    default 100\n");
+    printf("  --converge {c}    the relative change in the local means (and in the\n");
+    printf("                    date's strength) required for convergence, default 1e-4\n");
+    printf("  --rounds {r}      max rounds of refitting a closing date's events,\n");
+    printf("                    default 10\n");
+    printf("  --threads {n}     number of threads; default all available\n");
+
+    printf("********************************************************************************\n");
+
+    exit(0);
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) print_usage_and_exit();
+
+    string model = "";
+    string label = "final";
+    string input = "";
+    string out = "";
+    int max_iter = 100;
+    double converge = 1e-4;
+    int rounds = 10;
+    int threads = 0;
+
+    int opt;
+    const char* const short_options = "hM:l:I:o:i:c:r:t:";
+    const struct option long_options[] = {
+        {"help",            no_argument,       NULL, 'h'},
+        {"model",           required_argument, NULL, 'M'},
+        {"label",           required_argument, NULL, 'l'},
+        {"input",           required_argument, NULL, 'I'},
+        {"out",             required_argument, NULL, 'o'},
+        {"max_iter",        required_argument, NULL, 'i'},
+        {"converge",        required_argument, NULL, 'c'},
+        {"rounds",          required_argument, NULL, 'r'},
+        {"threads",         required_argument, NULL, 't'},
+        {NULL, 0, NULL, 0}};
+
+    while (true) {
+        opt = getopt_long(argc, argv, short_options, long_options, NULL);
+        switch (opt) {
+            case 'h':
+                print_usage_and_exit();
+                break;
+            case 'M':
+                model = optarg;
+                break;
+            case 'l':
+                label = optarg;
+                break;
+            case 'I':
+                input = optarg;
+                break;
+            case 'o':
+                out = optarg;
+                break;
+            case 'i':
+                max_iter = atoi(optarg);
+                break;
+            case 'c':
+                converge = atof(optarg);
+                break;
+            case 'r':
+                rounds = atoi(optarg);
+                break;
+            case 't':
+                threads = atoi(optarg);
+                break;
+            case -1:
+                break;
+            case '?':
+                print_usage_and_exit();
+                break;
+            default:
+                break;
+        }
+        if (opt == -1)
+            break;
+    }
+
+    if (model == "" || out == "") {
+        printf("--model and --out are required.  Exiting.\n");
+        exit(-1);
+    }
+    if (input != "" && !file_exists(input)) {
+        printf("input %s doesn't exist!  Exiting.\n", input.c_str());
+        exit(-1);
+    }
+    if (!dir_exists(out))
+        make_directory(out);
+    if (threads > 0)
+        omp_set_num_threads(threads);
+
+    printf("********************************************************************************\n");
+    printf("loading model from %s (%s)\n", model.c_str(), label.c_str());
+    model_settings settings;
+    if (!settings.load_model(model + "/model.txt")) {
+        printf("model settings file %s/model.txt doesn't exist!  Exiting.\n", model.c_str());
+        exit(-1);
+    }
+    if (!settings.incl_events) {
+        printf("the model has no event factors to monitor.  Exiting.\n");
+        exit(-1);
+    }
+    FoldIn foldin(&settings);
+    if (!foldin.load(model, label)) {
+        printf("unable to load the binary parameters (fits saved with --save_text,\n");
+        printf("or with --save_top but not --save_shapes, cannot be streamed).  Exiting.\n");
+        exit(-1);
+    }
+    printf("\tK = %d, %d terms, %d entities, %d dates\n", settings.k,
+        foldin.term_count(), foldin.entity_count(), foldin.date_count());
+
+    EventStream stream(&foldin, &settings, out, max_iter, converge, rounds);
+    if (!stream.open())
+        exit(-1);
+
+    // one "date  strength  docs" line per closed date follows
+    printf("streaming from %s\n", input == "" ? "stdin" : input.c_str());
+    fflush(stdout);
+    FILE* fileptr = input == "" ? stdin : fopen(input.c_str(), "r");
+    int doc, entity, date, count;
+    unsigned long long term;
+    long skipped = 0;
+    while (fscanf(fileptr, "%d\t%d\t%d\t%llu\t%d\n", &doc, &entity, &date, &term, &count) == 5) {
+        if (count == 0 || !stream.add(doc, entity, date, hash_term(term, settings.hash_terms), count))
+            skipped++;
+    }
+    if (fileptr != stdin)
+        fclose(fileptr);
+    stream.finish();
+
+    printf("end of stream: %ld documents on %d dates", stream.doc_count(), stream.date_count());
+    if (skipped > 0)
+        printf(" (skipped %ld counts: zero, out of date order, or on fitted dates)", skipped);
+    printf("\n");
+
+    return 0;
+}
@@ -33,6 +33,18 @@ void remove_directory(string name) {
   rmdir(name.c_str());
 }
 
+int hash_term(unsigned long long id, int n) {
+    if (n <= 0)
+        return (int) id;
+    // splitmix64's finalizer: consecutive ids land in unrelated buckets
+    id ^= id >> 30;
+    id *= 0xbf58476d1ce4e5b9ULL;
+    id ^= id >> 27;
+    id *= 0x94d049bb133111ebULL;
+    id ^= id >> 31;
+    return (int) (id % n);
+}
+
 double factorial(int x) {
     if (x == 0)
         return 1;
@@ -4,6 +4,7 @@
 using namespace std;
 #include <string>
 #include <sys/stat.h>
+#include <unistd.h>
 
 
 /*
@@ -115,6 +116,10 @@ void make_directory(string name);
 void remove_directory(string name);
 
 double factorial(int x);
+
+// the bucket of a (64-bit, e.g. hashed upstream) input term id among n, or
+// the id itself when n is 0
+int hash_term(unsigned long long id, int n);
 /*
 double  digamma(double x);
 unsigned int rmultinomial(const gsl_vector* v);
@@ -0,0 +1,314 @@
+#include "writer.h"
+#include <string.h>
+#include <algorithm>
+
+float sparse_rows::at(uword row, uword col) const {
+    const int* first = col_idx.data() + row_ptr[row];
+    const int* last = col_idx.data() + row_ptr[row+1];
+    const int* pos = lower_bound(first, last, (int) col);
+    if (pos != last && *pos == (int) col)
+        return values(pos - col_idx.data());
+    return defaults(row);
+}
+
+static FILE* open_binary(string filename, uint32_t type, uint64_t rows, uint64_t cols) {
+    FILE* file = fopen(filename.c_str(), "wb");
+    if (!file) {
+        printf("unable to open %s for writing\n", filename.c_str());
+        return NULL;
+    }
+
+    bin_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CAPSULE_BIN_MAGIC, 4);
+    header.version = CAPSULE_BIN_VERSION;
+    header.type = type;
+    header.rows = rows;
+    header.cols = cols;
+    if (fwrite(&header, sizeof(header), 1, file) != 1) {
+        printf("unable to write %s\n", filename.c_str());
+        fclose(file);
+        return NULL;
+    }
+
+    return file;
+}
+
+bool close_written(FILE* file, string filename, bool ok) {
+    ok = !ferror(file) && ok;
+    if (fclose(file) != 0)
+        ok = false;
+    if (!ok)
+        printf("unable to write %s\n", filename.c_str());
+    return ok;
+}
+
+bool write_text_file(string filename, function<void(FILE*)> body) {
+    FILE* file = fopen(filename.c_str(), "w");
+    if (!file) {
+        printf("unable to open %s for writing\n", filename.c_str());
+        return false;
+    }
+    body(file);
+    return close_written(file, filename);
+}
+
+bool write_binary(string filename, const fmat& m) {
+    FILE* file = open_binary(filename, CAPSULE_BIN_DENSE, m.n_rows, m.n_cols);
+    if (!file)
+        return false;
+    size_t written = fwrite(m.memptr(), sizeof(float), m.n_elem, file);
+    return close_written(file, filename, written == m.n_elem);
+}
+
+bool write_binary(string filename, const fvec& v) {
+    FILE* file = open_binary(filename, CAPSULE_BIN_DENSE, v.n_elem, 1);
+    if (!file)
+        return false;
+    size_t written = fwrite(v.memptr(), sizeof(float), v.n_elem, file);
+    return close_written(file, filename, written == v.n_elem);
+}
+
+bool write_binary(string filename, const vector<event_record>& events) {
+    FILE* file = open_binary(filename, CAPSULE_BIN_EVENTS, events.size(), 4);
+    if (!file)
+        return false;
+    size_t written = fwrite(events.data(), sizeof(event_record), events.size(), file);
+    return close_written(file, filename, written == events.size());
+}
+
+bool write_binary(string filename, const fvec& residual,
+                  const vector<top_entry>& top, int n) {
+    FILE* file = open_binary(filename, CAPSULE_BIN_TOP, residual.n_elem, n);
+    if (!file)
+        return false;
+    size_t written = 0;
+    for (uword r = 0; r < residual.n_elem; r++) {
+        float res = residual(r);
+        written += fwrite(&res, sizeof(float), 1, file);
+        written += fwrite(&top[r * n], sizeof(top_entry), n, file);
+    }
+    return close_written(file, filename, written == residual.n_elem * (n + 1));
+}
+
+bool write_binary(string filename, const sparse_rows& m) {
+    FILE* file = open_binary(filename, CAPSULE_BIN_SPARSE, m.rows, m.cols);
+    if (!file)
+        return false;
+    uint64_t nnz = m.col_idx.size();
+    bool ok = fwrite(&nnz, sizeof(uint64_t), 1, file) == 1;
+    ok = ok && fwrite(m.row_ptr.data(), sizeof(uword), m.rows + 1, file) == m.rows + 1;
+    ok = ok && fwrite(m.col_idx.data(), sizeof(int), nnz, file) == nnz;
+    ok = ok && fwrite(m.values.memptr(), sizeof(float), nnz, file) == nnz;
+    ok = ok && fwrite(m.defaults.memptr(), sizeof(float), m.rows, file) == m.rows;
+    return close_written(file, filename, ok);
+}
+
+static FILE* open_binary(string filename, uint32_t type, bin_header& header) {
+    FILE* file = fopen(filename.c_str(), "rb");
+    if (!file) {
+        printf("unable to open %s for reading\n", filename.c_str());
+        return NULL;
+    }
+
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        memcmp(header.magic, CAPSULE_BIN_MAGIC, 4) != 0 ||
+        header.version != CAPSULE_BIN_VERSION || header.type != type) {
+        printf("%s is not a binary parameter file of the expected type\n", filename.c_str());
+        fclose(file);
+        return NULL;
+    }
+
+    return file;
+}
+
+bool read_binary(string filename, fmat& m) {
+    bin_header header;
+    FILE* file = open_binary(filename, CAPSULE_BIN_DENSE, header);
+    if (!file)
+        return false;
+    m = fmat(header.rows, header.cols);
+    size_t read = fread(m.memptr(), sizeof(float), m.n_elem, file);
+    fclose(file);
+    return read == m.n_elem;
+}
+
+bool read_binary(string filename, fvec& v) {
+    bin_header header;
+    FILE* file = open_binary(filename, CAPSULE_BIN_DENSE, header);
+    if (!file)
+        return false;
+    v = fvec(header.rows * header.cols);
+    size_t read = fread(v.memptr(), sizeof(float), v.n_elem, file);
+    fclose(file);
+    return read == v.n_elem;
+}
+
+bool read_binary(string filename, sparse_rows& m) {
+    bin_header header;
+    FILE* file = open_binary(filename, CAPSULE_BIN_SPARSE, header);
+    if (!file)
+        return false;
+    m.rows = header.rows;
+    m.cols = header.cols;
+    uint64_t nnz = 0;
+    bool ok = fread(&nnz, sizeof(uint64_t), 1, file) == 1;
+    m.row_ptr.resize(m.rows + 1);
+    m.col_idx.resize(nnz);
+    m.values = fvec(nnz);
+    m.defaults = fvec(m.rows);
+    ok = ok && fread(m.row_ptr.data(), sizeof(uword), m.rows + 1, file) == m.rows + 1;
+    ok = ok && fread(m.col_idx.data(), sizeof(int), nnz, file) == nnz;
+    ok = ok && fread(m.values.memptr(), sizeof(float), nnz, file) == nnz;
+    ok = ok && fread(m.defaults.memptr(), sizeof(float), m.rows, file) == m.rows;
+    fclose(file);
+    return ok;
+}
+
+bool read_binary(string filename, vector<event_record>& events) {
+    bin_header header;
+    FILE* file = open_binary(filename, CAPSULE_BIN_EVENTS, header);
+    if (!file)
+        return false;
+    events.resize(header.rows);
+    size_t read = fread(events.data(), sizeof(event_record), events.size(), file);
+    fclose(file);
+    return read == events.size();
+}
+
+MappedParams::MappedParams() {
+    base = NULL;
+    length = 0;
+    memset(&header, 0, sizeof(header));
+}
+
+MappedParams::~MappedParams() {
+    close();
+}
+
+bool MappedParams::open(string filename, uint32_t type) {
+    close();
+
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        printf("unable to open %s for reading\n", filename.c_str());
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (size_t) info.st_size < sizeof(bin_header)) {
+        printf("%s is too short to be a binary parameter file\n", filename.c_str());
+        ::close(fd);
+        return false;
+    }
+
+    length = info.st_size;
+    base = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (base == MAP_FAILED) {
+        printf("unable to map %s\n", filename.c_str());
+        base = NULL;
+        return false;
+    }
+
+    memcpy(&header, base, sizeof(header));
+    size_t expected = sizeof(bin_header);
+    if (type == CAPSULE_BIN_DENSE)
+        expected += header.rows * header.cols * sizeof(float);
+    else if (type == CAPSULE_BIN_SPARSE && length >= expected + sizeof(uint64_t))
+        expected += sizeof(uint64_t) + (header.rows + 1) * sizeof(uword) +
+            nnz() * (sizeof(int) + sizeof(float)) + header.rows * sizeof(float);
+    if (memcmp(header.magic, CAPSULE_BIN_MAGIC, 4) != 0 ||
+        header.version != CAPSULE_BIN_VERSION || header.type != type ||
+        length < expected) {
+        printf("%s is not a binary parameter file of the expected type\n", filename.c_str());
+        close();
+        return false;
+    }
+    return true;
+}
+
+void MappedParams::close() {
+    if (base)
+        munmap(base, length);
+    base = NULL;
+    length = 0;
+}
+
+float* MappedParams::dense() const {
+    return (float*) ((char*) base + sizeof(bin_header));
+}
+
+uint64_t MappedParams::nnz() const {
+    return *(uint64_t*) ((char*) base + sizeof(bin_header));
+}
+
+uword* MappedParams::row_ptr() const {
+    return (uword*) ((char*) base + sizeof(bin_header) + sizeof(uint64_t));
+}
+
+int* MappedParams::col_idx() const {
+    return (int*) (row_ptr() + header.rows + 1);
+}
+
+float* MappedParams::values() const {
+    return (float*) (col_idx() + nnz());
+}
+
+float* MappedParams::defaults() const {
+    return values() + nnz();
+}
+
+ParamWriter::ParamWriter() {
+    pending = false;
+    busy = false;
+    stopping = false;
+    worker = thread(&ParamWriter::run, this);
+}
+
+ParamWriter::~ParamWriter() {
+    flush();
+    {
+        unique_lock<mutex> guard(lock);
+        stopping = true;
+    }
+    cond.notify_all();
+    worker.join();
+}
+
+void ParamWriter::run() {
+    while (true) {
+        function<void()> task;
+        {
+            unique_lock<mutex> guard(lock);
+            cond.wait(guard, [this] { return pending || stopping; });
+            if (!pending && stopping)
+                return;
+            task = job;
+            job = NULL;
+            pending = false;
+            busy = true;
+        }
+
+        task();
+
+        {
+            unique_lock<mutex> guard(lock);
+            busy = false;
+        }
+        cond.notify_all();
+    }
+}
+
+void ParamWriter::submit(function<void()> task) {
+    unique_lock<mutex> guard(lock);
+    cond.wait(guard, [this] { return !pending && !busy; });
+    job = task;
+    pending = true;
+    guard.unlock();
+    cond.notify_all();
+}
+
+void ParamWriter::flush() {
+    unique_lock<mutex> guard(lock);
+    cond.wait(guard, [this] { return !pending && !busy; });
+}
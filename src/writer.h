@@ -0,0 +1,148 @@
+#ifndef WRITER_H
+#define WRITER_H
+
+#include <string>
+#include <stdio.h>
+#include <stdint.h>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define ARMA_64BIT_WORD
+#include <armadillo>
+
+using namespace std;
+using namespace arma;
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "binary parameter files are little-endian; big-endian hosts are not supported"
+#endif
+
+// binary parameter files: a 32-byte header followed by raw float32 data
+//   dense:   rows x cols floats, column-major (as stored by Armadillo)
+//   events:  rows records of (int32 doc, int32 date, float val, float decayed)
+//   top:     rows records of (float residual, cols x (int32 term, float weight))
+//   sparse:  uint64 nnz, uint64 row_ptr[rows+1], int32 col[nnz], float val[nnz],
+//            float default[rows] (the value of every cell not listed in a row)
+#define CAPSULE_BIN_MAGIC   "CAPS"
+#define CAPSULE_BIN_VERSION 1
+#define CAPSULE_BIN_DENSE   0
+#define CAPSULE_BIN_EVENTS  1
+#define CAPSULE_BIN_TOP     2
+#define CAPSULE_BIN_SPARSE  3
+
+struct bin_header {
+    char     magic[4];
+    uint32_t version;
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t rows;
+    uint64_t cols;
+};
+
+struct event_record {
+    int32_t doc;
+    int32_t date;
+    float   val;
+    float   decayed;
+};
+
+// one of a row's top-N terms; rows with fewer than N terms are padded with
+// term -1 and weight 0
+struct top_entry {
+    int32_t term;
+    float   weight;
+};
+
+// rows with a default value plus explicitly stored cells, in CSR layout
+struct sparse_rows {
+    uword rows;
+    uword cols;
+    vector<uword> row_ptr;
+    vector<int> col_idx;
+    fvec values;
+    fvec defaults;
+
+    float at(uword row, uword col) const;
+};
+
+bool write_binary(string filename, const fmat& m);
+bool write_binary(string filename, const fvec& v);
+bool write_binary(string filename, const vector<event_record>& events);
+bool write_binary(string filename, const fvec& residual,
+                  const vector<top_entry>& top, int n);
+bool write_binary(string filename, const sparse_rows& m);
+
+// closes a file written to, and whether all went well: ok (the writes'
+// results), no stream error, and a clean fclose; a failure is reported
+bool close_written(FILE* file, string filename, bool ok = true);
+
+// a text file: opened, filled in by body, and closed; false (with a
+// message) if it cannot be opened or written
+bool write_text_file(string filename, function<void(FILE*)> body);
+
+// readers for the dense and sparse files above; false (with a message) if
+// the file is missing, truncated, or of another type
+bool read_binary(string filename, fmat& m);
+bool read_binary(string filename, fvec& v);
+bool read_binary(string filename, sparse_rows& m);
+bool read_binary(string filename, vector<event_record>& events);
+
+// A binary parameter file mapped read-only into memory, so processes serving
+// the same model share its pages and only touched pages are loaded.  The
+// accessors point into the mapping, which lives as long as this object.
+class MappedParams {
+    private:
+        void* base;
+        size_t length;
+
+        MappedParams(const MappedParams&);
+        MappedParams& operator=(const MappedParams&);
+
+    public:
+        bin_header header;
+
+        MappedParams();
+        ~MappedParams();
+        bool open(string filename, uint32_t type);
+        void close();
+
+        // dense: rows x cols floats, column-major
+        float* dense() const;
+
+        // sparse: the CSR arrays and each row's default
+        uint64_t nnz() const;
+        uword* row_ptr() const;
+        int* col_idx() const;
+        float* values() const;
+        float* defaults() const;
+};
+
+// Runs parameter saves on a background thread so the training loop only pays
+// for taking a snapshot.  At most one save is in flight: submitting a new job
+// waits for the previous one, which bounds snapshot memory to a single copy.
+class ParamWriter {
+    private:
+        thread worker;
+        mutex lock;
+        condition_variable cond;
+        function<void()> job;
+        bool pending;
+        bool busy;
+        bool stopping;
+
+        void run();
+
+    public:
+        ParamWriter();
+        ~ParamWriter();
+        void submit(function<void()> task);
+        void flush();
+};
+
+#endif